@@ -180,6 +180,13 @@ CONFIG_XENBUS ?= y
 CONFIG_XC ?=y
 CONFIG_LWIP ?= $(lwip)
 CONFIG_BALLOON ?= n
+CONFIG_DEFERRED_MEM ?= n
+CONFIG_PREEMPT ?= n
+CONFIG_SMP ?= n
+# Setting CONFIG_COW_FAULT_AROUND populates the following zero-page mappings
+# too on a copy-on-write fault, for applications filling zeroed memory
+# sequentially.
+CONFIG_COW_FAULT_AROUND ?= n
 # Setting CONFIG_USE_XEN_CONSOLE copies all print output to the Xen emergency
 # console apart of standard dom0 handled console.
 CONFIG_USE_XEN_CONSOLE ?= n
@@ -200,6 +207,10 @@ DEFINES-$(CONFIG_FBFRONT) += -DCONFIG_FBFRONT
 DEFINES-$(CONFIG_CONSFRONT) += -DCONFIG_CONSFRONT
 DEFINES-$(CONFIG_XENBUS) += -DCONFIG_XENBUS
 DEFINES-$(CONFIG_BALLOON) += -DCONFIG_BALLOON
+DEFINES-$(CONFIG_DEFERRED_MEM) += -DCONFIG_DEFERRED_MEM
+DEFINES-$(CONFIG_PREEMPT) += -DCONFIG_PREEMPT
+DEFINES-$(CONFIG_SMP) += -DCONFIG_SMP
+DEFINES-$(CONFIG_COW_FAULT_AROUND) += -DCONFIG_COW_FAULT_AROUND
 DEFINES-$(CONFIG_USE_XEN_CONSOLE) += -DCONFIG_USE_XEN_CONSOLE
 
 DEFINES-y += -D__XEN_INTERFACE_VERSION__=$(XEN_INTERFACE_VERSION)
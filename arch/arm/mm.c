@@ -16,12 +16,28 @@ struct e820entry e820_map[1] = {
 };
 unsigned e820_entries = 1;
 
+/*
+ * There is no demand map area on ARM yet: allocating from it fails, which
+ * callers handle, and so there is never anything to give back.
+ */
 unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
 {
-    // FIXME
-    BUG();
+    printk("No demand map area for %lu frames\n", n);
+    return 0;
 }
 
+void free_ondemand(unsigned long va, unsigned long n)
+{
+}
+
+#ifdef CONFIG_DEFERRED_MEM
+/* All memory is set up at boot. */
+int arch_map_deferred(unsigned long pfn, unsigned long n)
+{
+    return 0;
+}
+#endif
+
 void arch_init_mm(unsigned long *start_pfn_p, unsigned long *max_pfn_p)
 {
     int memory;
@@ -91,6 +107,9 @@ int do_map_frames(unsigned long addr,
     return -ENOSYS;
 }
 
+/* Size of the region Xen suggests for the grant table. */
+static uint64_t gnttab_size;
+
 /* Get Xen's suggested physical page assignments for the grant table. */
 static paddr_t get_gnttab_base(void)
 {
@@ -110,13 +129,14 @@ static paddr_t get_gnttab_base(void)
     }
 
     gnttab_base = fdt64_to_cpu(regs[0]);
+    gnttab_size = fdt64_to_cpu(regs[1]);
 
     printk("FDT suggests grant table base %llx\n", (unsigned long long) gnttab_base);
 
     return gnttab_base;
 }
 
-grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames)
+grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames, int max_grant_frames)
 {
     struct xen_add_to_physmap xatp;
     struct gnttab_setup_table setup;
@@ -150,6 +170,36 @@ grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames)
     return to_virt(gnttab_table);
 }
 
+/* Adding frames past the current end makes Xen grow its table. */
+int arch_grow_gnttab(grant_entry_v1_t *gnttab_table, int nr_grant_frames,
+                     int new_grant_frames)
+{
+    struct xen_add_to_physmap xatp;
+    paddr_t base = to_phys(gnttab_table);
+    int i, rc;
+
+    if (((uint64_t)new_grant_frames << PAGE_SHIFT) > gnttab_size)
+        return -ENOSPC;
+
+    for (i = nr_grant_frames; i < new_grant_frames; i++)
+    {
+        xatp.domid = DOMID_SELF;
+        xatp.size = 0;
+        xatp.space = XENMAPSPACE_grant_table;
+        xatp.idx = i;
+        xatp.gpfn = (base >> PAGE_SHIFT) + i;
+        rc = HYPERVISOR_memory_op(XENMEM_add_to_physmap, &xatp);
+        if (rc)
+        {
+            printk("Growing grant table to %d frames failed: %d\n",
+                   new_grant_frames, rc);
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
 unsigned long map_frame_virt(unsigned long mfn)
 {
     return mfn_to_virt(mfn);
@@ -26,6 +26,7 @@
 
 #include <mini-os/os.h>
 #include <mini-os/console.h>
+#include <mini-os/sched.h>
 #include <arch_mm.h>
 
 extern int irqstack[];
@@ -85,8 +86,10 @@ void dump_registers(int *saved_registers) {
         stack_top = _boot_stack_end;                    /* The boot stack */
     else if (sp >= irqstack && sp <= irqstack_end)
         stack_top = irqstack_end;                       /* The IRQ stack */
+    else if (current)
+        stack_top = (int *) (current->stack + current->stack_size);     /* A normal thread stack */
     else
-        stack_top = (int *) ((((unsigned long) sp) | (__STACK_SIZE-1)) + 1);        /* A normal thread stack */
+        stack_top = sp;
 
     for (x = stack_top - 1; x >= sp; x--)
     {
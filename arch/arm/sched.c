@@ -9,22 +9,22 @@ void arm_start_thread(void);
 
 /* Architecture specific setup of thread creation */
 struct thread* arch_create_thread(char *name, void (*function)(void *),
-                                  void *data)
+                                  void *data, char *stack,
+                                  unsigned long stack_size)
 {
     struct thread *thread;
 
     thread = xmalloc(struct thread);
-    /* We can't use lazy allocation here since the trap handler runs on the stack */
-    thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
+    if (!thread)
+        return NULL;
+    thread->stack = stack;
+    thread->stack_size = stack_size;
     thread->name = name;
     printk("Thread \"%s\": pointer: 0x%p, stack: 0x%p\n", name, thread,
             thread->stack);
 
-    /* Save pointer to the thread on the stack, used by current macro */
-    *((unsigned long *)thread->stack) = (unsigned long)thread;
-
     /* Push the details to pass to arm_start_thread onto the stack. */
-    int *sp = (int *) (thread->stack + STACK_SIZE);
+    int *sp = (int *) (thread->stack + stack_size);
     *(--sp) = (int) function;
     *(--sp) = (int) data;
 
@@ -40,6 +40,7 @@ struct thread* arch_create_thread(char *name, void (*function)(void *),
 
 void run_idle_thread(void)
 {
+    set_current(idle_thread);
     __asm__ __volatile__ ("mov sp, %0; bx %1"::
             "r"(idle_thread->sp + 4 * CALLEE_SAVED_REGISTERS),
             "r"(idle_thread->ip));
@@ -140,6 +140,17 @@ void arch_pfn_add(unsigned long pfn, unsigned long mfn)
         do_exit();
     }
 }
+
+/* Drop the 1:1 mappings of pages about to be given back to Xen. */
+void arch_pfn_remove(unsigned long pfn, unsigned long n)
+{
+    unsigned long i;
+
+    if ( unmap_frames((unsigned long)pfn_to_virt(pfn), n) )
+        BUG();
+    for ( i = 0; i < n; i++ )
+        phys_to_machine_mapping[pfn + i] = INVALID_P2M_ENTRY;
+}
 #else
 void arch_pfn_add(unsigned long pfn, unsigned long mfn)
 {
@@ -150,6 +161,11 @@ void arch_pfn_add(unsigned long pfn, unsigned long mfn)
     if ( !(*pgt & _PAGE_PSE) )
         *pgt = (pgentry_t)(mfn << PAGE_SHIFT) | _PAGE_PRESENT | _PAGE_RW;
 }
+
+void arch_pfn_remove(unsigned long pfn, unsigned long n)
+{
+    /* The p2m is Xen's business, the mappings may stay in place. */
+}
 #endif
 
 #endif
@@ -1,16 +1,30 @@
 #include <mini-os/os.h>
 #include <mini-os/mm.h>
 #include <mini-os/events.h>
+#include <mini-os/smp.h>
 
 #if defined(__x86_64__)
 char irqstack[2 * STACK_SIZE];
 
+#ifdef CONFIG_SMP
+/* The boot context counts as having preemption disabled. */
+struct pda pda[NR_CPUS] = { [0] = { .preempt = 1 } };
+#define cpu0_pda pda[0]
+
+/* smp_processor_id() and friends work from here on. */
+void init_boot_pda(void)
+{
+    asm volatile("movl %0,%%fs ; movl %0,%%gs" :: "r" (0));
+    wrmsrl(0xc0000101, (uint64_t)&cpu0_pda); /* 0xc0000101 is MSR_GS_BASE */
+}
+#else
 static struct pda
 {
     int irqcount;       /* offset 0 (used in x86_64.S) */
     char *irqstackptr;  /*        8 */
 } cpu0_pda;
 #endif
+#endif
 
 void arch_init_events(void)
 {
@@ -29,7 +43,7 @@ void arch_unbind_ports(void)
 
 void arch_fini_events(void)
 {
-#if defined(__x86_64__)
+#if defined(__x86_64__) && !defined(CONFIG_SMP)
     wrmsrl(0xc0000101, 0); /* 0xc0000101 is MSR_GS_BASE */
 #endif
 }
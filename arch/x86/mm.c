@@ -43,6 +43,7 @@
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/spinlock.h>
 #include <mini-os/e820.h>
 #include <xen/memory.h>
 
@@ -284,19 +285,7 @@ static void build_pagetable(unsigned long *start_pfn, unsigned long *max_pfn)
        mapped, start the loop at the very beginning. */
     pfn_to_map = *start_pfn;
 
-#ifdef CONFIG_PARAVIRT
-    if ( *max_pfn >= virt_to_pfn(HYPERVISOR_VIRT_START) )
-    {
-        printk("WARNING: Mini-OS trying to use Xen virtual space. "
-               "Truncating memory from %luMB to ",
-               ((unsigned long)pfn_to_virt(*max_pfn) -
-                (unsigned long)&_text)>>20);
-        *max_pfn = virt_to_pfn(HYPERVISOR_VIRT_START - PAGE_SIZE);
-        printk("%luMB\n",
-               ((unsigned long)pfn_to_virt(*max_pfn) - 
-                (unsigned long)&_text)>>20);
-    }
-#else
+#ifndef CONFIG_PARAVIRT
     /* Round up to next 2MB boundary as we are using 2MB pages on HVMlite. */
     pfn_to_map = (pfn_to_map + L1_PAGETABLE_ENTRIES - 1) &
                  ~(L1_PAGETABLE_ENTRIES - 1);
@@ -504,11 +493,8 @@ static pgentry_t *get_pgt(unsigned long va)
 }
 
 
-/*
- * return a valid PTE for a given virtual address. If PTE does not exist,
- * allocate page-table pages.
- */
-pgentry_t *need_pgt(unsigned long va)
+/* NULL if a page-table page is missing and *spare is 0, else uses it. */
+static pgentry_t *__need_pgt(unsigned long va, unsigned long *spare)
 {
     unsigned long pt_mfn;
     pgentry_t *tab;
@@ -522,9 +508,10 @@ pgentry_t *need_pgt(unsigned long va)
     offset = l4_table_offset(va);
     if ( !(tab[offset] & _PAGE_PRESENT) )
     {
-        pt_pfn = virt_to_pfn(alloc_page());
-        if ( !pt_pfn )
+        if ( !*spare )
             return NULL;
+        pt_pfn = virt_to_pfn(*spare);
+        *spare = 0;
         new_pt_frame(&pt_pfn, pt_mfn, offset, L3_FRAME);
     }
     ASSERT(tab[offset] & _PAGE_PRESENT);
@@ -534,9 +521,10 @@ pgentry_t *need_pgt(unsigned long va)
     offset = l3_table_offset(va);
     if ( !(tab[offset] & _PAGE_PRESENT) ) 
     {
-        pt_pfn = virt_to_pfn(alloc_page());
-        if ( !pt_pfn )
+        if ( !*spare )
             return NULL;
+        pt_pfn = virt_to_pfn(*spare);
+        *spare = 0;
         new_pt_frame(&pt_pfn, pt_mfn, offset, L2_FRAME);
     }
     ASSERT(tab[offset] & _PAGE_PRESENT);
@@ -545,9 +533,10 @@ pgentry_t *need_pgt(unsigned long va)
     offset = l2_table_offset(va);
     if ( !(tab[offset] & _PAGE_PRESENT) )
     {
-        pt_pfn = virt_to_pfn(alloc_page());
-        if ( !pt_pfn )
+        if ( !*spare )
             return NULL;
+        pt_pfn = virt_to_pfn(*spare);
+        *spare = 0;
         new_pt_frame(&pt_pfn, pt_mfn, offset, L1_FRAME);
     }
     ASSERT(tab[offset] & _PAGE_PRESENT);
@@ -561,6 +550,36 @@ pgentry_t *need_pgt(unsigned long va)
     return &tab[offset];
 }
 
+/*
+ * return a valid PTE for a given virtual address. If PTE does not exist,
+ * allocate page-table pages.
+ */
+static DEFINE_SPINLOCK(pgt_lock);
+
+pgentry_t *need_pgt(unsigned long va)
+{
+    unsigned long spare = 0, flags;
+    pgentry_t *pgt;
+
+    /* Two threads must not add the same page-table page. */
+    for ( ;; )
+    {
+        spin_lock_irqsave(&pgt_lock, flags);
+        pgt = __need_pgt(va, &spare);
+        spin_unlock_irqrestore(&pgt_lock, flags);
+        if ( pgt )
+            break;
+        /* Allocating may map deferred memory, which comes back here. */
+        spare = alloc_page();
+        if ( !spare )
+            return NULL;
+    }
+    if ( spare )
+        free_page((void *)spare);
+
+    return pgt;
+}
+
 /*
  * Reserve an area of virtual address space for mappings and Heap
  */
@@ -570,6 +589,229 @@ static unsigned long demand_map_area_end;
 unsigned long heap, brk, heap_mapped, heap_end;
 #endif
 
+/*
+ * Free parts of the demand map area are kept as extents in an AVL tree
+ * sorted by address.  Each node also records the longest extent below it,
+ * so the first extent large enough is found in O(log n) however fragmented
+ * the area is.  Nodes come from pages carved up as needed and are recycled,
+ * never given back.
+ */
+struct dmap_extent {
+    unsigned long start;        /* First page, relative to the area. */
+    unsigned long len;
+    unsigned long max_len;      /* Longest extent in this subtree. */
+    int height;
+    struct dmap_extent *left, *right;
+};
+
+static struct dmap_extent *dmap_root;
+static struct dmap_extent *dmap_spare;  /* Unused nodes, linked by left. */
+static unsigned long dmap_nr_spare;
+static DEFINE_SPINLOCK(dmap_lock);
+
+/* Make sure at least n unused nodes are at hand. */
+static int dmap_refill(unsigned long n)
+{
+    struct dmap_extent *e;
+    unsigned long i;
+
+    while ( dmap_nr_spare < n )
+    {
+        e = (struct dmap_extent *)alloc_page();
+        if ( !e )
+            return -ENOMEM;
+        for ( i = 0; i < PAGE_SIZE / sizeof(*e); i++ )
+        {
+            e[i].left = dmap_spare;
+            dmap_spare = &e[i];
+            dmap_nr_spare++;
+        }
+    }
+
+    return 0;
+}
+
+static struct dmap_extent *dmap_new(unsigned long start, unsigned long len)
+{
+    struct dmap_extent *e = dmap_spare;
+
+    BUG_ON(!e);
+    dmap_spare = e->left;
+    dmap_nr_spare--;
+    e->start = start;
+    e->len = len;
+    e->left = e->right = NULL;
+
+    return e;
+}
+
+static void dmap_put(struct dmap_extent *e)
+{
+    e->left = dmap_spare;
+    dmap_spare = e;
+    dmap_nr_spare++;
+}
+
+static inline int dmap_height(struct dmap_extent *e)
+{
+    return e ? e->height : 0;
+}
+
+static void dmap_update(struct dmap_extent *e)
+{
+    int hl = dmap_height(e->left), hr = dmap_height(e->right);
+
+    e->height = 1 + (hl > hr ? hl : hr);
+    e->max_len = e->len;
+    if ( e->left && e->left->max_len > e->max_len )
+        e->max_len = e->left->max_len;
+    if ( e->right && e->right->max_len > e->max_len )
+        e->max_len = e->right->max_len;
+}
+
+static struct dmap_extent *dmap_rotate_right(struct dmap_extent *e)
+{
+    struct dmap_extent *l = e->left;
+
+    e->left = l->right;
+    l->right = e;
+    dmap_update(e);
+    dmap_update(l);
+
+    return l;
+}
+
+static struct dmap_extent *dmap_rotate_left(struct dmap_extent *e)
+{
+    struct dmap_extent *r = e->right;
+
+    e->right = r->left;
+    r->left = e;
+    dmap_update(e);
+    dmap_update(r);
+
+    return r;
+}
+
+static struct dmap_extent *dmap_balance(struct dmap_extent *e)
+{
+    int bf;
+
+    dmap_update(e);
+    bf = dmap_height(e->left) - dmap_height(e->right);
+    if ( bf > 1 )
+    {
+        if ( dmap_height(e->left->left) < dmap_height(e->left->right) )
+            e->left = dmap_rotate_left(e->left);
+        return dmap_rotate_right(e);
+    }
+    if ( bf < -1 )
+    {
+        if ( dmap_height(e->right->right) < dmap_height(e->right->left) )
+            e->right = dmap_rotate_right(e->right);
+        return dmap_rotate_left(e);
+    }
+
+    return e;
+}
+
+static struct dmap_extent *dmap_insert(struct dmap_extent *root,
+                                       struct dmap_extent *e)
+{
+    if ( !root )
+    {
+        dmap_update(e);
+        return e;
+    }
+    if ( e->start < root->start )
+        root->left = dmap_insert(root->left, e);
+    else
+        root->right = dmap_insert(root->right, e);
+
+    return dmap_balance(root);
+}
+
+static struct dmap_extent *dmap_remove_min(struct dmap_extent *e,
+                                           struct dmap_extent **min)
+{
+    if ( !e->left )
+    {
+        *min = e;
+        return e->right;
+    }
+    e->left = dmap_remove_min(e->left, min);
+
+    return dmap_balance(e);
+}
+
+/* Remove the extent starting at start, which must be in the tree. */
+static struct dmap_extent *dmap_remove(struct dmap_extent *root,
+                                       unsigned long start)
+{
+    struct dmap_extent *l, *r, *min;
+
+    BUG_ON(!root);
+    if ( start < root->start )
+        root->left = dmap_remove(root->left, start);
+    else if ( start > root->start )
+        root->right = dmap_remove(root->right, start);
+    else
+    {
+        l = root->left;
+        r = root->right;
+        dmap_put(root);
+        if ( !r )
+            return l;
+        r = dmap_remove_min(r, &min);
+        min->left = l;
+        min->right = r;
+        root = min;
+    }
+
+    return dmap_balance(root);
+}
+
+/* First extent of at least len pages. */
+static struct dmap_extent *dmap_find_len(unsigned long len)
+{
+    struct dmap_extent *e = dmap_root;
+
+    if ( !e || e->max_len < len )
+        return NULL;
+    for ( ;; )
+    {
+        if ( e->left && e->left->max_len >= len )
+            e = e->left;
+        else if ( e->len >= len )
+            return e;
+        else
+            e = e->right;
+    }
+}
+
+static inline unsigned long dmap_align(unsigned long x, unsigned long align)
+{
+    return (x + align - 1) & ~(align - 1);
+}
+
+/* First extent holding an aligned run of n pages, visiting only candidates. */
+static struct dmap_extent *dmap_find_aligned(struct dmap_extent *e,
+                                             unsigned long n,
+                                             unsigned long align)
+{
+    struct dmap_extent *found;
+
+    if ( !e || e->max_len < n )
+        return NULL;
+    found = dmap_find_aligned(e->left, n, align);
+    if ( found )
+        return found;
+    if ( dmap_align(e->start, align) + n <= e->start + e->len )
+        return e;
+
+    return dmap_find_aligned(e->right, n, align);
+}
+
 void arch_init_demand_mapping_area(void)
 {
     demand_map_area_start = VIRT_DEMAND_AREA;
@@ -577,6 +819,13 @@ void arch_init_demand_mapping_area(void)
     printk("Demand map pfns at %lx-%lx.\n", demand_map_area_start,
            demand_map_area_end);
 
+    if ( dmap_refill(1) )
+    {
+        printk("Failed to allocate demand map area extents\n");
+        do_exit();
+    }
+    dmap_root = dmap_insert(NULL, dmap_new(0, DEMAND_MAP_PAGES));
+
 #ifdef HAVE_LIBC
     heap_mapped = brk = heap = VIRT_HEAP_AREA;
     heap_end = heap_mapped + HEAP_PAGES * PAGE_SIZE;
@@ -584,45 +833,131 @@ void arch_init_demand_mapping_area(void)
 #endif
 }
 
-unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
+static unsigned long __allocate_ondemand(unsigned long n,
+                                         unsigned long alignment)
 {
-    unsigned long x;
-    unsigned long y = 0;
+    struct dmap_extent *e;
+    unsigned long start, end, x;
 
-    /* Find a properly aligned run of n contiguous frames */
-    for ( x = 0;
-          x <= DEMAND_MAP_PAGES - n; 
-          x = (x + y + 1 + alignment - 1) & ~(alignment - 1) )
+    if ( !alignment )
+        alignment = 1;
+    /* Up to two pieces are left over. */
+    if ( dmap_refill(2) )
     {
-        unsigned long addr = demand_map_area_start + x * PAGE_SIZE;
-        pgentry_t *pgt = get_pgt(addr);
-        for ( y = 0; y < n; y++, addr += PAGE_SIZE ) 
-        {
-            if ( !(addr & L1_MASK) )
-                pgt = get_pgt(addr);
-            if ( pgt )
-            {
-                if ( *pgt & _PAGE_PRESENT )
-                    break;
-                pgt++;
-            }
-        }
-        if ( y == n )
-            break;
+        printk("Failed to allocate demand map area extents\n");
+        return 0;
     }
-    if ( y != n )
+
+    /*
+     * Any extent this long has room for an aligned run; only if there is
+     * none look at the shorter ones too.
+     */
+    e = dmap_find_len(n + alignment - 1);
+    if ( !e && alignment > 1 )
+        e = dmap_find_aligned(dmap_root, n, alignment);
+    if ( !e )
     {
         printk("Failed to find %ld frames!\n", n);
         return 0;
     }
+
+    start = e->start;
+    end = e->start + e->len;
+    x = dmap_align(start, alignment);
+    dmap_root = dmap_remove(dmap_root, start);
+    if ( x > start )
+        dmap_root = dmap_insert(dmap_root, dmap_new(start, x - start));
+    if ( x + n < end )
+        dmap_root = dmap_insert(dmap_root, dmap_new(x + n, end - x - n));
+
     return demand_map_area_start + x * PAGE_SIZE;
 }
 
+unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
+{
+    unsigned long va, flags;
+
+    spin_lock_irqsave(&dmap_lock, flags);
+    va = __allocate_ondemand(n, alignment);
+    spin_unlock_irqrestore(&dmap_lock, flags);
+
+    return va;
+}
+
+/*
+ * Give back n pages of the demand map area at va, which should no longer be
+ * mapped.  Addresses outside the area are ignored.
+ */
+void free_ondemand(unsigned long va, unsigned long n)
+{
+    struct dmap_extent *e, *prev = NULL, *next = NULL;
+    unsigned long x, len, flags;
+
+    if ( va < demand_map_area_start || va >= demand_map_area_end || !n )
+        return;
+
+    x = (va - demand_map_area_start) >> PAGE_SHIFT;
+    if ( n > DEMAND_MAP_PAGES - x )
+        n = DEMAND_MAP_PAGES - x;
+    spin_lock_irqsave(&dmap_lock, flags);
+
+    /* The free extents either side. */
+    for ( e = dmap_root; e; )
+    {
+        if ( e->start <= x )
+        {
+            prev = e;
+            e = e->right;
+        }
+        else
+        {
+            next = e;
+            e = e->left;
+        }
+    }
+    if ( (prev && prev->start + prev->len > x) ||
+         (next && next->start < x + n) )
+    {
+        printk("free_ondemand: pages at %lx already free\n", va);
+        goto out;
+    }
+
+    if ( prev && prev->start + prev->len != x )
+        prev = NULL;
+    if ( next && next->start != x + n )
+        next = NULL;
+    /* Merging frees a node, otherwise one is needed. */
+    if ( !prev && !next && dmap_refill(1) )
+    {
+        printk("free_ondemand: out of memory, leaking %lu pages at %lx\n",
+               n, va);
+        goto out;
+    }
+
+    len = n;
+    if ( prev )
+    {
+        x = prev->start;
+        len += prev->len;
+        dmap_root = dmap_remove(dmap_root, x);
+    }
+    if ( next )
+    {
+        len += next->len;
+        dmap_root = dmap_remove(dmap_root, next->start);
+    }
+    dmap_root = dmap_insert(dmap_root, dmap_new(x, len));
+
+ out:
+    spin_unlock_irqrestore(&dmap_lock, flags);
+}
+
 /*
  * Map an array of MFNs contiguously into virtual address space starting at
- * va. map f[i*stride]+i*increment for i in 0..n-1.
+ * va. map f[i*stride]+i*increment for i in 0..n-1.  The updates are batched
+ * on the stack, which may be as small as STACK_SIZE_MIN.
  */
-#define MAP_BATCH ((STACK_SIZE / 2) / sizeof(mmu_update_t))
+#define MAP_BATCH 32
 int do_map_frames(unsigned long va,
                   const unsigned long *mfns, unsigned long n,
                   unsigned long stride, unsigned long incr,
@@ -716,24 +1051,32 @@ void *map_frames_ex(const unsigned long *mfns, unsigned long n,
         return NULL;
 
     if ( do_map_frames(va, mfns, n, stride, incr, id, err, prot) )
+    {
+        free_ondemand(va, n);
         return NULL;
+    }
 
     return (void *)va;
 }
 
 /*
- * Unmap nun_frames frames mapped at virtual address va.
+ * Unmap nun_frames frames mapped at virtual address va.  Demand map area
+ * addresses are given back for reuse.  The page table entries are cleared
+ * in batches, and unmapping more than UNMAP_FLUSH_ALL pages is followed by
+ * a single TLB flush instead of one invalidation per page.
  */
-#define UNMAP_BATCH ((STACK_SIZE / 2) / sizeof(multicall_entry_t))
+#define UNMAP_BATCH 32
+#define UNMAP_FLUSH_ALL 32
 int unmap_frames(unsigned long va, unsigned long num_frames)
 {
-#ifdef CONFIG_PARAVIRT
-    int n = UNMAP_BATCH;
-    multicall_entry_t call[n];
-    int ret;
-    int i;
-#else
+    unsigned long start = va, total = num_frames;
+    unsigned long cleared = 0;
     pgentry_t *pgt;
+#ifdef CONFIG_PARAVIRT
+    mmu_update_t mmu_updates[UNMAP_BATCH];
+    struct mmuext_op flush[UNMAP_FLUSH_ALL];
+    unsigned long n;
+    int rc;
 #endif
 
     ASSERT(!((unsigned long)va & ~PAGE_MASK));
@@ -742,55 +1085,110 @@ int unmap_frames(unsigned long va, unsigned long num_frames)
 
     while ( num_frames ) {
 #ifdef CONFIG_PARAVIRT
-        if ( n > num_frames )
-            n = num_frames;
-
-        for ( i = 0; i < n; i++ )
-        {
-            int arg = 0;
-            /* simply update the PTE for the VA and invalidate TLB */
-            call[i].op = __HYPERVISOR_update_va_mapping;
-            call[i].args[arg++] = va;
-            call[i].args[arg++] = 0;
-#ifdef __i386__
-            call[i].args[arg++] = 0;
-#endif  
-            call[i].args[arg++] = UVMF_INVLPG;
-
-            va += PAGE_SIZE;
-        }
-
-        ret = HYPERVISOR_multicall(call, n);
-        if ( ret )
+        for ( n = 0; num_frames && n < UNMAP_BATCH;
+              va += PAGE_SIZE, num_frames-- )
         {
-            printk("update_va_mapping hypercall failed with rc=%d.\n", ret);
-            return -ret;
+            pgt = get_pgt(va);
+            if ( !pgt || !*pgt )
+                continue;
+            ASSERT(!(*pgt & _PAGE_PSE));
+            mmu_updates[n].ptr = virt_to_mach(pgt) | MMU_NORMAL_PT_UPDATE;
+            mmu_updates[n].val = 0;
+            if ( total <= UNMAP_FLUSH_ALL )
+            {
+                flush[n].cmd = MMUEXT_INVLPG;
+                flush[n].arg1.linear_addr = va;
+            }
+            n++;
         }
+        if ( !n )
+            continue;
 
-        for ( i = 0; i < n; i++ )
+        rc = HYPERVISOR_mmu_update(mmu_updates, n, NULL, DOMID_SELF);
+        if ( !rc && total <= UNMAP_FLUSH_ALL )
+            rc = HYPERVISOR_mmuext_op(flush, n, NULL, DOMID_SELF);
+        if ( rc )
         {
-            if ( call[i].result ) 
-            {
-                printk("update_va_mapping failed for with rc=%d.\n", ret);
-                return -(call[i].result);
-            }
+            printk("Unmap %ld frames at %lx failed: %d.\n", n, start, rc);
+            return -rc;
         }
-        num_frames -= n;
+        cleared += n;
 #else
         pgt = get_pgt(va);
-        if ( pgt )
+        if ( pgt && *pgt )
         {
             ASSERT(!(*pgt & _PAGE_PSE));
             *pgt = 0;
-            invlpg(va);
+            if ( total <= UNMAP_FLUSH_ALL )
+                invlpg(va);
+            cleared++;
         }
         va += PAGE_SIZE;
         num_frames--;
 #endif
     }
+
+    if ( cleared && total > UNMAP_FLUSH_ALL )
+    {
+#ifdef CONFIG_PARAVIRT
+        flush[0].cmd = MMUEXT_TLB_FLUSH;
+        rc = HYPERVISOR_mmuext_op(flush, 1, NULL, DOMID_SELF);
+        if ( rc )
+        {
+            printk("TLB flush after unmapping at %lx failed: %d.\n",
+                   start, rc);
+            return -rc;
+        }
+#else
+        write_cr3(read_cr3());
+#endif
+    }
+
+    free_ondemand(start, total);
     return 0;
 }
 
+#ifdef CONFIG_DEFERRED_MEM
+/*
+ * Map pfns [pfn, pfn + n) left out by build_pagetable(), at most
+ * L1_PAGETABLE_ENTRIES at a time so that nothing is mapped on failure.
+ * Only called under deferred_lock, which covers the static batch.
+ */
+int arch_map_deferred(unsigned long pfn, unsigned long n)
+{
+#ifdef CONFIG_PARAVIRT
+    static mmu_update_t mmu_updates[L1_PAGETABLE_ENTRIES];
+    unsigned long va = (unsigned long)pfn_to_virt(pfn);
+    pgentry_t *pgt = NULL;
+    unsigned long i;
+    int rc;
+
+    ASSERT(n <= L1_PAGETABLE_ENTRIES);
+
+    for ( i = 0; i < n; i++, va += PAGE_SIZE, pgt++ )
+    {
+        if ( !pgt || !(va & L1_MASK) )
+            pgt = need_pgt(va);
+        if ( !pgt )
+            return -ENOMEM;
+        mmu_updates[i].ptr = virt_to_mach(pgt) | MMU_NORMAL_PT_UPDATE;
+        mmu_updates[i].val = (pgentry_t)pfn_to_mfn(pfn + i) << PAGE_SHIFT |
+                             L1_PROT;
+    }
+
+    rc = HYPERVISOR_mmu_update(mmu_updates, n, NULL, DOMID_SELF);
+    if ( rc < 0 )
+    {
+        printk("Map of deferred pfns %lx-%lx failed: %d.\n",
+               pfn, pfn + n - 1, rc);
+        return rc;
+    }
+#endif
+
+    return 0;
+}
+#endif
+
 /*
  * Clear some of the bootstrap memory
  */
@@ -885,7 +1283,29 @@ void arch_init_mm(unsigned long* start_pfn_p, unsigned long* max_pfn_p)
     printk("  start_pfn: %lx\n", start_pfn);
     printk("    max_pfn: %lx\n", max_pfn);
 
+#ifdef CONFIG_PARAVIRT
+    if ( max_pfn >= virt_to_pfn(HYPERVISOR_VIRT_START) )
+    {
+        printk("WARNING: Mini-OS trying to use Xen virtual space. "
+               "Truncating memory from %luMB to ",
+               ((unsigned long)pfn_to_virt(max_pfn) -
+                (unsigned long)&_text)>>20);
+        max_pfn = virt_to_pfn(HYPERVISOR_VIRT_START - PAGE_SIZE);
+        printk("%luMB\n",
+               ((unsigned long)pfn_to_virt(max_pfn) - 
+                (unsigned long)&_text)>>20);
+    }
+#endif
+
+#if defined(CONFIG_DEFERRED_MEM) && defined(CONFIG_PARAVIRT)
+    /* Mapping every frame is slow on PV, leave most of them for later. */
+    deferred_pfn = start_pfn + DEFERRED_MEM_BOOT_PAGES;
+    if ( deferred_pfn > max_pfn )
+        deferred_pfn = max_pfn;
+    build_pagetable(&start_pfn, &deferred_pfn);
+#else
     build_pagetable(&start_pfn, &max_pfn);
+#endif
     clear_bootstrap();
     set_readonly(&_text, &_erodata);
 
@@ -904,17 +1324,59 @@ void arch_init_mm(unsigned long* start_pfn_p, unsigned long* max_pfn_p)
 #endif
 }
 
-grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames)
+grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames, int max_grant_frames)
 {
     struct gnttab_setup_table setup;
     unsigned long frames[nr_grant_frames];
+    unsigned long va;
 
     setup.dom = DOMID_SELF;
     setup.nr_frames = nr_grant_frames;
     set_xen_guest_handle(setup.frame_list, frames);
 
     HYPERVISOR_grant_table_op(GNTTABOP_setup_table, &setup, 1);
-    return map_frames(frames, nr_grant_frames);
+
+    /* Leave room for the table to grow in place. */
+    va = allocate_ondemand(max_grant_frames, 1);
+    if ( !va || do_map_frames(va, frames, nr_grant_frames, 1, 0, DOMID_SELF,
+                              NULL, L1_PROT) )
+        return NULL;
+
+    return (grant_entry_v1_t *)va;
+}
+
+int arch_grow_gnttab(grant_entry_v1_t *gnttab_table, int nr_grant_frames,
+                     int new_grant_frames)
+{
+    struct gnttab_setup_table setup;
+    unsigned long *frames;
+    int rc;
+
+    /* Xen lists all frames, which may be too many for the stack. */
+    frames = xmalloc_array(unsigned long, new_grant_frames);
+    if ( !frames )
+        return -ENOMEM;
+
+    setup.dom = DOMID_SELF;
+    setup.nr_frames = new_grant_frames;
+    set_xen_guest_handle(setup.frame_list, frames);
+
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_setup_table, &setup, 1);
+    if ( rc || setup.status != GNTST_okay )
+    {
+        printk("Growing grant table to %d frames failed: %d/%d\n",
+               new_grant_frames, rc, setup.status);
+        xfree(frames);
+        return rc ? rc : -EINVAL;
+    }
+
+    rc = do_map_frames((unsigned long)gnttab_table +
+                       nr_grant_frames * PAGE_SIZE,
+                       frames + nr_grant_frames,
+                       new_grant_frames - nr_grant_frames, 1, 0,
+                       DOMID_SELF, NULL, L1_PROT);
+    xfree(frames);
+    return rc;
 }
 
 void arch_suspend_gnttab(grant_entry_v1_t *gnttab_table, int nr_grant_frames)
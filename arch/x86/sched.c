@@ -57,7 +57,7 @@
 
 void dump_stack(struct thread *thread)
 {
-    unsigned long *bottom = (unsigned long *)(thread->stack + STACK_SIZE); 
+    unsigned long *bottom = (unsigned long *)(thread->stack + thread->stack_size);
     unsigned long *pointer = (unsigned long *)thread->sp;
     int count;
     if(thread == current)
@@ -91,22 +91,85 @@ static void stack_push(struct thread *thread, unsigned long value)
     *((unsigned long *)thread->sp) = value;
 }
 
+#ifdef __x86_64__
+/*
+ * Thread-local storage.  Each thread gets a copy of .tdata and a cleared
+ * .tbss right below the thread control block %fs points to, where the
+ * local-exec code the compiler emits for __thread expects it (variant II of
+ * the ELF TLS ABI).  The block is allocated along with struct thread.  Event
+ * callbacks see the TLS of the thread they interrupted.
+ */
+extern char _tdata_start[], _tdata_end[], _tbss_end[], _tls_align[];
+
+struct tcb {
+    unsigned long self;             /* %fs:0 */
+    unsigned long pad[4];
+    unsigned long stack_guard;      /* %fs:0x28, for -fstack-protector */
+};
+
+void arch_set_tls(unsigned long tp)
+{
+#ifdef CONFIG_PARAVIRT
+    HYPERVISOR_set_segment_base(SEGBASE_FS, tp);
+#else
+    wrmsrl(0xc0000100, tp); /* 0xc0000100 is MSR_FS_BASE */
+#endif
+}
+
+static struct thread *alloc_thread_tls(void)
+{
+    unsigned long tls_size = _tbss_end - _tdata_start;
+    unsigned long tdata_size = _tdata_end - _tdata_start;
+    unsigned long align = (unsigned long)_tls_align;
+    unsigned long block, offset;
+    struct thread *thread;
+    struct tcb *tcb;
+    char *tls;
+
+    if (!tls_size) {
+        thread = xmalloc(struct thread);
+        if (thread)
+            thread->tls = 0;
+        return thread;
+    }
+
+    /* struct thread, then the TLS block ending at an aligned TCB. */
+    block = (tls_size + align - 1) & ~(align - 1);
+    offset = (sizeof(*thread) + block + align - 1) & ~(align - 1);
+    thread = _xmalloc(offset + sizeof(*tcb), align);
+    if (!thread)
+        return NULL;
+    tls = (char *)thread + offset - block;
+    memcpy(tls, _tdata_start, tdata_size);
+    memset(tls + tdata_size, 0, block - tdata_size);
+    tcb = (struct tcb *)((char *)thread + offset);
+    memset(tcb, 0, sizeof(*tcb));
+    tcb->self = (unsigned long)tcb;
+    tcb->stack_guard = NOW() ^ tcb->self;
+    thread->tls = tcb->self;
+    return thread;
+}
+#else
+#define alloc_thread_tls() xmalloc(struct thread)
+#endif
+
 /* Architecture specific setup of thread creation */
 struct thread* arch_create_thread(char *name, void (*function)(void *),
-                                  void *data)
+                                  void *data, char *stack,
+                                  unsigned long stack_size)
 {
     struct thread *thread;
     
-    thread = xmalloc(struct thread);
-    /* We can't use lazy allocation here since the trap handler runs on the stack */
-    thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
+    thread = alloc_thread_tls();
+    if (!thread)
+        return NULL;
+    thread->stack = stack;
+    thread->stack_size = stack_size;
     thread->name = name;
     printk("Thread \"%s\": pointer: 0x%p, stack: 0x%p\n", name, thread, 
             thread->stack);
     
-    thread->sp = (unsigned long)thread->stack + STACK_SIZE;
-    /* Save pointer to the thread on the stack, used by current macro */
-    *((unsigned long *)thread->stack) = (unsigned long)thread;
+    thread->sp = (unsigned long)thread->stack + stack_size;
 
     /* Must ensure that (%rsp + 8) is 16-byte aligned at the start of thread_starter. */
     thread->sp -= sizeof(unsigned long);
@@ -119,19 +182,26 @@ struct thread* arch_create_thread(char *name, void (*function)(void *),
 
 void run_idle_thread(void)
 {
+    struct thread *idle = idle_threads[smp_processor_id()];
+
+    set_current(idle);
+#ifdef __x86_64__
+    if (idle->tls)
+        arch_set_tls(idle->tls);
+#endif
     /* Switch stacks and run the thread */ 
 #if defined(__i386__)
     __asm__ __volatile__("mov %0,%%esp\n\t"
                          "push %1\n\t" 
                          "ret"                                            
-                         :"=m" (idle_thread->sp)
-                         :"m" (idle_thread->ip));                          
+                         :"=m" (idle->sp)
+                         :"m" (idle->ip));                          
 #elif defined(__x86_64__)
     __asm__ __volatile__("mov %0,%%rsp\n\t"
                          "push %1\n\t" 
                          "ret"                                            
-                         :"=m" (idle_thread->sp)
-                         :"m" (idle_thread->ip));                                                    
+                         :"=m" (idle->sp)
+                         :"m" (idle->ip));                                                    
 #endif
 }
 
@@ -0,0 +1,63 @@
+#include <mini-os/os.h>
+#include <mini-os/mm.h>
+#include <mini-os/sched.h>
+#include <mini-os/smp.h>
+#include <mini-os/lib.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/errno.h>
+#include <xen/vcpu.h>
+
+#ifdef CONFIG_SMP
+/*
+ * The new vCPU starts in its idle thread like run_idle_thread() does, with
+ * events masked and preemption disabled, on the boot vCPU's page tables.
+ */
+int arch_start_cpu(unsigned int cpu, struct thread *idle)
+{
+    vcpu_guest_context_t *ctxt;
+    struct pda *p = &pda[cpu];
+    char *irqstack;
+    int rc;
+
+    irqstack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
+    if ( !irqstack )
+        return -ENOMEM;
+    ctxt = xzalloc(vcpu_guest_context_t);
+    if ( !ctxt )
+    {
+        free_pages(irqstack, STACK_SIZE_PAGE_ORDER);
+        return -ENOMEM;
+    }
+
+    p->irqcount = -1;
+    p->irqstackptr = irqstack + STACK_SIZE;
+    p->curr = idle;
+    p->cpu = cpu;
+    p->callback = 0;
+    p->preempt = 1;
+    p->resched = 0;
+    HYPERVISOR_shared_info->vcpu_info[cpu].evtchn_upcall_mask = 1;
+
+    ctxt->flags = VGCF_in_kernel | VGCF_failsafe_disables_events;
+    ctxt->user_regs.cs = FLAT_KERNEL_CS;
+    ctxt->user_regs.ss = FLAT_KERNEL_SS;
+    ctxt->user_regs.rip = idle->ip;
+    ctxt->user_regs.rsp = idle->sp;
+    ctxt->user_regs.rflags = 0x1000;    /* IOPL 1, as on the boot vCPU. */
+    ctxt->kernel_ss = FLAT_KERNEL_SS;
+    ctxt->kernel_sp = (unsigned long)idle->stack + idle->stack_size;
+    ctxt->ctrlreg[3] = xen_pfn_to_cr3(virt_to_mfn(pt_base));
+    ctxt->fs_base = idle->tls;
+    ctxt->gs_base_kernel = (unsigned long)p;
+    trap_init_vcpu(ctxt);
+
+    rc = HYPERVISOR_vcpu_op(VCPUOP_initialise, cpu, ctxt);
+    if ( !rc )
+        rc = HYPERVISOR_vcpu_op(VCPUOP_up, cpu, NULL);
+    xfree(ctxt);
+    if ( rc )
+        free_pages(irqstack, STACK_SIZE_PAGE_ORDER);
+
+    return rc;
+}
+#endif
@@ -39,6 +39,9 @@
 #include <mini-os/events.h>
 #include <mini-os/time.h>
 #include <mini-os/lib.h>
+#include <mini-os/preempt.h>
+#include <mini-os/smp.h>
+#include <xen/vcpu.h>
 
 /************************************************************************
  * Time functions
@@ -56,7 +59,13 @@ struct shadow_time_info {
 static struct timespec shadow_ts;
 static uint32_t shadow_ts_version;
 
+#ifdef CONFIG_SMP
+/* Each vCPU reads its own time info, the TSCs need not agree. */
+static struct shadow_time_info shadows[NR_CPUS];
+#define shadow (shadows[smp_processor_id()])
+#else
 static struct shadow_time_info shadow;
+#endif
 
 
 #ifndef rmb
@@ -74,7 +83,7 @@ static struct shadow_time_info shadow;
 
 static inline int time_values_up_to_date(void)
 {
-	struct vcpu_time_info *src = &HYPERVISOR_shared_info->vcpu_info[0].time; 
+	struct vcpu_time_info *src = &HYPERVISOR_shared_info->vcpu_info[smp_processor_id()].time; 
 
 	return (shadow.version == src->version);
 }
@@ -134,7 +143,7 @@ static unsigned long get_nsec_offset(void)
 
 static void get_time_values_from_xen(void)
 {
-	struct vcpu_time_info    *src = &HYPERVISOR_shared_info->vcpu_info[0].time;
+	struct vcpu_time_info    *src = &HYPERVISOR_shared_info->vcpu_info[smp_processor_id()].time;
 
  	do {
 		shadow.version = src->version;
@@ -161,6 +170,12 @@ uint64_t monotonic_clock(void)
 {
 	uint64_t time;
 	uint32_t local_time_version;
+#ifdef CONFIG_SMP
+	unsigned long flags;
+
+	/* Stay on the vCPU whose shadow and TSC are used. */
+	local_irq_save(flags);
+#endif
 
 	do {
 		local_time_version = shadow.version;
@@ -170,6 +185,9 @@ uint64_t monotonic_clock(void)
 			get_time_values_from_xen();
 		rmb();
 	} while (local_time_version != shadow.version);
+#ifdef CONFIG_SMP
+	local_irq_restore(flags);
+#endif
 
 	return time;
 }
@@ -206,12 +224,36 @@ int gettimeofday(struct timeval *tv, void *tz)
 }
 
 
+/*
+ * There is no periodic tick: Xen's one-shot timer is only set for the
+ * deadline block_domain() is asked for, and left alone when that does not
+ * change.  Deadlines are rounded up to a multiple of timer_slack so that
+ * close ones fall on the same wakeup ("timer_slack_us=" on the command
+ * line, 0 to disable).
+ */
+#define TIMER_SLACK_US 50
+static s_time_t timer_slack = -1;
+/* Per vCPU, 0 if the timer is not set. */
+static s_time_t timer_deadlines[NR_CPUS];
+#define timer_deadline (timer_deadlines[smp_processor_id()])
+
+void arch_set_timer(s_time_t deadline)
+{
+    if ( deadline == timer_deadline )
+        return;
+    timer_deadline = deadline;
+    HYPERVISOR_set_timer_op(deadline);
+}
+
 void block_domain(s_time_t until)
 {
     ASSERT(irqs_disabled());
     if(monotonic_clock() < until)
     {
-        HYPERVISOR_set_timer_op(until);
+        if ( timer_slack > 1 )
+            until = (until + timer_slack - 1) / timer_slack * timer_slack;
+        /* An earlier wakeup leaves the timer set for the next call. */
+        arch_set_timer(until);
 #ifdef CONFIG_PARAVIRT
         HYPERVISOR_sched_op(SCHEDOP_block, 0);
 #else
@@ -219,27 +261,65 @@ void block_domain(s_time_t until)
         asm volatile ( "hlt" : : : "memory" );
 #endif
         local_irq_disable();
-        HYPERVISOR_set_timer_op(0);
     }
 }
 
 static void timer_handler(evtchn_port_t ev, struct pt_regs *regs, void *ign)
 {
-    HYPERVISOR_set_timer_op(monotonic_clock() + MILLISECS(1));
+    /* The one-shot timer has fired, or an earlier one set before. */
+    if ( NOW() >= timer_deadline )
+        timer_deadline = 0;
+    else
+        HYPERVISOR_set_timer_op(timer_deadline);
+#ifdef CONFIG_PREEMPT
+    /* Slice end or a deadline: have the scheduler look at it. */
+    set_need_resched(1);
+#endif
 }
 
 
 
-static evtchn_port_t port;
+static evtchn_port_t ports[NR_CPUS];
+#define port (ports[smp_processor_id()])
+
+/* Xen may start vCPUs with a periodic timer, which would defeat all this. */
+static void stop_periodic_timer(void)
+{
+    int rc;
+
+    rc = HYPERVISOR_vcpu_op(VCPUOP_stop_periodic_timer, smp_processor_id(),
+                            NULL);
+    if ( rc )
+        printk("WARN: stopping the periodic timer failed rc=%d\n", rc);
+}
+
+/* Also called on resume, when Xen has forgotten any timer set before. */
 void init_time(void)
 {
+    if ( timer_slack < 0 )
+        timer_slack = MICROSECS(get_boot_param("timer_slack_us",
+                                               TIMER_SLACK_US));
+    memset(timer_deadlines, 0, sizeof(timer_deadlines));
+    stop_periodic_timer();
     port = bind_virq(VIRQ_TIMER, &timer_handler, NULL);
     unmask_evtchn(port);
 }
 
+#ifdef CONFIG_SMP
+/* VIRQ_TIMER of the calling vCPU. */
+void init_time_secondary(void)
+{
+    timer_deadline = 0;
+    stop_periodic_timer();
+    port = bind_virq(VIRQ_TIMER, &timer_handler, NULL);
+    unmask_evtchn(port);
+}
+#endif
+
 void fini_time(void)
 {
     /* Clear any pending timer */
     HYPERVISOR_set_timer_op(0);
+    timer_deadline = 0;
     unbind_evtchn(port);
 }
@@ -6,6 +6,7 @@
 #include <mini-os/mm.h>
 #include <mini-os/lib.h>
 #include <mini-os/sched.h>
+#include <mini-os/spinlock.h>
 #include <xen/hvm/params.h>
 
 /*
@@ -118,10 +119,29 @@ void page_walk(unsigned long virt_address)
 
 }
 
-static int handle_cow(unsigned long addr) {
+/*
+ * Number of zero-page mappings populated per CoW fault, starting at the
+ * faulting page, so sequential writes do not trap on every page.  Only with
+ * CONFIG_COW_FAULT_AROUND: the neighbours may belong to another sparse
+ * allocation, which would then be backed by real pages.
+ */
+#ifdef CONFIG_COW_FAULT_AROUND
+#define COW_FAULT_AROUND 16
+#else
+#define COW_FAULT_AROUND 1
+#endif
+
+/* Serialises CoW faults so two vCPUs never replace the same mapping. */
+static DEFINE_SPINLOCK(cow_lock);
+
+static int __handle_cow(unsigned long addr) {
         pgentry_t *tab = pt_base, page;
-	unsigned long new_page;
+	unsigned long new_page, offset, n, i;
 #ifdef CONFIG_PARAVIRT
+	mmu_update_t mmu_updates[COW_FAULT_AROUND];
+	struct mmuext_op flush[COW_FAULT_AROUND];
+	unsigned long pages[COW_FAULT_AROUND];
+	int done = 0;
 	int rc;
 #endif
 
@@ -143,30 +163,85 @@ static int handle_cow(unsigned long addr) {
 	    return 0;
         tab = pte_to_virt(page);
         
-        page = tab[l1_table_offset(addr)];
+        offset = l1_table_offset(addr);
+        page = tab[offset];
 	if (!(page & _PAGE_PRESENT))
 	    return 0;
+#ifdef CONFIG_SMP
+	/* Another vCPU got here first, only our TLB entry is stale. */
+	if ((page & _PAGE_RW) && PHYS_PFN(page) != mfn_zero) {
+#ifdef CONFIG_PARAVIRT
+	    flush[0].cmd = MMUEXT_INVLPG_LOCAL;
+	    flush[0].arg1.linear_addr = addr & PAGE_MASK;
+	    return !HYPERVISOR_mmuext_op(flush, 1, NULL, DOMID_SELF);
+#else
+	    invlpg(addr);
+	    return 1;
+#endif
+	}
+#endif
 	/* Only support CoW for the zero page.  */
 	if (PHYS_PFN(page) != mfn_zero)
 	    return 0;
 
-	new_page = alloc_pages(0);
-	memset((void*) new_page, 0, PAGE_SIZE);
+	/* Extend over the following zero-page mappings in this L1 table. */
+	for (n = 1; n < COW_FAULT_AROUND && offset + n < L1_PAGETABLE_ENTRIES; n++) {
+	    page = tab[offset + n];
+	    if (!(page & _PAGE_PRESENT) || PHYS_PFN(page) != mfn_zero)
+		break;
+	}
+
+	addr &= PAGE_MASK;
+	for (i = 0; i < n; i++) {
+	    new_page = alloc_zeroed_page();
+	    if (!new_page) {
+		/* Neighbours are optional, the faulting page is not. */
+		if (!i)
+		    return 0;
+		n = i;
+		break;
+	    }
+#ifdef CONFIG_PARAVIRT
+	    pages[i] = new_page;
+	    mmu_updates[i].ptr = virt_to_mach(&tab[offset + i]) | MMU_NORMAL_PT_UPDATE;
+	    mmu_updates[i].val = virt_to_mach(new_page) | L1_PROT;
+	    flush[i].cmd = MMUEXT_INVLPG;
+	    flush[i].arg1.linear_addr = addr + i * PAGE_SIZE;
+#else
+	    tab[offset + i] = virt_to_mach(new_page) | L1_PROT;
+	    invlpg(addr + i * PAGE_SIZE);
+#endif
+	}
 
 #ifdef CONFIG_PARAVIRT
-	rc = HYPERVISOR_update_va_mapping(addr & PAGE_MASK, __pte(virt_to_mach(new_page) | L1_PROT), UVMF_INVLPG);
+	rc = HYPERVISOR_mmu_update(mmu_updates, n, &done, DOMID_SELF);
+	if (!rc)
+	    rc = HYPERVISOR_mmuext_op(flush, n, NULL, DOMID_SELF);
 	if (!rc)
 		return 1;
 
 	printk("Map zero page to %lx failed: %d.\n", addr, rc);
+	/* Pages Xen did not map are still ours. */
+	for (i = done; i < n; i++)
+	    free_page((void *)pages[i]);
 	return 0;
 #else
-	tab[l1_table_offset(addr)] = virt_to_mach(new_page) | L1_PROT;
-	invlpg(addr);
 	return 1;
 #endif
 }
 
+static int handle_cow(unsigned long addr)
+{
+	unsigned long flags;
+	int rc;
+
+	spin_lock_irqsave(&cow_lock, flags);
+	rc = __handle_cow(addr);
+	spin_unlock_irqrestore(&cow_lock, flags);
+
+	return rc;
+}
+
 static void do_stack_walk(unsigned long frame_base)
 {
     unsigned long *frame = (void*) frame_base;
@@ -352,6 +427,19 @@ void trap_init(void)
 #endif
 }
 
+#ifdef CONFIG_SMP
+/* What trap_init() registers, for a vCPU about to be started. */
+void trap_init_vcpu(vcpu_guest_context_t *ctxt)
+{
+    trap_info_t *t;
+
+    for ( t = trap_table; t->address; t++ )
+        ctxt->trap_ctxt[t->vector] = *t;
+    ctxt->event_callback_eip = (unsigned long)hypervisor_callback;
+    ctxt->failsafe_callback_eip = (unsigned long)failsafe_callback;
+}
+#endif
+
 void trap_fini(void)
 {
     HYPERVISOR_set_trap_table(NULL);
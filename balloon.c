@@ -26,6 +26,10 @@
 #include <mini-os/errno.h>
 #include <mini-os/lib.h>
 #include <mini-os/paravirt.h>
+#include <mini-os/sched.h>
+#include <mini-os/spinlock.h>
+#include <mini-os/xenbus.h>
+#include <mini-os/xmalloc.h>
 #include <xen/xen.h>
 #include <xen/memory.h>
 
@@ -65,22 +69,156 @@ void mm_alloc_bitmap_remap(void)
     mm_alloc_bitmap = (unsigned long *)new_bitmap;
 }
 
-#define N_BALLOON_FRAMES 64
+/* One page worth of extents per hypercall. */
+#define N_BALLOON_FRAMES (PAGE_SIZE / sizeof(unsigned long))
 static unsigned long balloon_frames[N_BALLOON_FRAMES];
+static unsigned long balloon_pfns[N_BALLOON_FRAMES];
 
-int balloon_up(unsigned long n_pages)
+/* Largest chunk populated or released at once: 2M on x86. */
+#define BALLOON_CHUNK_ORDER 9
+
+/*
+ * Frames of a PV guest are only pseudo-physically contiguous, so they are
+ * released one by one.  Translated guests can release whole chunks.
+ */
+#ifdef CONFIG_PARAVIRT
+#define release_order(order) 0
+#else
+#define release_order(order) (order)
+#endif
+
+/* Runs of pfns given back to Xen by balloon_down(). */
+struct balloon_run {
+    unsigned long pfn;
+    unsigned long nr;
+};
+static struct balloon_run *runs;
+static unsigned long nr_runs, max_runs;
+unsigned long nr_ballooned_pages;
+
+/*
+ * Held while ballooning, which may allocate and come back here: only ever
+ * tried, never waited for.  Raw, so that ballooning stays preemptible.
+ */
+static DEFINE_SPINLOCK(balloon_lock);
+
+/* Hand pages [pfn, pfn + n) to the buddy allocator in aligned chunks. */
+static void balloon_free_range(unsigned long pfn, unsigned long n)
 {
-    unsigned long page, pfn;
+    int order;
+
+    while ( n )
+    {
+        for ( order = 0; order < BALLOON_CHUNK_ORDER; order++ )
+            if ( (pfn & (1UL << order)) || (2UL << order) > n )
+                break;
+        __free_pages(pfn_to_virt(pfn), order);
+        pfn += 1UL << order;
+        n -= 1UL << order;
+    }
+}
+
+/* Make sure n more runs can be recorded without allocating. */
+static int balloon_reserve_runs(unsigned long n)
+{
+    struct balloon_run *new;
+    unsigned long max;
+
+    if ( nr_runs + n <= max_runs )
+        return 0;
+
+    max = (nr_runs + n + 63) & ~63UL;
+    new = realloc(runs, max * sizeof(*runs));
+    if ( !new )
+        return -ENOMEM;
+    runs = new;
+    max_runs = max;
+
+    return 0;
+}
+
+/* Room has to be reserved by balloon_reserve_runs(). */
+static void balloon_add_run(unsigned long pfn, unsigned long nr)
+{
+    if ( nr_runs && runs[nr_runs - 1].pfn + runs[nr_runs - 1].nr == pfn )
+    {
+        runs[nr_runs - 1].nr += nr;
+        return;
+    }
+
+    ASSERT(nr_runs < max_runs);
+    runs[nr_runs].pfn = pfn;
+    runs[nr_runs].nr = nr;
+    nr_runs++;
+}
+
+/* Repopulate pfns released by balloon_down(), last run first. */
+static int balloon_refill(unsigned long n_pages)
+{
+    struct balloon_run *run = &runs[nr_runs - 1];
+    unsigned long i;
     int rc;
     struct xen_memory_reservation reservation = {
         .domid        = DOMID_SELF
     };
 
-    if ( n_pages > nr_max_pages - nr_mem_pages )
-        n_pages = nr_max_pages - nr_mem_pages;
+    if ( n_pages > run->nr )
+        n_pages = run->nr;
     if ( n_pages > N_BALLOON_FRAMES )
         n_pages = N_BALLOON_FRAMES;
 
+    for ( i = 0; i < n_pages; i++ )
+        balloon_frames[i] = run->pfn + i;
+    set_xen_guest_handle(reservation.extent_start, balloon_frames);
+    reservation.nr_extents = n_pages;
+    rc = HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
+    if ( rc <= 0 )
+        return rc;
+
+    for ( i = 0; i < rc; i++ )
+        arch_pfn_add(run->pfn + i, balloon_frames[i]);
+    balloon_free_range(run->pfn, rc);
+
+    run->pfn += rc;
+    run->nr -= rc;
+    if ( !run->nr )
+        nr_runs--;
+    nr_ballooned_pages -= rc;
+
+    return rc;
+}
+
+int balloon_up(unsigned long n_pages)
+{
+    unsigned long page, pfn, i, nr_extents;
+    int rc, order;
+    struct xen_memory_reservation reservation = {
+        .domid        = DOMID_SELF
+    };
+
+    if ( nr_runs )
+        return balloon_refill(n_pages);
+
+    if ( n_pages > nr_max_pages - nr_mem_pages )
+        n_pages = nr_max_pages - nr_mem_pages;
+
+    /* Use large extents once the end of memory is suitably aligned. */
+    order = BALLOON_CHUNK_ORDER;
+    if ( n_pages < (1UL << order) || (nr_mem_pages & ((1UL << order) - 1)) )
+    {
+        order = 0;
+        i = (1UL << BALLOON_CHUNK_ORDER) -
+            (nr_mem_pages & ((1UL << BALLOON_CHUNK_ORDER) - 1));
+        if ( n_pages > i )
+            n_pages = i;
+    }
+    nr_extents = n_pages >> order;
+    if ( nr_extents > N_BALLOON_FRAMES )
+        nr_extents = N_BALLOON_FRAMES;
+    n_pages = nr_extents << order;
+    if ( !n_pages )
+        return 0;
+
     /* Resize alloc_bitmap if necessary. */
     while ( mm_alloc_bitmap_size * 8 < nr_mem_pages + n_pages )
     {
@@ -104,46 +242,170 @@ int balloon_up(unsigned long n_pages)
         return rc;
 
     /* Get new memory from hypervisor. */
-    for ( pfn = 0; pfn < n_pages; pfn++ )
+ retry:
+    for ( i = 0; i < nr_extents; i++ )
     {
-        balloon_frames[pfn] = nr_mem_pages + pfn;
+        balloon_frames[i] = nr_mem_pages + (i << order);
     }
     set_xen_guest_handle(reservation.extent_start, balloon_frames);
-    reservation.nr_extents = n_pages;
+    reservation.nr_extents = nr_extents;
+    reservation.extent_order = order;
     rc = HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
+    if ( rc <= 0 && order )
+    {
+        /* No contiguous memory left in Xen, fall back to single pages. */
+        nr_extents = n_pages < N_BALLOON_FRAMES ? n_pages : N_BALLOON_FRAMES;
+        order = 0;
+        goto retry;
+    }
     if ( rc <= 0 )
         return rc;
 
-    for ( pfn = 0; pfn < rc; pfn++ )
+    for ( i = 0; i < rc; i++ )
     {
-        arch_pfn_add(nr_mem_pages + pfn, balloon_frames[pfn]);
-        free_page(pfn_to_virt(nr_mem_pages + pfn));
+        pfn = nr_mem_pages + (i << order);
+        for ( page = 0; page < (1UL << order); page++ )
+            arch_pfn_add(pfn + page, balloon_frames[i] + page);
+        __free_pages(pfn_to_virt(pfn), order);
     }
 
-    nr_mem_pages += rc;
+    nr_mem_pages += (unsigned long)rc << order;
 
-    return rc;
+    return rc << order;
+}
+
+/*
+ * Give up to n_pages free pages back to Xen, taking the largest chunks the
+ * buddy allocator has to offer.  Returns the number of pages released.
+ */
+int balloon_down(unsigned long n_pages)
+{
+    unsigned long done = 0, nr, nr_chunks, page, i, j, k;
+    int max_order = BALLOON_CHUNK_ORDER;
+    int order, rel, rc;
+    struct xen_memory_reservation reservation = {
+        .domid        = DOMID_SELF
+    };
+
+    while ( done < n_pages )
+    {
+        order = max_order;
+        while ( order && (1UL << order) > n_pages - done )
+            order--;
+        rel = release_order(order);
+
+        /* Collect a batch of chunks of this order. */
+        nr = 0;
+        nr_chunks = 0;
+        while ( done + ((nr_chunks + 1) << order) <= n_pages &&
+                nr + (1UL << (order - rel)) <= N_BALLOON_FRAMES &&
+                nr_free_pages >= (1UL << order) + BALLOON_EMERGENCY_PAGES )
+        {
+            page = __alloc_pages(order);
+            if ( !page )
+                break;
+            balloon_pfns[nr_chunks++] = virt_to_pfn(page);
+            for ( j = 0; j < (1UL << order); j += 1UL << rel )
+                balloon_frames[nr++] = pfn_to_mfn(virt_to_pfn(page) + j);
+        }
+        if ( !nr_chunks )
+        {
+            /* Nothing free at this order, retry with smaller chunks. */
+            if ( !order )
+                break;
+            max_order = order - 1;
+            continue;
+        }
+
+        /* Every extent Xen takes may start a run, keep memory otherwise. */
+        if ( balloon_reserve_runs(nr) )
+        {
+            for ( i = 0; i < nr_chunks; i++ )
+                __free_pages(pfn_to_virt(balloon_pfns[i]), order);
+            break;
+        }
+
+        for ( i = 0; i < nr_chunks; i++ )
+            arch_pfn_remove(balloon_pfns[i], 1UL << order);
+
+        set_xen_guest_handle(reservation.extent_start, balloon_frames);
+        reservation.nr_extents = nr;
+        reservation.extent_order = rel;
+        rc = HYPERVISOR_memory_op(XENMEM_decrease_reservation, &reservation);
+        if ( rc < 0 )
+            rc = 0;
+
+        /* Record what Xen took, put anything it refused back in service. */
+        for ( i = 0; i < nr; i++ )
+        {
+            page = balloon_pfns[i >> (order - rel)] +
+                   ((i & ((1UL << (order - rel)) - 1)) << rel);
+            if ( i < rc )
+            {
+                balloon_add_run(page, 1UL << rel);
+                continue;
+            }
+            for ( k = 0; k < (1UL << rel); k++ )
+                arch_pfn_add(page + k, balloon_frames[i] + k);
+            __free_pages(pfn_to_virt(page), rel);
+        }
+        done += (unsigned long)rc << rel;
+        nr_ballooned_pages += (unsigned long)rc << rel;
+        if ( rc < nr )
+            break;
+    }
+
+    return done;
 }
 
-static int in_balloon;
+/* Grow or shrink towards target_pages owned pages. */
+static void balloon_set_target(unsigned long target_pages)
+{
+    unsigned long cur;
+    int rc;
+
+    if ( !_raw_spin_trylock(&balloon_lock) )
+        return;
 
-int chk_free_pages(unsigned long needed)
+    if ( target_pages > nr_max_pages )
+        target_pages = nr_max_pages;
+
+    for ( ;; )
+    {
+        cur = nr_mem_pages - nr_ballooned_pages;
+        if ( cur < target_pages )
+            rc = balloon_up(target_pages - cur);
+        else if ( cur > target_pages )
+            rc = balloon_down(cur - target_pages);
+        else
+            break;
+        if ( rc <= 0 )
+            break;
+    }
+
+    _raw_spin_unlock(&balloon_lock);
+}
+
+int __chk_free_pages(unsigned long needed)
 {
     unsigned long n_pages;
 
-    /* No need for ballooning if plenty of space available. */
-    if ( needed + BALLOON_EMERGENCY_PAGES <= nr_free_pages )
-        return 1;
-
     /* If we are already ballooning up just hope for the best. */
-    if ( in_balloon )
+    if ( spin_is_locked(&balloon_lock) )
         return 1;
 
     /* Interrupts disabled can't be handled right now. */
     if ( irqs_disabled() )
         return 1;
 
-    in_balloon = 1;
+    /* Try to get by with deferred memory and what caches give back first. */
+    if ( needed + BALLOON_EMERGENCY_PAGES > nr_free_pages )
+        deferred_mem_init(needed + BALLOON_EMERGENCY_PAGES - nr_free_pages);
+    if ( needed + BALLOON_EMERGENCY_PAGES > nr_free_pages )
+        shrink_memory(needed + BALLOON_EMERGENCY_PAGES - nr_free_pages);
+
+    if ( !_raw_spin_trylock(&balloon_lock) )
+        return 1;
 
     while ( needed + BALLOON_EMERGENCY_PAGES > nr_free_pages )
     {
@@ -152,7 +414,49 @@ int chk_free_pages(unsigned long needed)
             break;
     }
 
-    in_balloon = 0;
+    _raw_spin_unlock(&balloon_lock);
 
     return needed <= nr_free_pages;
 }
+
+#ifdef CONFIG_XENBUS
+static const char *target_path = "memory/target";
+
+/* Follow the memory target set by the toolstack, in KiB. */
+static void balloon_thread(void *p)
+{
+    xenbus_event_queue events = NULL;
+    char *err, *buf;
+    unsigned long target;
+
+    err = xenbus_watch_path_token(XBT_NIL, target_path, target_path, &events);
+    if ( err )
+    {
+        printk("balloon: could not watch %s: %s\n", target_path, err);
+        free(err);
+        return;
+    }
+
+    for ( ;; )
+    {
+        xenbus_wait_for_watch(&events);
+        /* Too large for xenbus_read_integer() with more than 2T. */
+        err = xenbus_read(XBT_NIL, target_path, &buf);
+        if ( err )
+        {
+            free(err);
+            continue;
+        }
+        target = strtoul(buf, NULL, 10);
+        free(buf);
+        if ( !target )
+            continue;
+        balloon_set_target(target >> (PAGE_SHIFT - 10));
+    }
+}
+
+void init_balloon(void)
+{
+    create_thread("balloon", balloon_thread, NULL);
+}
+#endif
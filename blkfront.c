@@ -15,10 +15,12 @@
 #include <time.h>
 #include <mini-os/blkfront.h>
 #include <mini-os/lib.h>
+#include <mini-os/spinlock.h>
 #include <fcntl.h>
 
 /* Note: we generally don't need to disable IRQs since we hardly do anything in
- * the interrupt handler.  */
+ * the interrupt handler.  Threads on other vCPUs may use the ring too though,
+ * hence dev->lock.  */
 
 /* Note: we really suppose non-preemptive threads.  */
 
@@ -39,6 +41,7 @@ struct blk_buffer {
 struct blkfront_dev {
     domid_t dom;
 
+    spinlock_t lock;            /* Covers ring. */
     struct blkif_front_ring ring;
     grant_ref_t ring_ref;
     evtchn_port_t evtchn;
@@ -105,13 +108,14 @@ struct blkfront_dev *init_blkfront(char *_nodename, struct blkfront_info *info)
 #ifdef HAVE_LIBC
     dev->fd = -1;
 #endif
+    spin_lock_init(&dev->lock);
 
     snprintf(path, sizeof(path), "%s/backend-id", nodename);
     dev->dom = xenbus_read_integer(path); 
     evtchn_alloc_unbound(dev->dom, blkfront_handler, dev, &dev->evtchn);
+    evtchn_spread(dev->evtchn);
 
-    s = (struct blkif_sring*) alloc_page();
-    memset(s,0,PAGE_SIZE);
+    s = (struct blkif_sring*) alloc_zeroed_page();
 
 
     SHARED_RING_INIT(s);
@@ -327,6 +331,17 @@ static void blkfront_wait_slot(struct blkfront_dev *dev)
     }
 }
 
+/* Return with dev->lock held and a free slot in the ring. */
+static void blkfront_get_slot(struct blkfront_dev *dev, unsigned long *flags)
+{
+    spin_lock_irqsave(&dev->lock, *flags);
+    while (RING_FULL(&dev->ring)) {
+        spin_unlock_irqrestore(&dev->lock, *flags);
+        blkfront_wait_slot(dev);
+        spin_lock_irqsave(&dev->lock, *flags);
+    }
+}
+
 /* Issue an aio */
 void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
 {
@@ -336,6 +351,7 @@ void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
     int notify;
     int n, j;
     uintptr_t start, end;
+    unsigned long flags;
 
     // Can't io at non-sector-aligned location
     ASSERT(!(aiocbp->aio_offset & (dev->info.sector_size-1)));
@@ -352,7 +368,19 @@ void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
      * so max 44KB can't happen */
     ASSERT(n <= BLKIF_MAX_SEGMENTS_PER_REQUEST);
 
-    blkfront_wait_slot(dev);
+    /* Granting may block, so before taking a slot. */
+    for (j = 0; j < n; j++) {
+	uintptr_t data = start + j * PAGE_SIZE;
+        if (!write) {
+            /* Trigger CoW if needed */
+            *(char*)(j ? data : (uintptr_t)aiocbp->aio_buf) = 0;
+            barrier();
+        }
+	aiocbp->gref[j] =
+            gnttab_grant_access(dev->dom, virtual_to_mfn(data), write);
+    }
+
+    blkfront_get_slot(dev, &flags);
     i = dev->ring.req_prod_pvt;
     req = RING_GET_REQUEST(&dev->ring, i);
 
@@ -365,24 +393,16 @@ void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
     for (j = 0; j < n; j++) {
         req->seg[j].first_sect = 0;
         req->seg[j].last_sect = PAGE_SIZE / 512 - 1;
+        req->seg[j].gref = aiocbp->gref[j];
     }
     req->seg[0].first_sect = ((uintptr_t)aiocbp->aio_buf & ~PAGE_MASK) / 512;
     req->seg[n-1].last_sect = (((uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes - 1) & ~PAGE_MASK) / 512;
-    for (j = 0; j < n; j++) {
-	uintptr_t data = start + j * PAGE_SIZE;
-        if (!write) {
-            /* Trigger CoW if needed */
-            *(char*)(data + (req->seg[j].first_sect << 9)) = 0;
-            barrier();
-        }
-	aiocbp->gref[j] = req->seg[j].gref =
-            gnttab_grant_access(dev->dom, virtual_to_mfn(data), write);
-    }
 
     dev->ring.req_prod_pvt = i + 1;
 
     wmb();
     RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
+    spin_unlock_irqrestore(&dev->lock, flags);
 
     if(notify) notify_remote_via_evtchn(dev->evtchn);
 }
@@ -423,8 +443,9 @@ static void blkfront_push_operation(struct blkfront_dev *dev, uint8_t op, uint64
     int i;
     struct blkif_request *req;
     int notify;
+    unsigned long flags;
 
-    blkfront_wait_slot(dev);
+    blkfront_get_slot(dev, &flags);
     i = dev->ring.req_prod_pvt;
     req = RING_GET_REQUEST(&dev->ring, i);
     req->operation = op;
@@ -436,6 +457,7 @@ static void blkfront_push_operation(struct blkfront_dev *dev, uint8_t op, uint64
     dev->ring.req_prod_pvt = i + 1;
     wmb();
     RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
+    spin_unlock_irqrestore(&dev->lock, flags);
     if (notify) notify_remote_via_evtchn(dev->evtchn);
 }
 
@@ -474,12 +496,17 @@ void blkfront_sync(struct blkfront_dev *dev)
     local_irq_restore(flags);
 }
 
+/*
+ * Responses are taken off the ring one at a time under dev->lock, which is
+ * dropped to complete them: callbacks may issue new requests or poll again.
+ */
 int blkfront_aio_poll(struct blkfront_dev *dev)
 {
     RING_IDX rp, cons;
     struct blkif_response *rsp;
     int more;
     int nr_consumed;
+    unsigned long flags;
 
 moretodo:
 #ifdef HAVE_LIBC
@@ -489,23 +516,30 @@ moretodo:
     }
 #endif
 
-    rp = dev->ring.sring->rsp_prod;
-    rmb(); /* Ensure we see queued responses up to 'rp'. */
-    cons = dev->ring.rsp_cons;
-
     nr_consumed = 0;
-    while ((cons != rp))
+    spin_lock_irqsave(&dev->lock, flags);
+    while (1)
     {
         struct blkfront_aiocb *aiocbp;
-        int status;
+        int status, operation;
+
+        rp = dev->ring.sring->rsp_prod;
+        rmb(); /* Ensure we see queued responses up to 'rp'. */
+        cons = dev->ring.rsp_cons;
+        if (cons == rp)
+            break;
 
 	rsp = RING_GET_RESPONSE(&dev->ring, cons);
 	nr_consumed++;
 
         aiocbp = (void*) (uintptr_t) rsp->id;
         status = rsp->status;
+        operation = rsp->operation;
+        /* The slot may be reused as soon as it is consumed. */
+        dev->ring.rsp_cons = ++cons;
+        spin_unlock_irqrestore(&dev->lock, flags);
 
-        switch (rsp->operation) {
+        switch (operation) {
         case BLKIF_OP_READ:
         case BLKIF_OP_WRITE:
         {
@@ -513,7 +547,7 @@ moretodo:
 
             if (status != BLKIF_RSP_OKAY)
                 printk("%s error %d on %s at offset %llu, num bytes %llu\n",
-                        rsp->operation == BLKIF_OP_READ?"read":"write",
+                        operation == BLKIF_OP_READ?"read":"write",
                         status, aiocbp->aio_dev->nodename,
                         (unsigned long long) aiocbp->aio_offset,
                         (unsigned long long) aiocbp->aio_nbytes);
@@ -534,20 +568,18 @@ moretodo:
             break;
 
         default:
-            printk("unrecognized block operation %d response (status %d)\n", rsp->operation, status);
+            printk("unrecognized block operation %d response (status %d)\n", operation, status);
             break;
         }
 
-        dev->ring.rsp_cons = ++cons;
         /* Nota: callback frees aiocbp itself */
         if (aiocbp && aiocbp->aio_cb)
             aiocbp->aio_cb(aiocbp, status ? -EIO : 0);
-        if (dev->ring.rsp_cons != cons)
-            /* We reentered, we must not continue here */
-            break;
+        spin_lock_irqsave(&dev->lock, flags);
     }
 
     RING_FINAL_CHECK_FOR_RESPONSES(&dev->ring, more);
+    spin_unlock_irqrestore(&dev->lock, flags);
     if (more) goto moretodo;
 
     return nr_consumed;
@@ -93,8 +93,7 @@ struct consfront_dev *init_consfront(char *_nodename)
         dev->dom = res;
     evtchn_alloc_unbound(dev->dom, console_handle_input, dev, &dev->evtchn);
 
-    dev->ring = (struct xencons_interface *) alloc_page();
-    memset(dev->ring, 0, PAGE_SIZE);
+    dev->ring = (struct xencons_interface *) alloc_zeroed_page();
     dev->ring_ref = gnttab_grant_access(dev->dom, virt_to_mfn(dev->ring), 0);
 
     dev->events = NULL;
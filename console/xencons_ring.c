@@ -206,7 +206,7 @@ static struct consfront_dev* resume_xen_console(struct consfront_dev* dev)
     dev->ring = xencons_interface();
 
     err = bind_evtchn(dev->evtchn, console_handle_input, dev);
-    if (err <= 0) {
+    if (err < 0) {
         printk("XEN console request chn bind failed %i\n", err);
         free(dev);
         return NULL;
@@ -21,9 +21,17 @@
 #include <mini-os/hypervisor.h>
 #include <mini-os/events.h>
 #include <mini-os/lib.h>
+#include <mini-os/errno.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/smp.h>
 #include <xen/xsm/flask_op.h>
 
-#define NR_EVS 1024
+/*
+ * The handler table starts with the NR_EVS_BOOT ports available before
+ * memory management is up, and grows when a higher port gets bound.
+ */
+#define NR_EVS_BOOT 64
+#define NR_EVS_MAX  EVTCHN_2L_NR_CHANNELS
 
 /* this represents a event handler. Chaining or sharing is not allowed */
 typedef struct _ev_action_t {
@@ -32,19 +40,141 @@ typedef struct _ev_action_t {
     uint32_t count;
 } ev_action_t;
 
-static ev_action_t ev_actions[NR_EVS];
+static ev_action_t ev_actions_boot[NR_EVS_BOOT];
+static ev_action_t *ev_actions = ev_actions_boot;
+static unsigned int nr_evs = NR_EVS_BOOT;
 void default_handler(evtchn_port_t port, struct pt_regs *regs, void *data);
 
-static unsigned long bound_ports[NR_EVS/(8*sizeof(unsigned long))];
+static unsigned long bound_ports[NR_EVS_MAX/(8*sizeof(unsigned long))];
+
+#ifdef CONFIG_SMP
+/*
+ * Ports are delivered to the vCPU they are bound to, vCPU 0 unless bound
+ * to another one by bind_virq(), bind_ipi() or evtchn_bind_vcpu().
+ */
+unsigned long cpu_evtchn_mask[NR_CPUS][NR_EVS_MAX/(8*sizeof(unsigned long))];
+static uint8_t evtchn_cpus[NR_EVS_MAX];
+
+static void set_evtchn_cpu(evtchn_port_t port, unsigned int cpu)
+{
+    clear_bit(port, cpu_evtchn_mask[evtchn_cpus[port]]);
+    evtchn_cpus[port] = cpu;
+    set_bit(port, cpu_evtchn_mask[cpu]);
+}
+
+unsigned int evtchn_cpu(evtchn_port_t port)
+{
+    return evtchn_cpus[port];
+}
+
+int evtchn_bind_vcpu(evtchn_port_t port, unsigned int cpu)
+{
+    evtchn_bind_vcpu_t op;
+    int rc;
+
+    if ( cpu >= nr_cpus )
+        return -EINVAL;
+
+    op.port = port;
+    op.vcpu = cpu;
+    rc = HYPERVISOR_event_channel_op(EVTCHNOP_bind_vcpu, &op);
+    if ( rc )
+    {
+        printk("WARN: binding port %d to vCPU %u failed rc=%d\n",
+               port, cpu, rc);
+        return rc;
+    }
+    set_evtchn_cpu(port, cpu);
+    return 0;
+}
+
+void evtchn_spread(evtchn_port_t port)
+{
+    static unsigned int next_cpu;
+    unsigned int cpu = ++next_cpu % nr_cpus;
+
+    /* Leaves the port on vCPU 0 if that fails. */
+    if ( cpu )
+        evtchn_bind_vcpu(port, cpu);
+}
+
+/*
+ * Wait until no other vCPU can still be using the handler table from before
+ * it was replaced: each one has either not been in its event callback at
+ * the time, or has left it and entered a new one since.
+ */
+static void evtchn_sync(void)
+{
+    volatile struct pda *p;
+    unsigned int cpu, seq[NR_CPUS];
+    int busy[NR_CPUS];
+
+    /* Order the switch to the new table before looking at the others. */
+    mb();
+    for ( cpu = 0; cpu < nr_cpus; cpu++ )
+    {
+        p = &pda[cpu];
+        busy[cpu] = p->callback;
+        seq[cpu] = p->callbacks;
+    }
+    for ( cpu = 0; cpu < nr_cpus; cpu++ )
+    {
+        if ( cpu == smp_processor_id() || !busy[cpu] )
+            continue;
+        p = &pda[cpu];
+        while ( p->callback && p->callbacks == seq[cpu] )
+            barrier();
+    }
+}
+#endif
+
+/* Make room for handlers of ports below nr. */
+static int grow_ev_actions(unsigned int nr)
+{
+    ev_action_t *new, *old = ev_actions;
+    unsigned long flags;
+    unsigned int i, n;
+
+    for ( n = nr_evs * 2; n < nr; n *= 2 )
+        ;
+    if ( n > NR_EVS_MAX )
+        n = NR_EVS_MAX;
+
+    new = xmalloc_array(ev_action_t, n);
+    if ( !new )
+        return -ENOMEM;
+    for ( i = nr_evs; i < n; i++ )
+    {
+        new[i].handler = default_handler;
+        new[i].data = NULL;
+        new[i].count = 0;
+    }
+
+    local_irq_save(flags);
+    memcpy(new, old, nr_evs * sizeof(*new));
+    ev_actions = new;
+    wmb();
+    nr_evs = n;
+    local_irq_restore(flags);
+
+#ifdef CONFIG_SMP
+    /* Another vCPU may still be looking at the old table. */
+    evtchn_sync();
+#endif
+    if ( old != ev_actions_boot )
+        xfree(old);
+
+    return 0;
+}
 
 void unbind_all_ports(void)
 {
     int i;
-    int cpu = 0;
+    int cpu;
     shared_info_t *s = HYPERVISOR_shared_info;
-    vcpu_info_t   *vcpu_info = &s->vcpu_info[cpu];
+    vcpu_info_t   *vcpu_info;
 
-    for ( i = 0; i < NR_EVS; i++ )
+    for ( i = 0; i < nr_evs; i++ )
     {
         if ( i == console_evtchn || i == xenbus_evtchn )
             continue;
@@ -55,8 +185,12 @@ void unbind_all_ports(void)
 	    unbind_evtchn(i);
         }
     }
-    vcpu_info->evtchn_upcall_pending = 0;
-    vcpu_info->evtchn_pending_sel = 0;
+    for ( cpu = 0; cpu < nr_cpus; cpu++ )
+    {
+        vcpu_info = &s->vcpu_info[cpu];
+        vcpu_info->evtchn_upcall_pending = 0;
+        vcpu_info->evtchn_pending_sel = 0;
+    }
 }
 
 /*
@@ -68,7 +202,7 @@ int do_event(evtchn_port_t port, struct pt_regs *regs)
 
     clear_evtchn(port);
 
-    if ( port >= NR_EVS )
+    if ( port >= nr_evs )
     {
         printk("WARN: do_event(): Port number too large: %d\n", port);
         return 1;
@@ -84,9 +218,16 @@ int do_event(evtchn_port_t port, struct pt_regs *regs)
 
 }
 
-evtchn_port_t bind_evtchn(evtchn_port_t port, evtchn_handler_t handler,
-						  void *data)
+/* Returns port, or a negative errno if there is no room for its handler. */
+int bind_evtchn(evtchn_port_t port, evtchn_handler_t handler, void *data)
 {
+    if ( port >= nr_evs &&
+         (port >= NR_EVS_MAX || grow_ev_actions(port + 1)) )
+    {
+        printk("ERROR: No room for a handler for port %d\n", port);
+        return -ENOMEM;
+    }
+
  	if ( ev_actions[port].handler != default_handler )
         printk("WARN: Handler for port %d already registered, replacing\n",
                port);
@@ -95,15 +236,28 @@ evtchn_port_t bind_evtchn(evtchn_port_t port, evtchn_handler_t handler,
 	wmb();
 	ev_actions[port].handler = handler;
 	set_bit(port, bound_ports);
+#ifdef CONFIG_SMP
+	/* Where Xen delivers new ports. */
+	set_evtchn_cpu(port, 0);
+#endif
 
 	return port;
 }
 
-void unbind_evtchn(evtchn_port_t port )
+static void close_port(evtchn_port_t port)
 {
     struct evtchn_close close;
     int rc;
 
+    close.port = port;
+    rc = HYPERVISOR_event_channel_op(EVTCHNOP_close, &close);
+    if ( rc )
+        printk("WARN: close_port %d failed rc=%d. ignored\n", port, rc);
+}
+
+void unbind_evtchn(evtchn_port_t port )
+{
+    BUG_ON(port >= nr_evs);
     if ( ev_actions[port].handler == default_handler )
         printk("WARN: No handler for port %d when unbinding\n", port);
     mask_evtchn(port);
@@ -114,10 +268,7 @@ void unbind_evtchn(evtchn_port_t port )
     ev_actions[port].data = NULL;
     clear_bit(port, bound_ports);
 
-    close.port = port;
-    rc = HYPERVISOR_event_channel_op(EVTCHNOP_close, &close);
-    if ( rc )
-        printk("WARN: close_port %d failed rc=%d. ignored\n", port, rc);
+    close_port(port);
 }
 
 evtchn_port_t bind_virq(uint32_t virq, evtchn_handler_t handler, void *data)
@@ -135,10 +286,41 @@ evtchn_port_t bind_virq(uint32_t virq, evtchn_handler_t handler, void *data)
 		printk("Failed to bind virtual IRQ %d with rc=%d\n", virq, rc);
 		return -1;
     }
-    bind_evtchn(op.port, handler, data);
+    if ( bind_evtchn(op.port, handler, data) < 0 )
+    {
+        close_port(op.port);
+        return -1;
+    }
+#ifdef CONFIG_SMP
+    set_evtchn_cpu(op.port, op.vcpu);
+#endif
 	return op.port;
 }
 
+#ifdef CONFIG_SMP
+/* A port for notifying the calling vCPU, see smp_send_reschedule(). */
+evtchn_port_t bind_ipi(evtchn_handler_t handler, void *data)
+{
+    evtchn_bind_ipi_t op;
+    int rc;
+
+    op.vcpu = smp_processor_id();
+    rc = HYPERVISOR_event_channel_op(EVTCHNOP_bind_ipi, &op);
+    if ( rc != 0 )
+    {
+        printk("Failed to bind IPI with rc=%d\n", rc);
+        return -1;
+    }
+    if ( bind_evtchn(op.port, handler, data) < 0 )
+    {
+        close_port(op.port);
+        return -1;
+    }
+    set_evtchn_cpu(op.port, op.vcpu);
+    return op.port;
+}
+#endif
+
 evtchn_port_t bind_pirq(uint32_t pirq, int will_share,
                         evtchn_handler_t handler, void *data)
 {
@@ -154,7 +336,11 @@ evtchn_port_t bind_pirq(uint32_t pirq, int will_share,
 		printk("Failed to bind physical IRQ %d with rc=%d\n", pirq, rc);
 		return -1;
 	}
-	bind_evtchn(op.port, handler, data);
+	if ( bind_evtchn(op.port, handler, data) < 0 )
+	{
+		close_port(op.port);
+		return -1;
+	}
 	return op.port;
 }
 
@@ -166,11 +352,13 @@ void init_events(void)
     int i;
 
     /* initialize event handler */
-    for ( i = 0; i < NR_EVS; i++ )
-	{
+    for ( i = 0; i < NR_EVS_BOOT; i++ )
         ev_actions[i].handler = default_handler;
+    for ( i = 0; i < NR_EVS_MAX; i++ )
         mask_evtchn(i);
-    }
+#ifdef CONFIG_SMP
+    memset(cpu_evtchn_mask[0], 0xff, sizeof(cpu_evtchn_mask[0]));
+#endif
 
     arch_init_events();
 }
@@ -194,7 +382,8 @@ void default_handler(evtchn_port_t port, struct pt_regs *regs, void *ignore)
 }
 
 /* Create a port available to the pal for exchanging notifications.
-   Returns the result of the hypervisor call. */
+   Returns the result of the hypervisor call, or a negative errno if the
+   handler could not be bound. */
 
 /* Unfortunate confusion of terminology: the port is unbound as far
    as Xen is concerned, but we automatically bind a handler to it
@@ -214,12 +403,19 @@ int evtchn_alloc_unbound(domid_t pal, evtchn_handler_t handler,
         printk("ERROR: alloc_unbound failed with rc=%d", rc);
 		return rc;
     }
-    *port = bind_evtchn(op.port, handler, data);
-    return rc;
+    rc = bind_evtchn(op.port, handler, data);
+    if ( rc < 0 )
+    {
+        close_port(op.port);
+        return rc;
+    }
+    *port = op.port;
+    return 0;
 }
 
 /* Connect to a port so as to allow the exchange of notifications with
-   the pal. Returns the result of the hypervisor call. */
+   the pal. Returns the result of the hypervisor call, or a negative errno
+   if the handler could not be bound. */
 
 int evtchn_bind_interdomain(domid_t pal, evtchn_port_t remote_port,
 			    evtchn_handler_t handler, void *data,
@@ -237,8 +433,14 @@ int evtchn_bind_interdomain(domid_t pal, evtchn_port_t remote_port,
 		return rc;
     }
     port = op.local_port;
-    *local_port = bind_evtchn(port, handler, data);
-    return rc;
+    rc = bind_evtchn(port, handler, data);
+    if ( rc < 0 )
+    {
+        close_port(port);
+        return rc;
+    }
+    *local_port = port;
+    return 0;
 }
 
 int evtchn_get_peercontext(evtchn_port_t local_port, char *ctx, int size)
@@ -90,8 +90,7 @@ struct kbdfront_dev *init_kbdfront(char *_nodename, int abs_pointer)
     dev->dom = xenbus_read_integer(path); 
     evtchn_alloc_unbound(dev->dom, kbdfront_handler, dev, &dev->evtchn);
 
-    dev->page = s = (struct xenkbd_page*) alloc_page();
-    memset(s,0,PAGE_SIZE);
+    dev->page = s = (struct xenkbd_page*) alloc_zeroed_page();
 
     dev->events = NULL;
 
@@ -433,8 +432,7 @@ struct fbfront_dev *init_fbfront(char *_nodename, unsigned long *mfns, int width
     dev->dom = xenbus_read_integer(path); 
     evtchn_alloc_unbound(dev->dom, fbfront_handler, dev, &dev->evtchn);
 
-    dev->page = s = (struct xenfb_page*) alloc_page();
-    memset(s,0,PAGE_SIZE);
+    dev->page = s = (struct xenfb_page*) alloc_zeroed_page();
 
     s->in_cons = s->in_prod = 0;
     s->out_cons = s->out_prod = 0;
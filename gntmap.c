@@ -48,6 +48,8 @@
 
 
 #define DEFAULT_MAX_GRANTS 128
+/* Maps that grow on demand stop at this many entries. */
+#define GROW_MAX_GRANTS 65536
 
 struct gntmap_entry {
     unsigned long host_addr;
@@ -60,6 +62,29 @@ gntmap_entry_used(struct gntmap_entry *entry)
     return entry->host_addr != 0;
 }
 
+/* Double the size of a map that was not given an explicit maximum. */
+static int
+gntmap_grow(struct gntmap *map)
+{
+    struct gntmap_entry *entries;
+    int count = map->nentries * 2;
+
+    if (count > GROW_MAX_GRANTS)
+        count = GROW_MAX_GRANTS;
+    if (!map->growable || count <= map->nentries)
+        return -ENOSPC;
+
+    entries = realloc(map->entries, sizeof(struct gntmap_entry) * count);
+    if (entries == NULL)
+        return -ENOMEM;
+
+    memset(entries + map->nentries, 0,
+           sizeof(struct gntmap_entry) * (count - map->nentries));
+    map->entries = entries;
+    map->nentries = count;
+    return 0;
+}
+
 static struct gntmap_entry*
 gntmap_find_free_entry(struct gntmap *map)
 {
@@ -72,6 +97,9 @@ gntmap_find_free_entry(struct gntmap *map)
 
     DEBUG("(map=%p): all %d entries full",
            map, map->nentries);
+
+    if (gntmap_grow(map) == 0)
+        return &map->entries[i];
     return NULL;
 }
 
@@ -101,6 +129,7 @@ gntmap_set_max_grants(struct gntmap *map, int count)
 
     memset(map->entries, 0, sizeof(struct gntmap_entry) * count);
     map->nentries = count;
+    map->growable = 0;
     return 0;
 }
 
@@ -177,6 +206,7 @@ gntmap_munmap(struct gntmap *map, unsigned long start_address, int count)
             return rc;
     }
 
+    free_ondemand(start_address, count);
     return 0;
 }
 
@@ -199,7 +229,8 @@ gntmap_map_grant_refs(struct gntmap *map,
            domids, domids == NULL ? 0 : domids[0], domids_stride,
            refs, refs == NULL ? 0 : refs[0], writable);
 
-    (void) gntmap_set_max_grants(map, DEFAULT_MAX_GRANTS);
+    if (gntmap_set_max_grants(map, DEFAULT_MAX_GRANTS) == 0)
+        map->growable = 1;
 
     addr = allocate_ondemand((unsigned long) count, 1);
     if (addr == 0)
@@ -215,6 +246,7 @@ gntmap_map_grant_refs(struct gntmap *map,
                                   writable) != 0) {
 
             (void) gntmap_munmap(map, addr, i);
+            free_ondemand(addr + PAGE_SIZE * i, count - i);
             return NULL;
         }
     }
@@ -227,6 +259,7 @@ gntmap_init(struct gntmap *map)
 {
     DEBUG("(map=%p)", map);
     map->nentries = 0;
+    map->growable = 0;
     map->entries = NULL;
 }
 
@@ -17,44 +17,131 @@
  */
 #include <mini-os/os.h>
 #include <mini-os/mm.h>
+#include <mini-os/kernel.h>
 #include <mini-os/gnttab.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/xmalloc.h>
+#include <mini-os/spinlock.h>
 
 #define NR_RESERVED_ENTRIES 8
 
-/* NR_GRANT_FRAMES must be less than or equal to that configured in Xen */
+/*
+ * The table starts with gnttab_frames frames (NR_GRANT_FRAMES by default)
+ * and is doubled when it runs out of entries, up to gnttab_max_frames or
+ * what Xen allows.
+ */
 #define NR_GRANT_FRAMES 4
-#define NR_GRANT_ENTRIES (NR_GRANT_FRAMES * PAGE_SIZE / sizeof(grant_entry_v1_t))
+#define GREFS_PER_GRANT_FRAME (PAGE_SIZE / sizeof(grant_entry_v1_t))
+#define NR_GRANT_ENTRIES (nr_grant_frames * GREFS_PER_GRANT_FRAME)
 
 static grant_entry_v1_t *gnttab_table;
-static grant_ref_t gnttab_list[NR_GRANT_ENTRIES];
+static int nr_grant_frames, max_grant_frames;
+static grant_ref_t *gnttab_list;
 #ifdef GNT_DEBUG
-static char inuse[NR_GRANT_ENTRIES];
+static char *inuse;
 #endif
 static __DECLARE_SEMAPHORE_GENERIC(gnttab_sem, 0);
+/* The free list, also taken by callbacks that end grants. */
+static DEFINE_SPINLOCK(gnttab_lock);
+/* Only one thread may grow the table at a time. */
+static DEFINE_SPINLOCK(grow_lock);
 
 static void
 put_free_entry(grant_ref_t ref)
 {
     unsigned long flags;
-    local_irq_save(flags);
+    spin_lock_irqsave(&gnttab_lock, flags);
 #ifdef GNT_DEBUG
     BUG_ON(!inuse[ref]);
     inuse[ref] = 0;
 #endif
     gnttab_list[ref] = gnttab_list[0];
     gnttab_list[0]  = ref;
-    local_irq_restore(flags);
+    spin_unlock_irqrestore(&gnttab_lock, flags);
     up(&gnttab_sem);
 }
 
+/* Double the number of grant frames, 0 if the table cannot grow. */
+static int
+gnttab_grow(void)
+{
+    grant_ref_t *list, *old_list;
+#ifdef GNT_DEBUG
+    char *used, *old_used;
+#endif
+    unsigned long flags;
+    int i, frames;
+
+    frames = nr_grant_frames * 2;
+    if (frames > max_grant_frames)
+        frames = max_grant_frames;
+    if (frames <= nr_grant_frames)
+        return 0;
+
+    list = xmalloc_array(grant_ref_t, frames * GREFS_PER_GRANT_FRAME);
+#ifdef GNT_DEBUG
+    used = xmalloc_array(char, frames * GREFS_PER_GRANT_FRAME);
+    if (!used) {
+        xfree(list);
+        list = NULL;
+    }
+#endif
+    if (!list)
+        return 0;
+
+    if (arch_grow_gnttab(gnttab_table, nr_grant_frames, frames)) {
+        xfree(list);
+#ifdef GNT_DEBUG
+        xfree(used);
+#endif
+        max_grant_frames = nr_grant_frames;
+        return 0;
+    }
+
+    spin_lock_irqsave(&gnttab_lock, flags);
+    memcpy(list, gnttab_list, NR_GRANT_ENTRIES * sizeof(*list));
+    old_list = gnttab_list;
+    gnttab_list = list;
+#ifdef GNT_DEBUG
+    memcpy(used, inuse, NR_GRANT_ENTRIES);
+    memset(used + NR_GRANT_ENTRIES, 1,
+           (frames - nr_grant_frames) * GREFS_PER_GRANT_FRAME);
+    old_used = inuse;
+    inuse = used;
+#endif
+    i = NR_GRANT_ENTRIES;
+    nr_grant_frames = frames;
+    spin_unlock_irqrestore(&gnttab_lock, flags);
+
+    xfree(old_list);
+#ifdef GNT_DEBUG
+    xfree(old_used);
+#endif
+
+    for (; i < NR_GRANT_ENTRIES; i++)
+        put_free_entry(i);
+    printk("gnttab: grown to %d frames\n", nr_grant_frames);
+
+    return 1;
+}
+
 static grant_ref_t
 get_free_entry(void)
 {
     unsigned int ref;
     unsigned long flags;
-    down(&gnttab_sem);
-    local_irq_save(flags);
+    int grown;
+
+    if (!trydown(&gnttab_sem)) {
+        grown = 0;
+        if (spin_trylock(&grow_lock)) {
+            grown = gnttab_grow();
+            spin_unlock(&grow_lock);
+        }
+        if (!grown || !trydown(&gnttab_sem))
+            down(&gnttab_sem);
+    }
+    spin_lock_irqsave(&gnttab_lock, flags);
     ref = gnttab_list[0];
     BUG_ON(ref < NR_RESERVED_ENTRIES || ref >= NR_GRANT_ENTRIES);
     gnttab_list[0] = gnttab_list[ref];
@@ -62,7 +149,7 @@ get_free_entry(void)
     BUG_ON(inuse[ref]);
     inuse[ref] = 1;
 #endif
-    local_irq_restore(flags);
+    spin_unlock_irqrestore(&gnttab_lock, flags);
     return ref;
 }
 
@@ -172,16 +259,36 @@ gnttabop_error(int16_t status)
 void
 init_gnttab(void)
 {
+    struct gnttab_query_size query = { .dom = DOMID_SELF };
     int i;
 
+    max_grant_frames = get_boot_param("gnttab_max_frames", 0);
+    if (!HYPERVISOR_grant_table_op(GNTTABOP_query_size, &query, 1) &&
+        query.status == GNTST_okay &&
+        (!max_grant_frames || max_grant_frames > query.max_nr_frames))
+        max_grant_frames = query.max_nr_frames;
+    if (!max_grant_frames)
+        max_grant_frames = NR_GRANT_FRAMES;
+
+    nr_grant_frames = get_boot_param("gnttab_frames", NR_GRANT_FRAMES);
+    if (nr_grant_frames < 1)
+        nr_grant_frames = 1;
+    if (nr_grant_frames > max_grant_frames)
+        nr_grant_frames = max_grant_frames;
+
+    gnttab_list = xmalloc_array(grant_ref_t, NR_GRANT_ENTRIES);
+    BUG_ON(!gnttab_list);
 #ifdef GNT_DEBUG
-    memset(inuse, 1, sizeof(inuse));
+    inuse = xmalloc_array(char, NR_GRANT_ENTRIES);
+    BUG_ON(!inuse);
+    memset(inuse, 1, NR_GRANT_ENTRIES);
 #endif
     for (i = NR_RESERVED_ENTRIES; i < NR_GRANT_ENTRIES; i++)
         put_free_entry(i);
 
-    gnttab_table = arch_init_gnttab(NR_GRANT_FRAMES);
-    printk("gnttab_table mapped at %p.\n", gnttab_table);
+    gnttab_table = arch_init_gnttab(nr_grant_frames, max_grant_frames);
+    printk("gnttab_table mapped at %p, %d of up to %d frames.\n",
+           gnttab_table, nr_grant_frames, max_grant_frames);
 }
 
 void
@@ -197,10 +304,10 @@ fini_gnttab(void)
 
 void suspend_gnttab(void)
 {
-    arch_suspend_gnttab(gnttab_table, NR_GRANT_FRAMES);
+    arch_suspend_gnttab(gnttab_table, nr_grant_frames);
 }
 
 void resume_gnttab(void)
 {
-    arch_resume_gnttab(gnttab_table, NR_GRANT_FRAMES);
+    arch_resume_gnttab(gnttab_table, nr_grant_frames);
 }
@@ -29,13 +29,24 @@
 #include <mini-os/lib.h>
 #include <mini-os/hypervisor.h>
 #include <mini-os/events.h>
+#include <mini-os/preempt.h>
 #include <xen/memory.h>
 
+#ifdef CONFIG_SMP
+/* Only the ports bound to this vCPU, others are another one's business. */
+#define active_evtchns(cpu,sh,idx)              \
+    ((sh)->evtchn_pending[idx] &                \
+     ~(sh)->evtchn_mask[idx] &                  \
+     cpu_evtchn_mask[cpu][idx])
+#else
 #define active_evtchns(cpu,sh,idx)              \
     ((sh)->evtchn_pending[idx] &                \
      ~(sh)->evtchn_mask[idx])
+#endif
 
+#ifndef CONFIG_SMP
 int in_callback;
+#endif
 
 #ifndef CONFIG_PARAVIRT
 extern shared_info_t shared_info;
@@ -96,11 +107,14 @@ void do_hypervisor_callback(struct pt_regs *regs)
 {
     unsigned long  l1, l2, l1i, l2i;
     unsigned int   port;
-    int            cpu = 0;
+    int            cpu = smp_processor_id();
     shared_info_t *s = HYPERVISOR_shared_info;
     vcpu_info_t   *vcpu_info = &s->vcpu_info[cpu];
 
-    in_callback = 1;
+    set_in_callback(1);
+#ifdef CONFIG_SMP
+    this_cpu_inc(callbacks);
+#endif
    
     vcpu_info->evtchn_upcall_pending = 0;
     /* NB x86. No need for a barrier here -- XCHG is a barrier on x86. */
@@ -124,8 +138,18 @@ void do_hypervisor_callback(struct pt_regs *regs)
         }
     }
 
-    in_callback = 0;
+    set_in_callback(0);
+}
+
+#if defined(CONFIG_PREEMPT) && !defined(CONFIG_PARAVIRT)
+/* HVM event vector, which runs on the stack of the interrupted thread. */
+void do_hypervisor_callback_preempt(struct pt_regs *regs)
+{
+    do_hypervisor_callback(regs);
+    if ( regs->eflags & X86_EFLAGS_IF )
+        preempt_schedule_irq();
 }
+#endif
 
 void force_evtchn_callback(void)
 {
@@ -150,6 +174,11 @@ void force_evtchn_callback(void)
         barrier();
 #endif
     };
+#ifdef CONFIG_PREEMPT
+    /* Events handled here don't leave through the callback's exit path. */
+    if ( need_resched )
+        preempt_schedule();
+#endif
 }
 
 inline void mask_evtchn(uint32_t port)
@@ -163,6 +192,16 @@ inline void unmask_evtchn(uint32_t port)
     shared_info_t *s = HYPERVISOR_shared_info;
     vcpu_info_t *vcpu_info = &s->vcpu_info[smp_processor_id()];
 
+#ifdef CONFIG_SMP
+    /* Xen resends what is pending for another vCPU. */
+    if ( evtchn_cpu(port) != smp_processor_id() )
+    {
+        evtchn_unmask_t op = { .port = port };
+
+        HYPERVISOR_event_channel_op(EVTCHNOP_unmask, &op);
+        return;
+    }
+#endif
     synch_clear_bit(port, &s->evtchn_mask[0]);
 
     /*
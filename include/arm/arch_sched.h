@@ -3,13 +3,17 @@
 
 #include "arch_limits.h"
 
+/* Set by the scheduler whenever it switches threads. */
+extern struct thread *current_thread;
+
 static inline struct thread* get_current(void)
 {
-    struct thread **current;
-    unsigned long sp;
-    __asm__ __volatile__ ("mov %0, sp":"=r"(sp));
-    current = (void *)(unsigned long)(sp & ~(__STACK_SIZE-1));
-    return *current;
+    return current_thread;
+}
+
+static inline void set_current(struct thread *thread)
+{
+    current_thread = thread;
 }
 
 void __arch_switch_threads(unsigned long *prevctx, unsigned long *nextctx);
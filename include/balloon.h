@@ -34,17 +34,31 @@
 
 extern unsigned long nr_max_pages;
 extern unsigned long nr_mem_pages;
+extern unsigned long nr_ballooned_pages;
 
 void get_max_pages(void);
 int balloon_up(unsigned long n_pages);
+int balloon_down(unsigned long n_pages);
+void init_balloon(void);
 
 void mm_alloc_bitmap_remap(void);
 void arch_pfn_add(unsigned long pfn, unsigned long mfn);
-int chk_free_pages(unsigned long needed);
+void arch_pfn_remove(unsigned long pfn, unsigned long n);
+int __chk_free_pages(unsigned long needed);
+
+/* Keep the common "enough memory" case inline for the allocator. */
+static inline int chk_free_pages(unsigned long needed)
+{
+    if ( needed + BALLOON_EMERGENCY_PAGES <= nr_free_pages )
+        return 1;
+
+    return __chk_free_pages(needed);
+}
 
 #else /* CONFIG_BALLOON */
 
 static inline void get_max_pages(void) { }
+static inline void init_balloon(void) { }
 static inline void mm_alloc_bitmap_remap(void) { }
 static inline int chk_free_pages(unsigned long needed)
 {
@@ -35,8 +35,7 @@ void arch_fini_events(void);
 int do_event(evtchn_port_t port, struct pt_regs *regs);
 evtchn_port_t bind_virq(uint32_t virq, evtchn_handler_t handler, void *data);
 evtchn_port_t bind_pirq(uint32_t pirq, int will_share, evtchn_handler_t handler, void *data);
-evtchn_port_t bind_evtchn(evtchn_port_t port, evtchn_handler_t handler,
-						  void *data);
+int bind_evtchn(evtchn_port_t port, evtchn_handler_t handler, void *data);
 void unbind_evtchn(evtchn_port_t port);
 void init_events(void);
 int evtchn_alloc_unbound(domid_t pal, evtchn_handler_t handler,
@@ -47,6 +46,19 @@ int evtchn_bind_interdomain(domid_t pal, evtchn_port_t remote_port,
 int evtchn_get_peercontext(evtchn_port_t local_port, char *ctx, int size);
 void unbind_all_ports(void);
 
+#ifdef CONFIG_SMP
+extern unsigned long cpu_evtchn_mask[][EVTCHN_2L_NR_CHANNELS /
+                                       (8 * sizeof(unsigned long))];
+unsigned int evtchn_cpu(evtchn_port_t port);
+/* Have the events of port delivered to vCPU cpu. */
+int evtchn_bind_vcpu(evtchn_port_t port, unsigned int cpu);
+/* Move a device port to the next vCPU in turn, spreading interrupts. */
+void evtchn_spread(evtchn_port_t port);
+evtchn_port_t bind_ipi(evtchn_handler_t handler, void *data);
+#else
+#define evtchn_spread(port)         ((void)0)
+#endif
+
 static inline int notify_remote_via_evtchn(evtchn_port_t port)
 {
     evtchn_send_t op;
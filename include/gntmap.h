@@ -9,6 +9,7 @@
  */
 struct gntmap {
     int nentries;
+    int growable;   /* not sized by gntmap_set_max_grants() */
     struct gntmap_entry *entries;
 };
 
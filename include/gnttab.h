@@ -14,7 +14,9 @@ const char *gnttabop_error(int16_t status);
 void fini_gnttab(void);
 void suspend_gnttab(void);
 void resume_gnttab(void);
-grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames);
+grant_entry_v1_t *arch_init_gnttab(int nr_grant_frames, int max_grant_frames);
+int arch_grow_gnttab(grant_entry_v1_t *gnttab_table, int nr_grant_frames,
+                     int new_grant_frames);
 void arch_suspend_gnttab(grant_entry_v1_t *gnttab_table, int nr_grant_frames);
 void arch_resume_gnttab(grant_entry_v1_t *gnttab_table, int nr_grant_frames);
 
@@ -50,6 +50,13 @@ void mask_evtchn(uint32_t port);
 void unmask_evtchn(uint32_t port);
 void clear_evtchn(uint32_t port);
 
+#ifdef CONFIG_SMP
+/* Per vCPU, see struct pda. */
+#define in_callback             this_cpu_read(callback)
+#define set_in_callback(v)      this_cpu_write(callback, v)
+#else
 extern int in_callback;
+#define set_in_callback(v)      (in_callback = (v))
+#endif
 
 #endif /* __HYPERVISOR_H__ */
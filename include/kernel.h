@@ -4,6 +4,8 @@
 #define MAX_CMDLINE_SIZE 1024
 extern char cmdline[MAX_CMDLINE_SIZE];
 
+unsigned long get_boot_param(const char *name, unsigned long def);
+
 void start_kernel(void* par);
 void pre_suspend(void);
 void post_suspend(int canceled);
@@ -236,8 +236,10 @@ extern struct file {
 #endif
     };
     int read;	/* maybe available for read */
-} files[];
+} *files;
+extern int nr_files;
 
+void init_files(void);
 int alloc_fd(enum fd_type type);
 void close_all_files(void);
 extern struct thread *main_thread;
@@ -36,6 +36,7 @@
 #endif
 #include <xen/xen.h>
 
+#include <mini-os/list.h>
 #include <mini-os/paravirt.h>
 #include <mini-os/arch_limits.h>
 #include <mini-os/arch_mm.h>
@@ -51,11 +52,35 @@ extern unsigned long nr_free_pages;
 extern unsigned long *mm_alloc_bitmap;
 extern unsigned long mm_alloc_bitmap_size;
 
+/* Per-context stack of free order-0 pages in front of the buddy allocator. */
+#define PAGE_MAG_SIZE 16
+struct page_magazine {
+    unsigned int nr;
+    unsigned long pages[PAGE_MAG_SIZE];
+};
+
+/* Magazine of the running context, NULL before threads are started. */
+struct page_magazine *current_page_magazine(void);
+void page_magazine_flush(struct page_magazine *mag);
+
 void init_mm(void);
 unsigned long alloc_pages(int order);
 #define alloc_page()    alloc_pages(0)
 void free_pages(void *pointer, int order);
 #define free_page(p)    free_pages(p, 0)
+/* Straight from/to the buddy lists: no magazines, ballooning or messages. */
+unsigned long __alloc_pages(int order);
+void __free_pages(void *pointer, int order);
+
+/* Pages cleared to zero, from a pool refilled by the idle thread. */
+unsigned long alloc_zeroed_pages(int order);
+#define alloc_zeroed_page() alloc_zeroed_pages(0)
+int refill_zero_pool(void);
+
+/* n pages, virtually but not physically contiguous. */
+void *vmalloc_pages(unsigned long n);
+void *vzalloc_pages(unsigned long n);
+void vfree_pages(void *va, unsigned long n);
 
 static __inline__ int get_order(unsigned long size)
 {
@@ -69,7 +94,28 @@ static __inline__ int get_order(unsigned long size)
 void arch_init_demand_mapping_area(void);
 void arch_init_mm(unsigned long* start_pfn_p, unsigned long* max_pfn_p);
 
+#define DEFERRED_MEM_BATCH      512
+#ifdef CONFIG_DEFERRED_MEM
+/*
+ * Only memory up to deferred_pfn, set by arch_init_mm(), is set up at boot.
+ * The rest is mapped by arch_map_deferred() and given to the allocator
+ * later, see deferred_mem_init().
+ */
+#ifndef DEFERRED_MEM_BOOT_PAGES
+#define DEFERRED_MEM_BOOT_PAGES (64UL << (20 - PAGE_SHIFT))
+#endif
+extern unsigned long deferred_pfn;
+int arch_map_deferred(unsigned long pfn, unsigned long n);
+unsigned long deferred_mem_init(unsigned long nr_pages);
+#else
+static inline unsigned long deferred_mem_init(unsigned long nr_pages)
+{
+    return 0;
+}
+#endif
+
 unsigned long allocate_ondemand(unsigned long n, unsigned long alignment);
+void free_ondemand(unsigned long va, unsigned long n);
 /* map f[i*stride]+i*increment for i in 0..n-1, aligned on alignment pages */
 void *map_frames_ex(const unsigned long *f, unsigned long n, unsigned long stride,
 	unsigned long increment, unsigned long alignment, domid_t id,
@@ -84,6 +130,38 @@ unsigned long map_frame_virt(unsigned long mfn);
 extern unsigned long heap, brk, heap_mapped, heap_end;
 #endif
 
+/*
+ * Reclaim callbacks for memory held in caches.  When memory runs short,
+ * shrinkers are asked in ascending priority order to free up to nr_pages
+ * pages and return how many they freed.  They are only run from thread
+ * context.
+ */
+struct shrinker {
+    unsigned long (*shrink)(unsigned long nr_pages);
+    int priority;
+    MINIOS_TAILQ_ENTRY(struct shrinker) list;
+};
+void register_shrinker(struct shrinker *shrinker);
+void unregister_shrinker(struct shrinker *shrinker);
+unsigned long shrink_memory(unsigned long nr_pages);
+
+/* Page allocator statistics. */
+#define MM_NR_ORDERS   ((sizeof(void *) << 3) - PAGE_SHIFT)
+#define MM_LAT_SHIFT   7    /* First latency bucket: below 128ns. */
+#define MM_LAT_BUCKETS 12   /* Bucket i: below 2^(i + MM_LAT_SHIFT) ns. */
+struct mm_stats {
+    unsigned long free_pages;
+    int largest_free_order;             /* -1 if nothing is free. */
+    unsigned long free_chunks[MM_NR_ORDERS];
+    unsigned long allocs[MM_NR_ORDERS];
+    unsigned long frees[MM_NR_ORDERS];
+    unsigned long failed[MM_NR_ORDERS];
+    /* Last one open ended, all zero unless built with MM_LAT_STATS. */
+    unsigned long alloc_latency[MM_LAT_BUCKETS];
+};
+void get_mm_stats(struct mm_stats *stats);
+void print_mm_stats(void);
+
 int free_physical_pages(xen_pfn_t *mfns, int n);
 void fini_mm(void);
 
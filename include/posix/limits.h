@@ -45,4 +45,8 @@
 #define PATH_MAX __PAGE_SIZE
 #define PAGE_SIZE __PAGE_SIZE
 
+#define PTHREAD_STACK_MIN (2 * __PAGE_SIZE)
+#define PTHREAD_KEYS_MAX 32
+#define PTHREAD_DESTRUCTOR_ITERATIONS 4
+
 #endif /* _POSIX_LIMITS_H */
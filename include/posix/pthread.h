@@ -2,46 +2,156 @@
 #define _POSIX_PTHREAD_H
 
 #include <stdlib.h>
+#include <time.h>
+#include <limits.h>
+#include <mini-os/waittypes.h>
 
-/* Let's be single-threaded for now.  */
+/*
+ * POSIX threads are Mini-OS threads, see lib/pthread.c.  Waiting is done on
+ * wait queues, so none of this may be used from event callbacks.  A thread
+ * started by pthread_create() has to end by returning or pthread_exit(),
+ * not exit_thread().
+ */
+
+#ifndef _SYS_SCHED_H_
+#define SCHED_OTHER 0
+/* Mini-OS priorities, SCHED_PRIO_MIN to SCHED_PRIO_MAX. */
+struct sched_param {
+    int sched_priority;
+};
+#endif
+
+typedef struct pthread *pthread_t;
+
+#define PTHREAD_CREATE_JOINABLE 0
+#define PTHREAD_CREATE_DETACHED 1
 
 typedef struct {
-    void *ptr;
-} *pthread_key_t;
-static inline int pthread_key_create(pthread_key_t *key, void (*destr_function)(void*))
-{
-    *key = malloc(sizeof(**key));
-    (*key)->ptr = NULL;
-    return 0;
-}
-static inline int pthread_setspecific(pthread_key_t key, const void *pointer)
-{
-    key->ptr = (void*) pointer;
-    return 0;
-}
-static inline void *pthread_getspecific(pthread_key_t key)
-{
-    return key->ptr;
-}
-static inline int pthread_key_delete(pthread_key_t key)
-{
-    free(key);
-    return 0;
-}
+    size_t stacksize;
+    int detachstate;
+    int priority;
+} pthread_attr_t;
+int pthread_attr_init(pthread_attr_t *attr);
+static inline int pthread_attr_destroy(pthread_attr_t *attr) { return 0; }
+int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize);
+int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize);
+int pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate);
+int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *detachstate);
+int pthread_attr_setschedparam(pthread_attr_t *attr,
+                               const struct sched_param *param);
+int pthread_attr_getschedparam(const pthread_attr_t *attr,
+                               struct sched_param *param);
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg);
+void pthread_exit(void *retval) __attribute__((noreturn));
+int pthread_join(pthread_t thread, void **retval);
+int pthread_detach(pthread_t thread);
+pthread_t pthread_self(void);
+static inline int pthread_equal(pthread_t t1, pthread_t t2) { return t1 == t2; }
+int pthread_setschedparam(pthread_t thread, int policy,
+                          const struct sched_param *param);
+int pthread_getschedparam(pthread_t thread, int *policy,
+                          struct sched_param *param);
+
+
+
+typedef unsigned int pthread_key_t;
+int pthread_key_create(pthread_key_t *key, void (*destr_function)(void*));
+int pthread_key_delete(pthread_key_t key);
+int pthread_setspecific(pthread_key_t key, const void *pointer);
+void *pthread_getspecific(pthread_key_t key);
 
 
 
-typedef struct {} pthread_mutexattr_t;
-static inline int pthread_mutexattr_init(pthread_mutexattr_t *mattr) { return 0; }
 #define PTHREAD_MUTEX_NORMAL 0
 #define PTHREAD_MUTEX_RECURSIVE 1
-static inline int pthread_mutexattr_settype(pthread_mutexattr_t *mattr, int kind) { return 0; }
+#define PTHREAD_MUTEX_ERRORCHECK 2
+#define PTHREAD_MUTEX_DEFAULT PTHREAD_MUTEX_NORMAL
+typedef struct {
+    int type;
+} pthread_mutexattr_t;
+static inline int pthread_mutexattr_init(pthread_mutexattr_t *mattr)
+{
+    mattr->type = PTHREAD_MUTEX_DEFAULT;
+    return 0;
+}
+int pthread_mutexattr_settype(pthread_mutexattr_t *mattr, int kind);
 static inline int pthread_mutexattr_destroy(pthread_mutexattr_t *mattr) { return 0; }
-typedef struct {} pthread_mutex_t;
-#define PTHREAD_MUTEX_INITIALIZER {}
-static inline int pthread_mutex_init(pthread_mutex_t *mutex, pthread_mutexattr_t *mattr) { return 0; }
-static inline int pthread_mutex_lock(pthread_mutex_t *mutex) { return 0; }
-static inline int pthread_mutex_unlock(pthread_mutex_t *mutex) { return 0; }
+
+/* The wait queues of statically initialized objects are set up on first use. */
+typedef struct {
+    int type;
+    unsigned int count;         /* Times locked by the owner, 0 if unlocked. */
+    struct thread *owner;
+    struct wait_queue_head wait;
+} pthread_mutex_t;
+#define PTHREAD_MUTEX_INITIALIZER { 0 }
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *mattr);
+static inline int pthread_mutex_destroy(pthread_mutex_t *mutex) { return 0; }
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+
+
+typedef struct {} pthread_condattr_t;
+static inline int pthread_condattr_init(pthread_condattr_t *cattr) { return 0; }
+static inline int pthread_condattr_destroy(pthread_condattr_t *cattr) { return 0; }
+
+typedef struct {
+    struct wait_queue_head wait;
+} pthread_cond_t;
+#define PTHREAD_COND_INITIALIZER { { 0 } }
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *cattr);
+static inline int pthread_cond_destroy(pthread_cond_t *cond) { return 0; }
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+/* abstime is against clock_gettime(CLOCK_REALTIME). */
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime);
+int pthread_cond_signal(pthread_cond_t *cond);
+int pthread_cond_broadcast(pthread_cond_t *cond);
+
+
+
+typedef struct {} pthread_rwlockattr_t;
+static inline int pthread_rwlockattr_init(pthread_rwlockattr_t *rwattr) { return 0; }
+static inline int pthread_rwlockattr_destroy(pthread_rwlockattr_t *rwattr) { return 0; }
+
+/* Waiting writers hold off new readers. */
+typedef struct {
+    int state;                  /* Readers holding it, -1 for a writer. */
+    unsigned int writers_waiting;
+    struct wait_queue_head wait;
+} pthread_rwlock_t;
+#define PTHREAD_RWLOCK_INITIALIZER { 0 }
+int pthread_rwlock_init(pthread_rwlock_t *rwlock,
+                        const pthread_rwlockattr_t *rwattr);
+static inline int pthread_rwlock_destroy(pthread_rwlock_t *rwlock) { return 0; }
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock);
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock);
+
+
+
+#define PTHREAD_BARRIER_SERIAL_THREAD (-1)
+typedef struct {} pthread_barrierattr_t;
+static inline int pthread_barrierattr_init(pthread_barrierattr_t *battr) { return 0; }
+static inline int pthread_barrierattr_destroy(pthread_barrierattr_t *battr) { return 0; }
+
+typedef struct {
+    unsigned int count;
+    unsigned int arrived;
+    unsigned int generation;
+    struct wait_queue_head wait;
+} pthread_barrier_t;
+int pthread_barrier_init(pthread_barrier_t *barrier,
+                         const pthread_barrierattr_t *battr,
+                         unsigned int count);
+static inline int pthread_barrier_destroy(pthread_barrier_t *barrier) { return 0; }
+int pthread_barrier_wait(pthread_barrier_t *barrier);
 
 
 
@@ -50,15 +160,11 @@ typedef struct {
 } pthread_once_t;
 #define PTHREAD_ONCE_INIT { 0 }
 
-static inline int pthread_once(pthread_once_t *once_control, void (*init_routine)(void))
-{
-    if (!once_control->done) {
-        once_control->done = 1;
-        init_routine();
-    }
-    return 0;
-}
+int pthread_once(pthread_once_t *once_control, void (*init_routine)(void));
 
+#ifndef __x86_64__
+/* No TLS support on other architectures. */
 #define __thread
+#endif
 
 #endif /* _POSIX_PTHREAD_H */
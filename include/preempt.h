@@ -0,0 +1,71 @@
+#ifndef _PREEMPT_H_
+#define _PREEMPT_H_
+
+/*
+ * With CONFIG_PREEMPT, a thread can be switched out on return from the
+ * event callback once its time slice is used up, or when a thread of higher
+ * priority wakes up.  Code relying on not being switched out between two
+ * points without disabling interrupts brackets itself with preempt_disable()
+ * and preempt_enable().  Calling schedule() in between is still allowed.
+ */
+#ifdef CONFIG_PREEMPT
+
+#if !defined(__x86_64__)
+#error "CONFIG_PREEMPT is only supported on x86_64"
+#endif
+
+#ifdef CONFIG_SMP
+#include <mini-os/os.h>
+/* Per vCPU, see struct pda. */
+#define preempt_count           this_cpu_read(preempt)
+#define need_resched            this_cpu_read(resched)
+#define preempt_count_inc()     this_cpu_inc(preempt)
+#define preempt_count_dec()     this_cpu_dec(preempt)
+#define set_preempt_count(n)    this_cpu_write(preempt, n)
+#define set_need_resched(v)     this_cpu_write(resched, v)
+#else
+extern int preempt_count;
+extern int need_resched;
+#define preempt_count_inc()     (preempt_count++)
+#define preempt_count_dec()     (preempt_count--)
+#define set_preempt_count(n)    (preempt_count = (n))
+#define set_need_resched(v)     (need_resched = (v))
+#endif
+
+void preempt_schedule(void);
+/* On the way out of an event callback, with events masked. */
+void preempt_schedule_irq(void);
+#ifdef CONFIG_SMP
+/* In a callback, after another vCPU queued threads on this one. */
+void sched_check_preempt(void);
+#endif
+
+#define preempt_disable() do {                  \
+    preempt_count_inc();                        \
+    __asm__ __volatile__("" : : : "memory");    \
+} while (0)
+
+#define preempt_enable() do {                   \
+    __asm__ __volatile__("" : : : "memory");    \
+    preempt_count_dec();                        \
+    preempt_check_resched();                    \
+} while (0)
+
+/*
+ * preempt_schedule() does nothing with interrupts disabled, so whoever
+ * enables them again has to look at need_resched.
+ */
+#define preempt_check_resched() do {            \
+    if ( preempt_count == 0 && need_resched )   \
+        preempt_schedule();                     \
+} while (0)
+
+#else
+
+#define preempt_disable() ((void)0)
+#define preempt_enable()  ((void)0)
+#define preempt_check_resched() ((void)0)
+
+#endif
+
+#endif /* _PREEMPT_H_ */
@@ -2,6 +2,7 @@
 #define __SCHED_H__
 
 #include <mini-os/list.h>
+#include <mini-os/mm.h>
 #include <mini-os/time.h>
 #include <mini-os/arch_sched.h>
 #ifdef HAVE_LIBC
@@ -12,35 +13,95 @@ struct thread
 {
     char *name;
     char *stack;
+    unsigned long stack_size;
     /* keep in that order */
     unsigned long sp;  /* Stack pointer */
     unsigned long ip;  /* Instruction pointer */
+#ifdef __x86_64__
+    unsigned long tls; /* Thread pointer (FS base), 0 without TLS */
+#endif
     MINIOS_TAILQ_ENTRY(struct thread) thread_list;
+    MINIOS_TAILQ_ENTRY(struct thread) run_list;
     uint32_t flags;
+    int prio;
+    s_time_t queued_at;
     s_time_t wakeup_time;
+    int sleep_idx;      /* Position in the heap of sleepers, or -1. */
+    struct page_magazine page_mag;
+    unsigned int cpu;   /* vCPU whose run queue it goes on. */
+#ifdef CONFIG_SMP
+    int on_cpu;         /* Running, or its context not saved yet. */
+#endif
+#ifdef CONFIG_PREEMPT
+    int saved_preempt_count;    /* While switched out. */
+    s_time_t slice_start;
+#endif
+#if defined(CONFIG_PREEMPT) || defined(CONFIG_SMP)
+    void (*entry)(void *);
+    void *entry_data;
+#endif
 #ifdef HAVE_LIBC
     struct _reent reent;
+    struct pthread *pthread;    /* Freed with the thread, see pthread_exit(). */
 #endif
 };
 
-extern struct thread *idle_thread;
+/* One per vCPU, the boot one's also does deferred work. */
+extern struct thread *idle_threads[];
+#define idle_thread (idle_threads[0])
 void idle_thread_fn(void *unused);
 
 #define RUNNABLE_FLAG   0x00000001
+#define QUEUED_FLAG     0x00000002  /* On the run queue. */
+#define RUNNING_FLAG    0x00000004
+#define EXITED_FLAG     0x00000008
+#define PINNED_FLAG     0x00000010  /* Stays on its vCPU. */
+
+#ifdef CONFIG_SMP
+/* Other vCPUs change flags of threads they don't run. */
+#define thread_set_flags(_thread, _f)   \
+    __sync_fetch_and_or(&(_thread)->flags, (_f))
+#define thread_clear_flags(_thread, _f) \
+    __sync_fetch_and_and(&(_thread)->flags, ~(_f))
+#else
+#define thread_set_flags(_thread, _f)   ((_thread)->flags |= (_f))
+#define thread_clear_flags(_thread, _f) ((_thread)->flags &= ~(_f))
+#endif
 
 #define is_runnable(_thread)    (_thread->flags & RUNNABLE_FLAG)
-#define set_runnable(_thread)   (_thread->flags |= RUNNABLE_FLAG)
-#define clear_runnable(_thread) (_thread->flags &= ~RUNNABLE_FLAG)
+#define set_runnable(_thread)   thread_set_flags(_thread, RUNNABLE_FLAG)
+#define clear_runnable(_thread) thread_clear_flags(_thread, RUNNABLE_FLAG)
 
 #define switch_threads(prev, next) arch_switch_threads(prev, next)
  
-    /* Architecture specific setup of thread creation. */
+    /* Architecture specific setup of thread creation; NULL on failure. */
 struct thread* arch_create_thread(char *name, void (*function)(void *),
-                                  void *data);
+                                  void *data, char *stack,
+                                  unsigned long stack_size);
+
+/* Smallest stack create_thread_ex() hands out. */
+#define STACK_SIZE_MIN (2 * PAGE_SIZE)
+
+/* Thread priorities, runnable threads of a higher one run first. */
+#define SCHED_PRIO_MIN      0
+#define SCHED_PRIO_MAX      7
+#define SCHED_PRIO_DEFAULT  3
 
 void init_sched(void);
+#ifdef CONFIG_SMP
+/* Idle thread for a secondary vCPU, which starts in it. */
+struct thread *init_sched_cpu(unsigned int cpu);
+#endif
 void run_idle_thread(void);
 struct thread* create_thread(char *name, void (*function)(void *), void *data);
+/* stack_size is rounded up to a power of two number of pages. */
+struct thread* create_thread_ex(char *name, void (*function)(void *),
+                                void *data, unsigned long stack_size,
+                                int prio);
+int set_thread_priority(struct thread *thread, int prio);
+/* Deepest use of the thread's stack so far, in bytes. */
+unsigned long thread_stack_used(struct thread *thread);
+void print_stack_usage(void);
 void exit_thread(void) __attribute__((noreturn));
 void schedule(void);
 
@@ -5,8 +5,9 @@
 #include <mini-os/spinlock.h>
 
 /*
- * Implementation of semaphore in Mini-os is simple, because 
- * there are no preemptive threads, the atomicity is guaranteed.
+ * Implementation of semaphore in Mini-os is simple: the count is only
+ * touched with interrupts disabled, which also keeps preemption away, and
+ * waitq_lock held.
  */
 
 struct semaphore
@@ -52,12 +53,12 @@ static inline int trydown(struct semaphore *sem)
 {
     unsigned long flags;
     int ret = 0;
-    local_irq_save(flags);
+    waitq_lock_irqsave(flags);
     if (sem->count > 0) {
         ret = 1;
         sem->count--;
     }
-    local_irq_restore(flags);
+    waitq_unlock_irqrestore(flags);
     return ret;
 }
 
@@ -66,22 +67,22 @@ static void inline down(struct semaphore *sem)
     unsigned long flags;
     while (1) {
         wait_event(sem->wait, sem->count > 0);
-        local_irq_save(flags);
+        waitq_lock_irqsave(flags);
         if (sem->count > 0)
             break;
-        local_irq_restore(flags);
+        waitq_unlock_irqrestore(flags);
     }
     sem->count--;
-    local_irq_restore(flags);
+    waitq_unlock_irqrestore(flags);
 }
 
 static void inline up(struct semaphore *sem)
 {
     unsigned long flags;
-    local_irq_save(flags);
+    waitq_lock_irqsave(flags);
     sem->count++;
-    wake_up(&sem->wait);
-    local_irq_restore(flags);
+    __wake_up(&sem->wait);
+    waitq_unlock_irqrestore(flags);
 }
 
 /* FIXME! Thre read/write semaphores are unimplemented! */
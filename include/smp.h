@@ -0,0 +1,38 @@
+#ifndef _MINIOS_SMP_H_
+#define _MINIOS_SMP_H_
+
+#include <mini-os/os.h>
+
+/*
+ * With CONFIG_SMP, the vCPUs Xen gives the domain beyond the first are
+ * brought up at boot ("maxcpus=" on the command line limits how many are
+ * used).  Each one has its own idle thread and run queue, and takes work
+ * from the others when it runs out.
+ */
+#ifdef CONFIG_SMP
+
+#if !defined(__x86_64__) || !defined(CONFIG_PARAVIRT)
+#error "CONFIG_SMP is only supported on x86_64 PV"
+#endif
+
+#define NR_CPUS XEN_LEGACY_MAX_VCPUS
+
+extern unsigned int nr_cpus;    /* vCPUs up and running threads. */
+
+void init_smp(void);
+/* Make cpu look at its run queue again. */
+void smp_send_reschedule(unsigned int cpu);
+/* First thing a secondary vCPU does, in its idle thread. */
+void start_secondary(void);
+
+#else
+
+#define NR_CPUS 1
+#define nr_cpus 1
+
+#define init_smp()                  ((void)0)
+#define smp_send_reschedule(cpu)    ((void)0)
+
+#endif
+
+#endif /* _MINIOS_SMP_H_ */
@@ -2,6 +2,7 @@
 #define __ASM_SPINLOCK_H
 
 #include <mini-os/lib.h>
+#include <mini-os/preempt.h>
 
 /*
  * Your basic SMP spinlocks, allowing only a single CPU anywhere
@@ -19,7 +20,7 @@ typedef struct {
 
 #define SPIN_LOCK_UNLOCKED ARCH_SPIN_LOCK_UNLOCKED
 
-#define spin_lock_init(x)	do { *(x) = SPIN_LOCK_UNLOCKED; } while(0)
+#define spin_lock_init(x)	do { *(x) = (spinlock_t)SPIN_LOCK_UNLOCKED; } while(0)
 
 /*
  * Simple spin lock operations.  There are two variants, one clears IRQ's
@@ -33,22 +34,41 @@ typedef struct {
 #define spin_unlock_wait(x)	arch_spin_unlock_wait(x)
 
 
-#define _spin_trylock(lock)     ({_raw_spin_trylock(lock) ? \
-                                1 : ({ 0;});})
+/* The holder must not be preempted: whoever runs next could spin forever. */
+#define _spin_trylock(lock)     ({preempt_disable(); \
+                                _raw_spin_trylock(lock) ? \
+                                1 : ({ preempt_enable(); 0;});})
 
 #define _spin_lock(lock)        \
 do {                            \
+        preempt_disable();      \
         _raw_spin_lock(lock);   \
 } while(0)
 
 #define _spin_unlock(lock)      \
 do {                            \
         _raw_spin_unlock(lock); \
+        preempt_enable();       \
 } while (0)
 
 
 #define spin_lock(lock)       _spin_lock(lock)
 #define spin_unlock(lock)       _spin_unlock(lock)
+#define spin_trylock(lock)      _spin_trylock(lock)
+
+/* Also against event callbacks on the local vCPU, which take it too. */
+#define spin_lock_irqsave(lock, flags)          \
+do {                                            \
+        local_irq_save(flags);                  \
+        _raw_spin_lock(lock);                   \
+} while (0)
+
+#define spin_unlock_irqrestore(lock, flags)     \
+do {                                            \
+        _raw_spin_unlock(lock);                 \
+        local_irq_restore(flags);               \
+        preempt_check_resched();                \
+} while (0)
 
 #define DEFINE_SPINLOCK(x) spinlock_t x = SPIN_LOCK_UNLOCKED
 
@@ -54,10 +54,15 @@ typedef long suseconds_t;
 
 /* prototypes */
 void     init_time(void);
+#ifdef CONFIG_SMP
+void     init_time_secondary(void);
+#endif
 void     fini_time(void);
 s_time_t get_s_time(void);
 s_time_t get_v_time(void);
 uint64_t monotonic_clock(void);
 void     block_domain(s_time_t until);
+/* Make sure there is a timer event at deadline, replacing any other. */
+void     arch_set_timer(s_time_t deadline);
 
 #endif /* _MINIOS_TIME_H_ */
@@ -0,0 +1,62 @@
+/* -*-  Mode:C; c-basic-offset:4; tab-width:4 -*-
+ *
+ * Kernel timers: callbacks run at a given time, once or periodically.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <mini-os/list.h>
+#include <mini-os/time.h>
+
+/*
+ * Timer callbacks are run from schedule() with interrupts enabled, on the
+ * stack of the thread calling it.  They must not block.  A timer with a
+ * non-zero period is re-armed period nanoseconds later before its callback
+ * runs, skipping expiries that were missed.
+ */
+struct timer {
+    s_time_t expires;
+    s_time_t period;
+    void (*function)(void *data);
+    void *data;
+    int pending;
+    MINIOS_TAILQ_ENTRY(struct timer) list;
+};
+
+void init_timer(struct timer *timer, void (*function)(void *), void *data);
+/* Arm a timer which is not pending, using its expires and period. */
+void add_timer(struct timer *timer);
+/* (Re-)arm a timer to expire at expires, returns whether it was pending. */
+int mod_timer(struct timer *timer, s_time_t expires);
+/* Disarm a timer, returns whether it was pending. */
+int del_timer(struct timer *timer);
+
+static inline int timer_pending(const struct timer *timer)
+{
+    return timer->pending;
+}
+
+/* Used by the scheduler. */
+s_time_t next_timer_expiry(void);
+void run_timers(void);
+
+#endif /* _TIMER_H_ */
@@ -4,6 +4,21 @@
 #include <mini-os/sched.h>
 #include <mini-os/os.h>
 #include <mini-os/waittypes.h>
+#include <mini-os/spinlock.h>
+
+#ifdef CONFIG_SMP
+/*
+ * Wait queues and semaphores of all vCPUs.  Taken outside the scheduler's
+ * lock, by wake_up() for instance.
+ */
+extern spinlock_t waitq_lock;
+#define waitq_lock_irqsave(flags)       spin_lock_irqsave(&waitq_lock, flags)
+#define waitq_unlock_irqrestore(flags)  \
+    spin_unlock_irqrestore(&waitq_lock, flags)
+#else
+#define waitq_lock_irqsave(flags)       local_irq_save(flags)
+#define waitq_unlock_irqrestore(flags)  local_irq_restore(flags)
+#endif
 
 #define DEFINE_WAIT(name)                          \
 struct wait_queue name = {                         \
@@ -39,29 +54,35 @@ static inline void remove_wait_queue(struct wait_queue_head *h, struct wait_queu
     }
 }
 
-static inline void wake_up(struct wait_queue_head *head)
+/* With waitq_lock held. */
+static inline void __wake_up(struct wait_queue_head *head)
 {
-    unsigned long flags;
     struct wait_queue *curr, *tmp;
-    local_irq_save(flags);
     MINIOS_STAILQ_FOREACH_SAFE(curr, head, thread_list, tmp)
          wake(curr->thread);
-    local_irq_restore(flags);
+}
+
+static inline void wake_up(struct wait_queue_head *head)
+{
+    unsigned long flags;
+    waitq_lock_irqsave(flags);
+    __wake_up(head);
+    waitq_unlock_irqrestore(flags);
 }
 
 #define add_waiter(w, wq) do {  \
     unsigned long flags;        \
-    local_irq_save(flags);      \
+    waitq_lock_irqsave(flags);  \
     add_wait_queue(&wq, &w);    \
     block(get_current());       \
-    local_irq_restore(flags);   \
+    waitq_unlock_irqrestore(flags); \
 } while (0)
 
 #define remove_waiter(w, wq) do {  \
     unsigned long flags;           \
-    local_irq_save(flags);         \
+    waitq_lock_irqsave(flags);     \
     remove_wait_queue(&wq, &w);    \
-    local_irq_restore(flags);      \
+    waitq_unlock_irqrestore(flags); \
 } while (0)
 
 #define wait_event_deadline(wq, condition, deadline) do {       \
@@ -72,20 +93,20 @@ static inline void wake_up(struct wait_queue_head *head)
     for(;;)                                                     \
     {                                                           \
         /* protect the list */                                  \
-        local_irq_save(flags);                                  \
+        waitq_lock_irqsave(flags);                              \
         add_wait_queue(&wq, &__wait);                           \
         get_current()->wakeup_time = deadline;                  \
         clear_runnable(get_current());                          \
-        local_irq_restore(flags);                               \
+        waitq_unlock_irqrestore(flags);                         \
         if((condition) || (deadline && NOW() >= deadline))      \
             break;                                              \
         schedule();                                             \
     }                                                           \
-    local_irq_save(flags);                                      \
+    waitq_lock_irqsave(flags);                                  \
     /* need to wake up */                                       \
     wake(get_current());                                        \
     remove_wait_queue(&wq, &__wait);                            \
-    local_irq_restore(flags);                                   \
+    waitq_unlock_irqrestore(flags);                             \
 } while(0) 
 
 #define wait_event(wq, condition) wait_event_deadline(wq, condition, 0) 
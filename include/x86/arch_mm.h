@@ -213,6 +213,14 @@ typedef unsigned long maddr_t;
 
 extern pgentry_t *pt_base;
 #ifdef CONFIG_PARAVIRT
+/* TLB flushes after removing or changing a mapping, on every vCPU. */
+#ifdef CONFIG_SMP
+#define MMUEXT_INVLPG              MMUEXT_INVLPG_ALL
+#define MMUEXT_TLB_FLUSH           MMUEXT_TLB_FLUSH_ALL
+#else
+#define MMUEXT_INVLPG              MMUEXT_INVLPG_LOCAL
+#define MMUEXT_TLB_FLUSH           MMUEXT_TLB_FLUSH_LOCAL
+#endif
 extern unsigned long *phys_to_machine_mapping;
 #else
 extern pgentry_t page_table_base[];
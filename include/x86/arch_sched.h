@@ -3,22 +3,48 @@
 #define __ARCH_SCHED_H__
 
 #include "arch_limits.h"
+#ifdef CONFIG_SMP
+#include <mini-os/arch_smp.h>
+#endif
 
+#ifdef CONFIG_SMP
 static inline struct thread* get_current(void)
 {
-    struct thread **current;
-#ifdef __i386__    
-    register unsigned long sp asm("esp");
+    return this_cpu_read(curr);
+}
+
+static inline void set_current(struct thread *thread)
+{
+    this_cpu_write(curr, thread);
+}
 #else
-    register unsigned long sp asm("rsp");
-#endif 
-    current = (void *)(unsigned long)(sp & ~(__STACK_SIZE-1));
-    return *current;
+/* Set by the scheduler whenever it switches threads. */
+extern struct thread *current_thread;
+
+static inline struct thread* get_current(void)
+{
+    return current_thread;
+}
+
+static inline void set_current(struct thread *thread)
+{
+    current_thread = thread;
 }
+#endif
 
 extern void __arch_switch_threads(unsigned long *prevctx, unsigned long *nextctx);
 
+#ifdef __x86_64__
+void arch_set_tls(unsigned long tp);
+
+#define arch_switch_threads(prev,next) do {                 \
+    if ((next)->tls)                                        \
+        arch_set_tls((next)->tls);                          \
+    __arch_switch_threads(&(prev)->sp, &(next)->sp);        \
+} while (0)
+#else
 #define arch_switch_threads(prev,next) __arch_switch_threads(&(prev)->sp, &(next)->sp)
+#endif
 
 
           
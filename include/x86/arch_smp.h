@@ -0,0 +1,61 @@
+#ifndef __ARCH_SMP_H__
+#define __ARCH_SMP_H__
+
+#ifndef __ASSEMBLY__
+
+struct thread;
+
+/*
+ * Per vCPU data, at the kernel GS base of each vCPU.  irqcount and
+ * irqstackptr are used by the event callback in x86_64.S.
+ */
+struct pda
+{
+    int irqcount;           /* offset 0 (used in x86_64.S) */
+    char *irqstackptr;      /*        8 */
+    struct thread *curr;    /* The running thread. */
+    unsigned int cpu;
+    int callback;           /* in_callback */
+    unsigned int callbacks; /* Event callbacks entered so far. */
+    int preempt;            /* preempt_count */
+    int resched;            /* need_resched */
+};
+
+extern struct pda pda[];
+
+/*
+ * Single instructions, so that they are safe against the thread moving
+ * to another vCPU in between.
+ */
+#define this_cpu_read(field) ({                                         \
+    __typeof__(((struct pda *)0)->field) __v;                           \
+    asm volatile ( "mov %%gs:%c1,%0" : "=r" (__v)                       \
+                   : "i" (__builtin_offsetof(struct pda, field)) );     \
+    __v;                                                                \
+})
+
+#define this_cpu_write(field, v) do {                                   \
+    __typeof__(((struct pda *)0)->field) __v = (v);                     \
+    asm volatile ( "mov %0,%%gs:%c1" : : "r" (__v),                     \
+                   "i" (__builtin_offsetof(struct pda, field))          \
+                   : "memory" );                                        \
+} while (0)
+
+#define this_cpu_inc(field)                                             \
+    asm volatile ( "incl %%gs:%c0" : :                                  \
+                   "i" (__builtin_offsetof(struct pda, field))          \
+                   : "memory" )
+
+#define this_cpu_dec(field)                                             \
+    asm volatile ( "decl %%gs:%c0" : :                                  \
+                   "i" (__builtin_offsetof(struct pda, field))          \
+                   : "memory" )
+
+/* Point the boot vCPU's GS base at pda[0], first thing in arch_init(). */
+void init_boot_pda(void);
+/* Start vCPU cpu running its idle thread; 0 or a negative errno. */
+int arch_start_cpu(unsigned int cpu, struct thread *idle);
+
+#endif /* __ASSEMBLY__ */
+
+#endif /* __ARCH_SMP_H__ */
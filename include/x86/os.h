@@ -7,7 +7,12 @@
 #ifndef _OS_H_
 #define _OS_H_
 
+#ifdef CONFIG_SMP
+#include <mini-os/arch_smp.h>
+#define smp_processor_id() this_cpu_read(cpu)
+#else
 #define smp_processor_id() 0
+#endif
 
 
 #ifndef __ASSEMBLY__
@@ -66,6 +71,9 @@
 extern shared_info_t *HYPERVISOR_shared_info;
 
 void trap_init(void);
+#ifdef CONFIG_SMP
+void trap_init_vcpu(vcpu_guest_context_t *ctxt);
+#endif
 void trap_fini(void);
 #ifndef CONFIG_PARAVIRT
 void xen_callback_vector(void);
@@ -85,42 +93,75 @@ void arch_fini(void);
  * includes these barriers, for example.
  */
 
+/*
+ * A preempted thread can be moved to another vCPU, so it must not be
+ * preempted between looking up its vcpu_info and using it: it would mask or
+ * unmask the events of the vCPU it left.  Only the count is raised, on the
+ * vCPU it is running on, in a single instruction.  Once events are masked
+ * there is no preemption anyway, so nothing is missed by dropping it without
+ * a check; the others look at need_resched on the way out.
+ */
+#if defined(CONFIG_SMP) && defined(CONFIG_PREEMPT)
+void preempt_schedule(void);
+#define __vcpu_pin()		this_cpu_inc(preempt)
+#define __vcpu_unpin()		this_cpu_dec(preempt)
+#define __vcpu_unpin_check()						\
+do {									\
+	this_cpu_dec(preempt);						\
+	if ( !this_cpu_read(preempt) && this_cpu_read(resched) )	\
+		preempt_schedule();					\
+} while (0)
+#else
+#define __vcpu_pin()		((void)0)
+#define __vcpu_unpin()		((void)0)
+#define __vcpu_unpin_check()	((void)0)
+#endif
+
 #define __cli()								\
 do {									\
 	vcpu_info_t *_vcpu;						\
+	__vcpu_pin();							\
 	_vcpu = &HYPERVISOR_shared_info->vcpu_info[smp_processor_id()];	\
 	_vcpu->evtchn_upcall_mask = 1;					\
 	barrier();							\
+	__vcpu_unpin();							\
 } while (0)
 
 #define __sti()								\
 do {									\
 	vcpu_info_t *_vcpu;						\
 	barrier();							\
+	__vcpu_pin();							\
 	_vcpu = &HYPERVISOR_shared_info->vcpu_info[smp_processor_id()];	\
 	_vcpu->evtchn_upcall_mask = 0;					\
 	barrier(); /* unmask then check (avoid races) */		\
 	if ( unlikely(_vcpu->evtchn_upcall_pending) )			\
 		force_evtchn_callback();				\
+	__vcpu_unpin_check();						\
 } while (0)
 
 #define __save_flags(x)							\
 do {									\
 	vcpu_info_t *_vcpu;						\
+	__vcpu_pin();							\
 	_vcpu = &HYPERVISOR_shared_info->vcpu_info[smp_processor_id()];	\
 	(x) = _vcpu->evtchn_upcall_mask;				\
+	__vcpu_unpin_check();						\
 } while (0)
 
 #define __restore_flags(x)						\
 do {									\
 	vcpu_info_t *_vcpu;						\
 	barrier();							\
+	__vcpu_pin();							\
 	_vcpu = &HYPERVISOR_shared_info->vcpu_info[smp_processor_id()];	\
 	if ((_vcpu->evtchn_upcall_mask = (x)) == 0) {			\
 		barrier(); /* unmask then check (avoid races) */	\
 		if ( unlikely(_vcpu->evtchn_upcall_pending) )		\
 			force_evtchn_callback();			\
-	}\
+		__vcpu_unpin_check();					\
+	} else								\
+		__vcpu_unpin();						\
 } while (0)
 
 #define safe_halt()		((void)0)
@@ -128,10 +169,12 @@ do {									\
 #define __save_and_cli(x)						\
 do {									\
 	vcpu_info_t *_vcpu;						\
+	__vcpu_pin();							\
 	_vcpu = &HYPERVISOR_shared_info->vcpu_info[smp_processor_id()];	\
 	(x) = _vcpu->evtchn_upcall_mask;				\
 	_vcpu->evtchn_upcall_mask = 1;					\
 	barrier();							\
+	__vcpu_unpin();							\
 } while (0)
 
 #define irqs_disabled()			\
@@ -212,8 +255,13 @@ void __local_irq_enable(void);
 #endif
 
 
+#ifdef CONFIG_SMP
+#define LOCK_PREFIX "lock ; "
+#define LOCK "lock ; "
+#else
 #define LOCK_PREFIX ""
 #define LOCK ""
+#endif
 #define ADDR (*(volatile long *) addr)
 /*
  * Make sure gcc doesn't try to be clever and move things around
@@ -222,6 +270,14 @@ void __local_irq_enable(void);
  */
 typedef struct { volatile int counter; } atomic_t;
 
+static inline unsigned long read_cr3(void)
+{
+    unsigned long cr3;
+
+    asm volatile( "mov %%cr3, %0" : "=r" (cr3) );
+    return cr3;
+}
+
 static inline void write_cr3(unsigned long cr3)
 {
     asm volatile( "mov %0, %%cr3" : : "r" (cr3) : "memory" );
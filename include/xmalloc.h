@@ -1,21 +1,32 @@
 #ifndef __XMALLOC_H__
 #define __XMALLOC_H__
 
+#define DEFAULT_ALIGN (sizeof(unsigned long))
+
 #ifdef HAVE_LIBC
 
 #include <stdlib.h>
 #include <malloc.h>
+#include <string.h>
 /* Allocate space for typed object. */
 #define _xmalloc(size, align) memalign(align, size)
 #define xfree(ptr) free(ptr)
 
+static inline void *_xzalloc(size_t size, size_t align)
+{
+    void *p = memalign(align, size);
+
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
 #else
 
 #include <limits.h>
 
-#define DEFAULT_ALIGN (sizeof(unsigned long))
-
 extern void *malloc(size_t size);
+extern void *calloc(size_t nmemb, size_t size);
 extern void *realloc(void *ptr, size_t size);
 extern void free(void *ptr);
 
@@ -24,9 +35,40 @@ extern void xfree(const void *);
 
 /* Underlying functions */
 extern void *_xmalloc(size_t size, size_t align);
+/* Zeroed memory, large blocks are populated on first write. */
+extern void *_xzalloc(size_t size, size_t align);
 
 #endif
 
+/*
+ * Caches of fixed size objects, carved from page sized slabs.  The optional
+ * constructor is run on every object handed out by xmem_cache_alloc().
+ * align must be a power of two; xmem_cache_create() returns NULL if it is
+ * not, if an object does not fit in a slab, or if out of memory.
+ */
+struct xmem_cache;
+
+struct xmem_cache *xmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *));
+void xmem_cache_destroy(struct xmem_cache *cache);
+void *xmem_cache_alloc(struct xmem_cache *cache);
+void xmem_cache_free(struct xmem_cache *cache, void *obj);
+
+/*
+ * Allocator statistics.  Only the slab fields are maintained when building
+ * against a libc, which then provides malloc() itself.
+ */
+struct xmalloc_stats {
+    unsigned long slab_pages;       /* Pages held by slabs. */
+    unsigned long slab_bytes;       /* Bytes of slab objects in use. */
+    unsigned long block_bytes;      /* Usable bytes of other allocations. */
+    unsigned long block_overhead;   /* Their headers, padding and tags. */
+    unsigned long freelist_len;     /* Blocks on the free list. */
+    unsigned long freelist_bytes;   /* Bytes on the free list. */
+};
+void get_xmalloc_stats(struct xmalloc_stats *stats);
+void print_xmalloc_stats(void);
+
 static inline void *_xmalloc_array(size_t size, size_t align, size_t num)
 {
 	/* Check for overflow. */
@@ -35,10 +77,20 @@ static inline void *_xmalloc_array(size_t size, size_t align, size_t num)
  	return _xmalloc(size * num, align);
 }
 
+static inline void *_xzalloc_array(size_t size, size_t align, size_t num)
+{
+	/* Check for overflow. */
+	if (size && num > UINT_MAX / size)
+		return NULL;
+	return _xzalloc(size * num, align);
+}
+
 /* Allocate space for typed object. */
 #define xmalloc(_type) ((_type *)_xmalloc(sizeof(_type), __alignof__(_type)))
+#define xzalloc(_type) ((_type *)_xzalloc(sizeof(_type), __alignof__(_type)))
 
 /* Allocate space for array of typed objects. */
 #define xmalloc_array(_type, _num) ((_type *)_xmalloc_array(sizeof(_type), __alignof__(_type), _num))
+#define xzalloc_array(_type, _num) ((_type *)_xzalloc_array(sizeof(_type), __alignof__(_type), _num))
 
 #endif /* __XMALLOC_H__ */
@@ -31,11 +31,13 @@
 #include <mini-os/kernel.h>
 #include <mini-os/hypervisor.h>
 #include <mini-os/mm.h>
+#include <mini-os/balloon.h>
 #include <mini-os/events.h>
 #include <mini-os/time.h>
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
 #include <mini-os/sched.h>
+#include <mini-os/smp.h>
 #include <mini-os/xenbus.h>
 #include <mini-os/gnttab.h>
 #include <mini-os/netfront.h>
@@ -53,6 +55,40 @@
 uint8_t xen_features[XENFEAT_NR_SUBMAPS * 32];
 char cmdline[MAX_CMDLINE_SIZE];
 
+/*
+ * Value of a "name=value" parameter on the command line, or def if there is
+ * none.  The parameter is removed so that the application does not see it.
+ */
+unsigned long get_boot_param(const char *name, unsigned long def)
+{
+    size_t len = strlen(name);
+    unsigned long val;
+    char *p, *end;
+
+    for ( p = cmdline; *p; )
+    {
+        while ( *p == ' ' )
+            p++;
+        if ( !strncmp(p, name, len) && p[len] == '=' )
+        {
+            val = strtoul(p + len + 1, &end, 0);
+            if ( end != p + len + 1 && (*end == ' ' || !*end) )
+            {
+                while ( *end == ' ' )
+                    end++;
+                while ( (*p++ = *end++) )
+                    ;
+                printk("Boot parameter %s=%lu\n", name, val);
+                return val;
+            }
+        }
+        while ( *p && *p != ' ' )
+            p++;
+    }
+
+    return def;
+}
+
 void setup_xen_features(void)
 {
     xen_feature_info_t fi;
@@ -108,6 +144,17 @@ void start_kernel(void* par)
 #ifdef CONFIG_XENBUS
     /* Init shutdown thread */
     init_shutdown((start_info_t *)par);
+
+    /* Init balloon thread following the memory target */
+    init_balloon();
+#endif
+
+    /* Bring up the other vCPUs */
+    init_smp();
+
+#ifdef HAVE_LIBC
+    /* Before any application code gets to use stdin, stdout and stderr. */
+    init_files();
 #endif
 
     /* Call (possibly overridden) app_main() */
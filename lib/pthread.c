@@ -0,0 +1,707 @@
+/*
+ * POSIX threads on top of Mini-OS threads
+ *
+ * All the state below is protected by the wait queue lock, the one wake_up()
+ * and wait_event() take too.  A thread thus drops a mutex and goes to sleep
+ * on a condition variable without a wakeup getting in between.  Sleepers are
+ * woken by taking them off the wait queue, so they can tell a wakeup from a
+ * timeout.
+ */
+
+#ifdef HAVE_LIBC
+#include <os.h>
+#include <sched.h>
+#include <wait.h>
+#include <xmalloc.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+struct pthread {
+    struct thread *thread;      /* NULL until it starts and once it exits. */
+    void *(*start_routine)(void *);
+    void *arg;
+    void *retval;
+    int prio;
+    int detached;
+    int exited;
+    struct wait_queue_head join_wait;
+    struct {
+        unsigned int seq;       /* key_seq[] the value was set with. */
+        const void *value;
+    } specific[PTHREAD_KEYS_MAX];
+};
+
+static int key_used[PTHREAD_KEYS_MAX];
+static unsigned int key_seq[PTHREAD_KEYS_MAX];
+static void (*key_destructors[PTHREAD_KEYS_MAX])(void *);
+
+static DECLARE_WAIT_QUEUE_HEAD(once_wait);
+
+/* Objects set up by a static initializer don't have their queue ready. */
+static void init_wait(struct wait_queue_head *wq)
+{
+    if (!wq->stqh_last)
+        init_waitqueue_head(wq);
+}
+
+/*
+ * Sleep on wq until taken off it by wake_one() or wake_all(), or until
+ * deadline if not 0.  Called and returns with the wait queue lock held.
+ */
+static int wait_on(struct wait_queue_head *wq, s_time_t deadline,
+                   unsigned long *flags)
+{
+    struct thread *thread = get_current();
+    struct wait_queue w;
+
+    init_waitqueue_entry(&w, thread);
+    init_wait(wq);
+    MINIOS_STAILQ_INSERT_TAIL(wq, &w, thread_list);
+    w.waiting = 1;
+    while (w.waiting) {
+        if (deadline && NOW() >= deadline) {
+            remove_wait_queue(wq, &w);
+            return ETIMEDOUT;
+        }
+        thread->wakeup_time = deadline;
+        clear_runnable(thread);
+        waitq_unlock_irqrestore(*flags);
+        schedule();
+        waitq_lock_irqsave(*flags);
+    }
+    return 0;
+}
+
+static void wake_one(struct wait_queue_head *wq)
+{
+    struct wait_queue *w = MINIOS_STAILQ_FIRST(wq);
+
+    if (w) {
+        remove_wait_queue(wq, w);
+        wake(w->thread);
+    }
+}
+
+static void wake_all(struct wait_queue_head *wq)
+{
+    struct wait_queue *w;
+
+    while ((w = MINIOS_STAILQ_FIRST(wq))) {
+        remove_wait_queue(wq, w);
+        wake(w->thread);
+    }
+}
+
+int pthread_attr_init(pthread_attr_t *attr)
+{
+    attr->stacksize = STACK_SIZE;
+    attr->detachstate = PTHREAD_CREATE_JOINABLE;
+    attr->priority = SCHED_PRIO_DEFAULT;
+    return 0;
+}
+
+int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize)
+{
+    if (stacksize < PTHREAD_STACK_MIN)
+        return EINVAL;
+    attr->stacksize = stacksize;
+    return 0;
+}
+
+int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize)
+{
+    *stacksize = attr->stacksize;
+    return 0;
+}
+
+int pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate)
+{
+    if (detachstate != PTHREAD_CREATE_JOINABLE &&
+        detachstate != PTHREAD_CREATE_DETACHED)
+        return EINVAL;
+    attr->detachstate = detachstate;
+    return 0;
+}
+
+int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *detachstate)
+{
+    *detachstate = attr->detachstate;
+    return 0;
+}
+
+int pthread_attr_setschedparam(pthread_attr_t *attr,
+                               const struct sched_param *param)
+{
+    if (param->sched_priority < SCHED_PRIO_MIN ||
+        param->sched_priority > SCHED_PRIO_MAX)
+        return EINVAL;
+    attr->priority = param->sched_priority;
+    return 0;
+}
+
+int pthread_attr_getschedparam(const pthread_attr_t *attr,
+                               struct sched_param *param)
+{
+    param->sched_priority = attr->priority;
+    return 0;
+}
+
+static void pthread_start(void *data)
+{
+    struct pthread *self = data;
+    struct thread *thread = get_current();
+    unsigned long flags;
+
+    waitq_lock_irqsave(flags);
+    self->thread = thread;
+    thread->pthread = self;
+    /* pthread_setschedparam() may have been called before it got here. */
+    if (thread->prio != self->prio)
+        set_thread_priority(thread, self->prio);
+    waitq_unlock_irqrestore(flags);
+
+    pthread_exit(self->start_routine(self->arg));
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg)
+{
+    pthread_attr_t defaults;
+    struct pthread *pthread;
+
+    if (!attr) {
+        pthread_attr_init(&defaults);
+        attr = &defaults;
+    }
+    pthread = xzalloc(struct pthread);
+    if (!pthread)
+        return EAGAIN;
+    pthread->start_routine = start_routine;
+    pthread->arg = arg;
+    pthread->prio = attr->priority;
+    pthread->detached = attr->detachstate == PTHREAD_CREATE_DETACHED;
+    init_waitqueue_head(&pthread->join_wait);
+
+    /* A detached one may be gone before create_thread_ex() returns. */
+    *thread = pthread;
+    if (!create_thread_ex("pthread", pthread_start, pthread, attr->stacksize,
+                          attr->priority)) {
+        xfree(pthread);
+        return EAGAIN;
+    }
+    return 0;
+}
+
+pthread_t pthread_self(void)
+{
+    struct thread *thread = get_current();
+    struct pthread *self = thread->pthread;
+
+    /* Threads not started by pthread_create(), main for instance. */
+    if (!self) {
+        self = xzalloc(struct pthread);
+        if (!self) {
+            printk("Out of memory for pthread_self()\n");
+            BUG();
+        }
+        self->thread = thread;
+        self->prio = thread->prio;
+        self->detached = 1;
+        init_waitqueue_head(&self->join_wait);
+        thread->pthread = self;
+    }
+    return self;
+}
+
+static void run_key_destructors(struct pthread *self)
+{
+    void (*destructor)(void *);
+    const void *value;
+    int i, key, again = 1;
+
+    for (i = 0; i < PTHREAD_DESTRUCTOR_ITERATIONS && again; i++) {
+        again = 0;
+        for (key = 0; key < PTHREAD_KEYS_MAX; key++) {
+            destructor = key_destructors[key];
+            value = pthread_getspecific(key);
+            if (!key_used[key] || !destructor || !value)
+                continue;
+            self->specific[key].value = NULL;
+            destructor((void *)value);
+            again = 1;
+        }
+    }
+}
+
+/*
+ * The thread keeps its struct pthread, freed along with it, if nobody is to
+ * join it.
+ */
+void pthread_exit(void *retval)
+{
+    struct pthread *self = pthread_self();
+    unsigned long flags;
+
+    run_key_destructors(self);
+
+    waitq_lock_irqsave(flags);
+    self->retval = retval;
+    self->exited = 1;
+    self->thread = NULL;
+    if (!self->detached) {
+        get_current()->pthread = NULL;
+        wake_all(&self->join_wait);
+    }
+    waitq_unlock_irqrestore(flags);
+
+    exit_thread();
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+    unsigned long flags;
+
+    if (thread == pthread_self())
+        return EDEADLK;
+
+    waitq_lock_irqsave(flags);
+    if (thread->detached) {
+        waitq_unlock_irqrestore(flags);
+        return EINVAL;
+    }
+    while (!thread->exited)
+        wait_on(&thread->join_wait, 0, &flags);
+    waitq_unlock_irqrestore(flags);
+
+    if (retval)
+        *retval = thread->retval;
+    xfree(thread);
+    return 0;
+}
+
+int pthread_detach(pthread_t thread)
+{
+    unsigned long flags;
+    int exited;
+
+    waitq_lock_irqsave(flags);
+    if (thread->detached) {
+        waitq_unlock_irqrestore(flags);
+        return EINVAL;
+    }
+    thread->detached = 1;
+    exited = thread->exited;
+    waitq_unlock_irqrestore(flags);
+
+    /* Otherwise it goes with the thread. */
+    if (exited)
+        xfree(thread);
+    return 0;
+}
+
+int pthread_setschedparam(pthread_t thread, int policy,
+                          const struct sched_param *param)
+{
+    unsigned long flags;
+
+    if (policy != SCHED_OTHER)
+        return ENOTSUP;
+    if (param->sched_priority < SCHED_PRIO_MIN ||
+        param->sched_priority > SCHED_PRIO_MAX)
+        return EINVAL;
+
+    waitq_lock_irqsave(flags);
+    thread->prio = param->sched_priority;
+    if (thread->thread)
+        set_thread_priority(thread->thread, thread->prio);
+    waitq_unlock_irqrestore(flags);
+    return 0;
+}
+
+int pthread_getschedparam(pthread_t thread, int *policy,
+                          struct sched_param *param)
+{
+    *policy = SCHED_OTHER;
+    param->sched_priority = thread->prio;
+    return 0;
+}
+
+
+
+/*
+ * A key's values in all threads go back to NULL when it is created again:
+ * those set with an older key_seq[] are ignored.
+ */
+int pthread_key_create(pthread_key_t *key, void (*destr_function)(void*))
+{
+    unsigned long flags;
+    pthread_key_t i;
+
+    waitq_lock_irqsave(flags);
+    for (i = 0; i < PTHREAD_KEYS_MAX; i++)
+        if (!key_used[i])
+            break;
+    if (i == PTHREAD_KEYS_MAX) {
+        waitq_unlock_irqrestore(flags);
+        return EAGAIN;
+    }
+    key_used[i] = 1;
+    key_seq[i]++;
+    key_destructors[i] = destr_function;
+    waitq_unlock_irqrestore(flags);
+
+    *key = i;
+    return 0;
+}
+
+int pthread_key_delete(pthread_key_t key)
+{
+    unsigned long flags;
+
+    if (key >= PTHREAD_KEYS_MAX || !key_used[key])
+        return EINVAL;
+    waitq_lock_irqsave(flags);
+    key_used[key] = 0;
+    key_destructors[key] = NULL;
+    waitq_unlock_irqrestore(flags);
+    return 0;
+}
+
+int pthread_setspecific(pthread_key_t key, const void *pointer)
+{
+    struct pthread *self = pthread_self();
+
+    if (key >= PTHREAD_KEYS_MAX || !key_used[key])
+        return EINVAL;
+    self->specific[key].seq = key_seq[key];
+    self->specific[key].value = pointer;
+    return 0;
+}
+
+void *pthread_getspecific(pthread_key_t key)
+{
+    struct pthread *self = pthread_self();
+
+    if (key >= PTHREAD_KEYS_MAX || self->specific[key].seq != key_seq[key])
+        return NULL;
+    return (void *)self->specific[key].value;
+}
+
+
+
+int pthread_mutexattr_settype(pthread_mutexattr_t *mattr, int kind)
+{
+    if (kind != PTHREAD_MUTEX_NORMAL && kind != PTHREAD_MUTEX_RECURSIVE &&
+        kind != PTHREAD_MUTEX_ERRORCHECK)
+        return EINVAL;
+    mattr->type = kind;
+    return 0;
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *mattr)
+{
+    mutex->type = mattr ? mattr->type : PTHREAD_MUTEX_DEFAULT;
+    mutex->count = 0;
+    mutex->owner = NULL;
+    init_waitqueue_head(&mutex->wait);
+    return 0;
+}
+
+/* With the wait queue lock held. */
+static int __mutex_lock(pthread_mutex_t *mutex, int try, unsigned long *flags)
+{
+    struct thread *self = get_current();
+
+    if (mutex->count && mutex->owner == self) {
+        if (mutex->type == PTHREAD_MUTEX_RECURSIVE) {
+            mutex->count++;
+            return 0;
+        }
+        if (mutex->type == PTHREAD_MUTEX_ERRORCHECK)
+            return try ? EBUSY : EDEADLK;
+    }
+    while (mutex->count) {
+        if (try)
+            return EBUSY;
+        wait_on(&mutex->wait, 0, flags);
+    }
+    mutex->count = 1;
+    mutex->owner = self;
+    return 0;
+}
+
+static int __mutex_unlock(pthread_mutex_t *mutex)
+{
+    if (!mutex->count ||
+        (mutex->type != PTHREAD_MUTEX_NORMAL && mutex->owner != get_current()))
+        return EPERM;
+    if (--mutex->count)
+        return 0;
+    mutex->owner = NULL;
+    wake_one(&mutex->wait);
+    return 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    unsigned long flags;
+    int ret;
+
+    waitq_lock_irqsave(flags);
+    ret = __mutex_lock(mutex, 0, &flags);
+    waitq_unlock_irqrestore(flags);
+    return ret;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    unsigned long flags;
+    int ret;
+
+    waitq_lock_irqsave(flags);
+    ret = __mutex_lock(mutex, 1, &flags);
+    waitq_unlock_irqrestore(flags);
+    return ret;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    unsigned long flags;
+    int ret;
+
+    waitq_lock_irqsave(flags);
+    ret = __mutex_unlock(mutex);
+    waitq_unlock_irqrestore(flags);
+    return ret;
+}
+
+
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *cattr)
+{
+    init_waitqueue_head(&cond->wait);
+    return 0;
+}
+
+/*
+ * A recursive mutex is released however many times it is locked, and gets
+ * its count back once reacquired.
+ */
+static int cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                     s_time_t deadline)
+{
+    unsigned long flags;
+    unsigned int count;
+    int ret;
+
+    waitq_lock_irqsave(flags);
+    count = mutex->count;
+    if (count > 1)
+        mutex->count = 1;
+    ret = __mutex_unlock(mutex);
+    if (ret) {
+        mutex->count = count;
+    } else {
+        ret = wait_on(&cond->wait, deadline, &flags);
+        __mutex_lock(mutex, 0, &flags);
+        mutex->count = count;
+    }
+    waitq_unlock_irqrestore(flags);
+    return ret;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    return cond_wait(cond, mutex, 0);
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime)
+{
+    struct timespec now;
+    s_time_t deadline;
+
+    if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L)
+        return EINVAL;
+    clock_gettime(CLOCK_REALTIME, &now);
+    deadline = NOW() + SECONDS(abstime->tv_sec - now.tv_sec) +
+               (abstime->tv_nsec - now.tv_nsec);
+    /* 0 would be no deadline at all. */
+    if (deadline <= 0)
+        deadline = 1;
+    return cond_wait(cond, mutex, deadline);
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    unsigned long flags;
+
+    waitq_lock_irqsave(flags);
+    wake_one(&cond->wait);
+    waitq_unlock_irqrestore(flags);
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    unsigned long flags;
+
+    waitq_lock_irqsave(flags);
+    wake_all(&cond->wait);
+    waitq_unlock_irqrestore(flags);
+    return 0;
+}
+
+
+
+int pthread_rwlock_init(pthread_rwlock_t *rwlock,
+                        const pthread_rwlockattr_t *rwattr)
+{
+    rwlock->state = 0;
+    rwlock->writers_waiting = 0;
+    init_waitqueue_head(&rwlock->wait);
+    return 0;
+}
+
+static int rwlock_rdlock(pthread_rwlock_t *rwlock, int try)
+{
+    unsigned long flags;
+
+    waitq_lock_irqsave(flags);
+    while (rwlock->state < 0 || rwlock->writers_waiting) {
+        if (try) {
+            waitq_unlock_irqrestore(flags);
+            return EBUSY;
+        }
+        wait_on(&rwlock->wait, 0, &flags);
+    }
+    rwlock->state++;
+    waitq_unlock_irqrestore(flags);
+    return 0;
+}
+
+static int rwlock_wrlock(pthread_rwlock_t *rwlock, int try)
+{
+    unsigned long flags;
+
+    waitq_lock_irqsave(flags);
+    while (rwlock->state) {
+        if (try) {
+            waitq_unlock_irqrestore(flags);
+            return EBUSY;
+        }
+        rwlock->writers_waiting++;
+        wait_on(&rwlock->wait, 0, &flags);
+        rwlock->writers_waiting--;
+    }
+    rwlock->state = -1;
+    waitq_unlock_irqrestore(flags);
+    return 0;
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)
+{
+    return rwlock_rdlock(rwlock, 0);
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)
+{
+    return rwlock_rdlock(rwlock, 1);
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)
+{
+    return rwlock_wrlock(rwlock, 0);
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock)
+{
+    return rwlock_wrlock(rwlock, 1);
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock)
+{
+    unsigned long flags;
+
+    waitq_lock_irqsave(flags);
+    if (!rwlock->state) {
+        waitq_unlock_irqrestore(flags);
+        return EPERM;
+    }
+    if (rwlock->state < 0)
+        rwlock->state = 0;
+    else
+        rwlock->state--;
+    /* Waiting writers go first, readers check writers_waiting. */
+    if (!rwlock->state)
+        wake_all(&rwlock->wait);
+    waitq_unlock_irqrestore(flags);
+    return 0;
+}
+
+
+
+int pthread_barrier_init(pthread_barrier_t *barrier,
+                         const pthread_barrierattr_t *battr,
+                         unsigned int count)
+{
+    if (!count)
+        return EINVAL;
+    barrier->count = count;
+    barrier->arrived = 0;
+    barrier->generation = 0;
+    init_waitqueue_head(&barrier->wait);
+    return 0;
+}
+
+int pthread_barrier_wait(pthread_barrier_t *barrier)
+{
+    unsigned long flags;
+    unsigned int generation;
+    int ret = 0;
+
+    waitq_lock_irqsave(flags);
+    generation = barrier->generation;
+    if (++barrier->arrived == barrier->count) {
+        barrier->arrived = 0;
+        barrier->generation++;
+        wake_all(&barrier->wait);
+        ret = PTHREAD_BARRIER_SERIAL_THREAD;
+    } else {
+        while (generation == barrier->generation)
+            wait_on(&barrier->wait, 0, &flags);
+    }
+    waitq_unlock_irqrestore(flags);
+    return ret;
+}
+
+
+
+#define ONCE_RUNNING    1
+#define ONCE_DONE       2
+
+int pthread_once(pthread_once_t *once_control, void (*init_routine)(void))
+{
+    unsigned long flags;
+
+    waitq_lock_irqsave(flags);
+    while (once_control->done == ONCE_RUNNING)
+        wait_on(&once_wait, 0, &flags);
+    if (once_control->done) {
+        waitq_unlock_irqrestore(flags);
+        return 0;
+    }
+    once_control->done = ONCE_RUNNING;
+    waitq_unlock_irqrestore(flags);
+
+    init_routine();
+
+    waitq_lock_irqsave(flags);
+    once_control->done = ONCE_DONE;
+    wake_all(&once_wait);
+    waitq_unlock_irqrestore(flags);
+    return 0;
+}
+#endif
@@ -86,17 +86,39 @@
 	return ret; \
     }
 
+/* Default size of the file table, "nofile=" on the command line. */
 #define NOFILE 32
 extern void minios_interface_close_fd(int fd);
 extern void minios_evtchn_close_fd(int fd);
 extern void minios_gnttab_close_fd(int fd);
 
 pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
-struct file files[NOFILE] = {
-    { .type = FTYPE_CONSOLE }, /* stdin */
-    { .type = FTYPE_CONSOLE }, /* stdout */
-    { .type = FTYPE_CONSOLE }, /* stderr */
-};
+struct file *files;
+int nr_files;
+
+/*
+ * The table cannot grow later on: drivers keep pointers to their entries.
+ * Nor can it go past FD_SETSIZE, as select() and poll() use fd_sets.
+ */
+void init_files(void)
+{
+    nr_files = get_boot_param("nofile", NOFILE);
+    if (nr_files < 3)
+        nr_files = 3;
+    if (nr_files > FD_SETSIZE) {
+        printk("nofile=%d is above FD_SETSIZE, using %d\n",
+               nr_files, FD_SETSIZE);
+        nr_files = FD_SETSIZE;
+    }
+    files = calloc(nr_files, sizeof(*files));
+    if (!files) {
+        printk("Cannot allocate %d file descriptors\n", nr_files);
+        do_exit();
+    }
+    files[0].type = FTYPE_CONSOLE; /* stdin */
+    files[1].type = FTYPE_CONSOLE; /* stdout */
+    files[2].type = FTYPE_CONSOLE; /* stderr */
+}
 
 DECLARE_WAIT_QUEUE_HEAD(event_queue);
 
@@ -104,7 +126,7 @@ int alloc_fd(enum fd_type type)
 {
     int i;
     pthread_mutex_lock(&fd_lock);
-    for (i=0; i<NOFILE; i++) {
+    for (i=0; i<nr_files; i++) {
 	if (files[i].type == FTYPE_NONE) {
 	    files[i].type = type;
 	    pthread_mutex_unlock(&fd_lock);
@@ -120,7 +142,7 @@ void close_all_files(void)
 {
     int i;
     pthread_mutex_lock(&fd_lock);
-    for (i=NOFILE - 1; i > 0; i--)
+    for (i=nr_files - 1; i > 0; i--)
 	if (files[i].type != FTYPE_NONE)
             close(i);
     pthread_mutex_unlock(&fd_lock);
@@ -718,9 +740,14 @@ static int select_poll(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exce
 
 #ifdef LIBC_VERBOSE
     static int nb;
-    static int nbread[NOFILE], nbwrite[NOFILE], nbexcept[NOFILE];
+    static int *nbread, *nbwrite, *nbexcept;
     static s_time_t lastshown;
 
+    if (!nbread) {
+        nbread = calloc(nr_files, sizeof(*nbread));
+        nbwrite = calloc(nr_files, sizeof(*nbwrite));
+        nbexcept = calloc(nr_files, sizeof(*nbexcept));
+    }
     nb++;
 #endif
 
@@ -848,9 +875,9 @@ static int select_poll(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exce
 		printk(" %dE", nbexcept[i]);
 	}
 	printk("\n");
-	memset(nbread, 0, sizeof(nbread));
-	memset(nbwrite, 0, sizeof(nbwrite));
-	memset(nbexcept, 0, sizeof(nbexcept));
+	memset(nbread, 0, nr_files * sizeof(*nbread));
+	memset(nbwrite, 0, nr_files * sizeof(*nbwrite));
+	memset(nbexcept, 0, nr_files * sizeof(*nbexcept));
 	nb = 0;
     }
 #endif
@@ -1038,7 +1065,7 @@ int poll(struct pollfd _pfd[], nfds_t _nfds, int _timeout)
         if (fd < 0) continue;
 
         /* fd is invalid, revents = POLLNVAL, increment counter */
-        if (fd >= NOFILE || files[fd].type == FTYPE_NONE) {
+        if (fd >= nr_files || files[fd].type == FTYPE_NONE) {
             n++;
             _pfd[i].revents |= POLLNVAL;
             continue;
@@ -1084,7 +1111,7 @@ int poll(struct pollfd _pfd[], nfds_t _nfds, int _timeout)
         fd = _pfd[i].fd;
 
         /* the revents has already been set for all error case */
-        if (fd < 0 || fd >= NOFILE || files[fd].type == FTYPE_NONE)
+        if (fd < 0 || fd >= nr_files || files[fd].type == FTYPE_NONE)
             continue;
 
         if (FD_ISSET(fd, &rfds) || FD_ISSET(fd, &wfds) || FD_ISSET(fd, &efds))
@@ -1447,7 +1474,7 @@ const struct termios default_termios = {0,             /* iflag */
 
 int tcsetattr(int fildes, int action, const struct termios *tios)
 {
-    if (fildes < 0 || fildes >= NOFILE) {
+    if (fildes < 0 || fildes >= nr_files) {
         errno = EBADF;
         return -1;
     }
@@ -1482,7 +1509,7 @@ int tcsetattr(int fildes, int action, const struct termios *tios)
 
 int tcgetattr(int fildes, struct termios *tios)
 {
-    if (fildes < 0 || fildes >= NOFILE) {
+    if (fildes < 0 || fildes >= nr_files) {
         errno = EBADF;
         return -1;
     }
@@ -15,8 +15,10 @@
  * Description: simple memory allocator
  *
  ****************************************************************************
- * Simple allocator for Mini-os.  If larger than a page, simply use the
- * page-order allocator.
+ * Simple allocator for Mini-os.  Small objects come from page sized slabs
+ * of power-of-two size classes, medium ones from a free list of blocks
+ * carved from pages.  If larger than a page, simply use the page-order
+ * allocator.
  *
  * Copy of the allocator for Xen by Rusty Russell:
  * Copyright (C) 2005 Rusty Russell IBM Corporation
@@ -42,6 +44,250 @@
 #include <mini-os/lib.h>
 #include <mini-os/list.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/spinlock.h>
+
+/*
+ * Slabs: a page holding a header followed by equally sized objects.  A set
+ * bit in free_map marks a free object.  Pages with at least one free object
+ * are queued on their cache's partial list, full pages are on no list.
+ */
+#define SLAB_MIN_SHIFT   4
+#define SLAB_MIN_SIZE    (1UL << SLAB_MIN_SHIFT)
+#define SLAB_MAX_OBJS    (PAGE_SIZE / SLAB_MIN_SIZE)
+#define SLAB_MAP_BITS    (sizeof(unsigned long) * 8)
+#define SLAB_MAP_WORDS   ((SLAB_MAX_OBJS + SLAB_MAP_BITS - 1) / SLAB_MAP_BITS)
+
+struct slab_page
+{
+    /*
+     * Overlays the size field of the block header found at the start of
+     * every other page handed out by xmalloc.  Always 0 for slab pages.
+     */
+    size_t size;
+    struct xmem_cache *cache;
+    MINIOS_TAILQ_ENTRY(struct slab_page) partial;
+    unsigned int nr_free;
+    unsigned long free_map[SLAB_MAP_WORDS];
+};
+
+struct xmem_cache
+{
+    const char *name;
+    size_t size;                /* Object size, multiple of the alignment. */
+    size_t offset;              /* Offset of the first object in a slab. */
+    unsigned int nr_objs;       /* Objects per slab. */
+    unsigned long nr_full;      /* Slabs on no list, all objects in use. */
+    void (*ctor)(void *);
+    MINIOS_TAILQ_HEAD(, struct slab_page) partial;
+};
+
+static struct xmalloc_stats xstats;
+
+#ifdef CONFIG_SMP
+/*
+ * The slabs and the free list are shared by all vCPUs.  Taken with events
+ * masked, as a callback may allocate while a thread is at it, and dropped
+ * around calls into the page allocator, which may balloon or shrink.
+ */
+static DEFINE_SPINLOCK(xmalloc_lock);
+#define xmalloc_lock_irqsave(flags)      spin_lock_irqsave(&xmalloc_lock, flags)
+#define xmalloc_unlock_irqrestore(flags) spin_unlock_irqrestore(&xmalloc_lock, flags)
+#else
+/*
+ * Only threads use it then, but one preempted half way through would leave
+ * the slabs and the free list to the next one in a mess.
+ */
+#define xmalloc_lock_irqsave(flags)      \
+    do { (void)&(flags); preempt_disable(); } while ( 0 )
+#define xmalloc_unlock_irqrestore(flags) \
+    do { (void)&(flags); preempt_enable(); } while ( 0 )
+#endif
+
+/* Return size, increased to alignment with align. */
+static inline size_t align_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+static void slab_cache_setup(struct xmem_cache *cache, const char *name,
+                             size_t size, size_t align,
+                             void (*ctor)(void *))
+{
+    if ( size < SLAB_MIN_SIZE )
+        size = SLAB_MIN_SIZE;
+    cache->name = name;
+    cache->size = align_up(size, align);
+    cache->offset = align_up(sizeof(struct slab_page), align);
+    cache->nr_objs = (PAGE_SIZE - cache->offset) / cache->size;
+    cache->nr_full = 0;
+    cache->ctor = ctor;
+    MINIOS_TAILQ_INIT(&cache->partial);
+}
+
+static struct slab_page *slab_new_page(struct xmem_cache *cache,
+                                       unsigned long *flags)
+{
+    struct slab_page *page;
+    unsigned int i;
+
+    xmalloc_unlock_irqrestore(*flags);
+    page = (struct slab_page *)alloc_page();
+    xmalloc_lock_irqsave(*flags);
+    if ( page == NULL )
+        return NULL;
+
+    xstats.slab_pages++;
+    page->size = 0;
+    page->cache = cache;
+    page->nr_free = cache->nr_objs;
+    memset(page->free_map, 0, sizeof(page->free_map));
+    for ( i = 0; i < cache->nr_objs; i++ )
+        page->free_map[i / SLAB_MAP_BITS] |= 1UL << (i % SLAB_MAP_BITS);
+    MINIOS_TAILQ_INSERT_HEAD(&cache->partial, page, partial);
+
+    return page;
+}
+
+static void *slab_alloc(struct xmem_cache *cache, unsigned long *flags)
+{
+    struct slab_page *page;
+    unsigned int i, bit;
+
+    /* Someone may have used up the new page while the lock was dropped. */
+    while ( (page = MINIOS_TAILQ_FIRST(&cache->partial)) == NULL )
+        if ( slab_new_page(cache, flags) == NULL )
+            return NULL;
+
+    for ( i = 0; !page->free_map[i]; i++ )
+        ;
+    bit = __ffs(page->free_map[i]);
+    page->free_map[i] &= ~(1UL << bit);
+    if ( --page->nr_free == 0 )
+    {
+        MINIOS_TAILQ_REMOVE(&cache->partial, page, partial);
+        cache->nr_full++;
+    }
+    xstats.slab_bytes += cache->size;
+
+    return (char *)page + cache->offset +
+           (i * SLAB_MAP_BITS + bit) * cache->size;
+}
+
+static void slab_free(struct slab_page *page, const void *obj,
+                      unsigned long *flags)
+{
+    struct xmem_cache *cache = page->cache;
+    unsigned long idx;
+
+    idx = ((uintptr_t)obj - (uintptr_t)page - cache->offset) / cache->size;
+    BUG_ON(idx >= cache->nr_objs);
+    BUG_ON(page->free_map[idx / SLAB_MAP_BITS] &
+           (1UL << (idx % SLAB_MAP_BITS)));
+
+    page->free_map[idx / SLAB_MAP_BITS] |= 1UL << (idx % SLAB_MAP_BITS);
+    xstats.slab_bytes -= cache->size;
+    if ( page->nr_free++ == 0 )
+    {
+        MINIOS_TAILQ_INSERT_HEAD(&cache->partial, page, partial);
+        cache->nr_full--;
+    }
+
+    /*
+     * Keep one empty slab per cache around to absorb alloc/free churn.  With
+     * a single object per slab, one that was full may be empty already.
+     */
+    if ( page->nr_free == cache->nr_objs )
+    {
+        MINIOS_TAILQ_REMOVE(&cache->partial, page, partial);
+        if ( MINIOS_TAILQ_EMPTY(&cache->partial) )
+            MINIOS_TAILQ_INSERT_HEAD(&cache->partial, page, partial);
+        else
+        {
+            xstats.slab_pages--;
+            xmalloc_unlock_irqrestore(*flags);
+            free_page(page);
+            xmalloc_lock_irqsave(*flags);
+        }
+    }
+}
+
+struct xmem_cache *xmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *))
+{
+    struct xmem_cache *cache;
+
+    if ( align == 0 || (align & (align - 1)) )
+        return NULL;
+    if ( align < DEFAULT_ALIGN )
+        align = DEFAULT_ALIGN;
+    if ( align_up(sizeof(struct slab_page), align) + size > PAGE_SIZE )
+        return NULL;
+
+    cache = xmalloc(struct xmem_cache);
+    if ( cache == NULL )
+        return NULL;
+
+    slab_cache_setup(cache, name, size, align, ctor);
+
+    return cache;
+}
+
+void xmem_cache_destroy(struct xmem_cache *cache)
+{
+    struct slab_page *page;
+    unsigned long flags;
+
+    xmalloc_lock_irqsave(flags);
+    /* Those are not on any list, and their objects are still in use. */
+    if ( cache->nr_full )
+        printk("xmem_cache_destroy: %lu full slabs of %s still in use\n",
+               cache->nr_full, cache->name);
+    while ( (page = MINIOS_TAILQ_FIRST(&cache->partial)) != NULL )
+    {
+        MINIOS_TAILQ_REMOVE(&cache->partial, page, partial);
+        if ( page->nr_free != cache->nr_objs )
+            printk("xmem_cache_destroy: objects of %s still in use\n",
+                   cache->name);
+        else
+        {
+            xstats.slab_pages--;
+            xmalloc_unlock_irqrestore(flags);
+            free_page(page);
+            xmalloc_lock_irqsave(flags);
+        }
+    }
+    xmalloc_unlock_irqrestore(flags);
+    xfree(cache);
+}
+
+void *xmem_cache_alloc(struct xmem_cache *cache)
+{
+    unsigned long flags;
+    void *obj;
+
+    xmalloc_lock_irqsave(flags);
+    obj = slab_alloc(cache, &flags);
+    xmalloc_unlock_irqrestore(flags);
+    if ( obj && cache->ctor )
+        cache->ctor(obj);
+
+    return obj;
+}
+
+void xmem_cache_free(struct xmem_cache *cache, void *obj)
+{
+    struct slab_page *page;
+    unsigned long flags;
+
+    if ( obj == NULL )
+        return;
+
+    page = (struct slab_page *)((uintptr_t)obj & PAGE_MASK);
+    BUG_ON(page->size != 0 || page->cache != cache);
+    xmalloc_lock_irqsave(flags);
+    slab_free(page, obj, &flags);
+    xmalloc_unlock_irqrestore(flags);
+}
 
 #ifndef HAVE_LIBC
 /* static spinlock_t freelist_lock = SPIN_LOCK_UNLOCKED; */
@@ -64,15 +310,144 @@ struct xmalloc_pad
     size_t hdr_size;
 };
 
-/* Return size, increased to alignment with align. */
-static inline size_t align_up(size_t size, size_t align)
+/*
+ * Power-of-two size classes from SLAB_MIN_SIZE up to SLAB_MAX_SIZE.  Objects
+ * are naturally aligned, so a class also satisfies any smaller alignment.
+ * A 1024 byte class would lose a quarter of each page to the slab header.
+ */
+#define SLAB_MAX_SHIFT   9
+#define SLAB_MAX_SIZE    (1UL << SLAB_MAX_SHIFT)
+#define SLAB_NR_CLASSES  (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+static struct xmem_cache size_caches[SLAB_NR_CLASSES];
+static int size_caches_ready;
+
+static inline unsigned int size_class(size_t size)
 {
-    return (size + align - 1) & ~(align - 1);
+    unsigned int idx;
+
+    size = (size - 1) >> SLAB_MIN_SHIFT;
+    for ( idx = 0; size; idx++ )
+        size >>= 1;
+    return idx;
+}
+
+static void init_size_caches(void)
+{
+    unsigned int i;
+    size_t size;
+
+    for ( i = 0; i < SLAB_NR_CLASSES; i++ )
+    {
+        size = SLAB_MIN_SIZE << i;
+        slab_cache_setup(&size_caches[i], "size", size, size, NULL);
+    }
+    size_caches_ready = 1;
+}
+
+/* Return the slab page holding p, or NULL if p was not taken from a slab. */
+static struct slab_page *slab_page_of(const void *p)
+{
+    struct slab_page *page;
+
+    /* Slab objects never start a page, the slab header lives there. */
+    if ( !((uintptr_t)p & ~PAGE_MASK) )
+        return NULL;
+
+    page = (struct slab_page *)((uintptr_t)p & PAGE_MASK);
+    return page->size == 0 ? page : NULL;
+}
+
+/*
+ * Blocks carved from a page tile it completely.  Each one carries its size
+ * both in the header and in a trailing tag, with BLOCK_FREE set while the
+ * block is on the free list, so the neighbours of a block can be found and
+ * checked without walking the free list.  No two free blocks are adjacent.
+ */
+#define BLOCK_FREE       1UL
+#define BLOCK_TAG_SIZE   sizeof(size_t)
+
+/* Whole-page allocation mapped by vmalloc_pages(), kept in its size. */
+#define BLOCK_VMAP       2UL
+
+static inline size_t block_size(const struct xmalloc_hdr *hdr)
+{
+    return hdr->size & ~BLOCK_FREE;
+}
+
+static inline void set_block(struct xmalloc_hdr *hdr, size_t size,
+                             unsigned long free)
+{
+    hdr->size = size | free;
+    *(size_t *)((char *)hdr + size - BLOCK_TAG_SIZE) = size | free;
+}
+
+/* Following block in the same page, or NULL. */
+static inline struct xmalloc_hdr *block_next(struct xmalloc_hdr *hdr)
+{
+    uintptr_t next = (uintptr_t)hdr + block_size(hdr);
+
+    return (next & ~PAGE_MASK) ? (struct xmalloc_hdr *)next : NULL;
+}
+
+/* Preceding block in the same page if it is free, or NULL. */
+static inline struct xmalloc_hdr *block_prev_free(struct xmalloc_hdr *hdr)
+{
+    size_t tag;
+
+    if ( !((uintptr_t)hdr & ~PAGE_MASK) )
+        return NULL;
+    tag = *((size_t *)hdr - 1);
+    if ( !(tag & BLOCK_FREE) )
+        return NULL;
+    return (struct xmalloc_hdr *)((char *)hdr - (tag & ~BLOCK_FREE));
 }
 
+/* Usable bytes of an allocated block whose data starts hdr_size in. */
+static inline size_t block_usable(const struct xmalloc_hdr *hdr,
+                                  size_t hdr_size)
+{
+    if ( hdr->size >= PAGE_SIZE )
+        return (hdr->size & PAGE_MASK) - hdr_size;
+    return hdr->size - hdr_size - BLOCK_TAG_SIZE;
+}
+
+static inline void account_block(const struct xmalloc_hdr *hdr,
+                                 size_t hdr_size, int alloc)
+{
+    size_t usable = block_usable(hdr, hdr_size);
+
+    if ( alloc )
+    {
+        xstats.block_bytes += usable;
+        xstats.block_overhead += (hdr->size & ~BLOCK_VMAP) - usable;
+    }
+    else
+    {
+        xstats.block_bytes -= usable;
+        xstats.block_overhead -= (hdr->size & ~BLOCK_VMAP) - usable;
+    }
+}
+
+static inline void freelist_insert(struct xmalloc_hdr *hdr, size_t size)
+{
+    set_block(hdr, size, BLOCK_FREE);
+    /* spin_lock_irqsave(&freelist_lock, flags); */
+    MINIOS_TAILQ_INSERT_HEAD(&freelist, hdr, freelist);
+    /* spin_unlock_irqrestore(&freelist_lock, flags); */
+}
+
+static inline void freelist_remove(struct xmalloc_hdr *hdr)
+{
+    /* spin_lock_irqsave(&freelist_lock, flags); */
+    MINIOS_TAILQ_REMOVE(&freelist, hdr, freelist);
+    /* spin_unlock_irqrestore(&freelist_lock, flags); */
+}
+
+/* Give hdr size bytes out of block, returning the rest to the free list. */
 static void maybe_split(struct xmalloc_hdr *hdr, size_t size, size_t block)
 {
-    struct xmalloc_hdr *extra;
+    struct xmalloc_hdr *extra, *next;
     size_t leftover;
     size = align_up(size, __alignof__(struct xmalloc_hdr));
     size = align_up(size, __alignof__(struct xmalloc_pad));
@@ -83,24 +458,29 @@ static void maybe_split(struct xmalloc_hdr *hdr, size_t size, size_t block)
     {
         extra = (struct xmalloc_hdr *)((unsigned long)hdr + size);
         extra->size = leftover;
-        /* spin_lock_irqsave(&freelist_lock, flags); */
-        MINIOS_TAILQ_INSERT_HEAD(&freelist, extra, freelist);
-        /* spin_unlock_irqrestore(&freelist_lock, flags); */
+        next = block_next(extra);
+        if ( next && (next->size & BLOCK_FREE) )
+        {
+            freelist_remove(next);
+            leftover += block_size(next);
+        }
+        freelist_insert(extra, leftover);
     }
     else
     {
         size = block;
     }
 
-    hdr->size = size;
+    set_block(hdr, size, 0);
 }
 
-static struct xmalloc_hdr *xmalloc_new_page(size_t size)
+static struct xmalloc_hdr *xmalloc_new_page(size_t size, unsigned long *flags)
 {
     struct xmalloc_hdr *hdr;
-    /* unsigned long flags; */
 
+    xmalloc_unlock_irqrestore(*flags);
     hdr = (struct xmalloc_hdr *)alloc_page();
+    xmalloc_lock_irqsave(*flags);
     if ( hdr == NULL )
         return NULL;
 
@@ -109,12 +489,17 @@ static struct xmalloc_hdr *xmalloc_new_page(size_t size)
     return hdr;
 }
 
-/* Big object?  Just use the page allocator. */
-static void *xmalloc_whole_pages(size_t size, size_t align)
+/*
+ * Big object?  Just use the page allocator, or map single pages contiguously
+ * if memory is too fragmented for the order needed.
+ */
+static void *xmalloc_whole_pages(size_t size, size_t align,
+                                 unsigned long *flags)
 {
     struct xmalloc_hdr *hdr;
     struct xmalloc_pad *pad;
     unsigned int pageorder;
+    unsigned long nr_pages;
     void *ret;
     /* Room for headers */
     size_t hdr_size = sizeof(struct xmalloc_hdr) + sizeof(struct xmalloc_pad);
@@ -123,24 +508,45 @@ static void *xmalloc_whole_pages(size_t size, size_t align)
 
     pageorder = get_order(hdr_size + size);
 
+    xmalloc_unlock_irqrestore(*flags);
     hdr = (struct xmalloc_hdr *)alloc_pages(pageorder);
+    if ( hdr != NULL )
+        hdr->size = (1UL << (pageorder + PAGE_SHIFT));
+    else if ( align <= PAGE_SIZE )
+    {
+        /* Only buddy chunks are aligned beyond a page. */
+        nr_pages = (hdr_size + size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        hdr = vmalloc_pages(nr_pages);
+        if ( hdr != NULL )
+            hdr->size = (nr_pages << PAGE_SHIFT) | BLOCK_VMAP;
+    }
+    xmalloc_lock_irqsave(*flags);
     if ( hdr == NULL )
         return NULL;
 
-    hdr->size = (1UL << (pageorder + PAGE_SHIFT));
-
     ret = (char*)hdr + hdr_size;
     pad = (struct xmalloc_pad *) ret - 1;
     pad->hdr_size = hdr_size;
+    account_block(hdr, hdr_size, 1);
     return ret;
 }
 
-void *_xmalloc(size_t size, size_t align)
+static void *__xmalloc(size_t size, size_t align, unsigned long *flags)
 {
     struct xmalloc_hdr *i, *tmp, *hdr = NULL;
     uintptr_t data_begin;
     size_t hdr_size;
-    /* unsigned long flags; */
+    size_t obj_size;
+
+    /* Small objects come from the size class slabs. */
+    obj_size = size > align ? size : align;
+    if ( obj_size <= SLAB_MAX_SIZE )
+    {
+        if ( !size_caches_ready )
+            init_size_caches();
+        return slab_alloc(&size_caches[size_class(obj_size ? obj_size : 1)],
+                          flags);
+    }
 
     hdr_size = sizeof(struct xmalloc_hdr) + sizeof(struct xmalloc_pad);
     /* Align on headers requirements. */
@@ -148,8 +554,8 @@ void *_xmalloc(size_t size, size_t align)
     align = align_up(align, __alignof__(struct xmalloc_pad));
 
     /* For big allocs, give them whole pages. */
-    if ( size + align_up(hdr_size, align) >= PAGE_SIZE )
-        return xmalloc_whole_pages(size, align);
+    if ( size + align_up(hdr_size, align) + BLOCK_TAG_SIZE >= PAGE_SIZE )
+        return xmalloc_whole_pages(size, align, flags);
 
     /* Search free list. */
     /* spin_lock_irqsave(&freelist_lock, flags); */
@@ -157,10 +563,11 @@ void *_xmalloc(size_t size, size_t align)
     {
         data_begin = align_up((uintptr_t)i + hdr_size, align);
 
-        if ( data_begin + size > (uintptr_t)i + i->size )
+        if ( data_begin + size + BLOCK_TAG_SIZE >
+             (uintptr_t)i + block_size(i) )
             continue;
 
-        MINIOS_TAILQ_REMOVE(&freelist, i, freelist);
+        freelist_remove(i);
         /* spin_unlock_irqrestore(&freelist_lock, flags); */
 
         uintptr_t size_before = (data_begin - hdr_size) - (uintptr_t)i;
@@ -168,14 +575,12 @@ void *_xmalloc(size_t size, size_t align)
         if (size_before >= 2 * hdr_size) {
             /* Worth splitting the beginning */
             struct xmalloc_hdr *new_i = (void*)(data_begin - hdr_size);
-            new_i->size = i->size - size_before;
-            i->size = size_before;
-            /* spin_lock_irqsave(&freelist_lock, flags); */
-            MINIOS_TAILQ_INSERT_HEAD(&freelist, i, freelist);
-            /* spin_unlock_irqrestore(&freelist_lock, flags); */
+            new_i->size = block_size(i) - size_before;
+            freelist_insert(i, size_before);
             i = new_i;
         }
-        maybe_split(i, (data_begin + size) - (uintptr_t)i, i->size);
+        maybe_split(i, (data_begin + size + BLOCK_TAG_SIZE) - (uintptr_t)i,
+                    block_size(i));
         hdr = i;
         break;
     }
@@ -184,7 +589,8 @@ void *_xmalloc(size_t size, size_t align)
         /* spin_unlock_irqrestore(&freelist_lock, flags); */
 
         /* Alloc a new page and return from that. */
-        hdr = xmalloc_new_page(align_up(hdr_size, align) + size);
+        hdr = xmalloc_new_page(align_up(hdr_size, align) + size +
+                               BLOCK_TAG_SIZE, flags);
         if ( hdr == NULL )
             return NULL;
         data_begin = (uintptr_t)hdr + align_up(hdr_size, align);
@@ -193,25 +599,41 @@ void *_xmalloc(size_t size, size_t align)
     struct xmalloc_pad *pad = (struct xmalloc_pad *) data_begin - 1;
     pad->hdr_size = data_begin - (uintptr_t)hdr;
     BUG_ON(data_begin % align);
+    account_block(hdr, pad->hdr_size, 1);
     return (void*)data_begin;
 }
 
-void xfree(const void *p)
+/* Pages are handed back with the lock dropped. */
+static void __xfree(const void *p, unsigned long *flags)
 {
-    /* unsigned long flags; */
-    struct xmalloc_hdr *i, *tmp, *hdr;
+    struct xmalloc_hdr *i, *hdr;
     struct xmalloc_pad *pad;
+    struct slab_page *page;
+    size_t size;
 
     if ( p == NULL )
         return;
 
+    page = slab_page_of(p);
+    if ( page )
+    {
+        slab_free(page, p, flags);
+        return;
+    }
+
     pad = (struct xmalloc_pad *)p - 1;
     hdr = (struct xmalloc_hdr *)((char *)p - pad->hdr_size);
+    account_block(hdr, pad->hdr_size, 0);
 
     /* Big allocs free directly. */
     if ( hdr->size >= PAGE_SIZE )
     {
-        free_pages(hdr, get_order(hdr->size));
+        xmalloc_unlock_irqrestore(*flags);
+        if ( hdr->size & BLOCK_VMAP )
+            vfree_pages(hdr, hdr->size >> PAGE_SHIFT);
+        else
+            free_pages(hdr, get_order(hdr->size));
+        xmalloc_lock_irqsave(*flags);
         return;
     }
 
@@ -222,49 +644,102 @@ void xfree(const void *p)
         *(int*)0=0;
     }
 
-    /* Merge with other free block, or put in list. */
-    /* spin_lock_irqsave(&freelist_lock, flags); */
-    MINIOS_TAILQ_FOREACH_SAFE(i, &freelist, freelist, tmp)
+    /* Merge with free neighbours, or put in list. */
+    size = hdr->size;
+    i = block_next(hdr);
+    if ( i && (i->size & BLOCK_FREE) )
     {
-        unsigned long _i   = (unsigned long)i;
-        unsigned long _hdr = (unsigned long)hdr;
-
-        /* Do not merge across page boundaries. */
-        if ( ((_i ^ _hdr) & PAGE_MASK) != 0 )
-            continue;
-
-        /* We follow this block?  Swallow it. */
-        if ( (_i + i->size) == _hdr )
-        {
-            MINIOS_TAILQ_REMOVE(&freelist, i, freelist);
-            i->size += hdr->size;
-            hdr = i;
-        }
-
-        /* We precede this block? Swallow it. */
-        if ( (_hdr + hdr->size) == _i )
-        {
-            MINIOS_TAILQ_REMOVE(&freelist, i, freelist);
-            hdr->size += i->size;
-        }
+        freelist_remove(i);
+        size += block_size(i);
+    }
+    i = block_prev_free(hdr);
+    if ( i )
+    {
+        freelist_remove(i);
+        size += block_size(i);
+        hdr = i;
     }
 
     /* Did we merge an entire page? */
-    if ( hdr->size == PAGE_SIZE )
+    if ( size == PAGE_SIZE )
     {
         if((((unsigned long)hdr) & (PAGE_SIZE-1)) != 0)
         {
             printk("Bug\n");
             *(int*)0=0;
         }
+        xmalloc_unlock_irqrestore(*flags);
         free_page(hdr);
+        xmalloc_lock_irqsave(*flags);
     }
     else
     {
-        MINIOS_TAILQ_INSERT_HEAD(&freelist, hdr, freelist);
+        freelist_insert(hdr, size);
     }
+}
 
-    /* spin_unlock_irqrestore(&freelist_lock, flags); */
+void *_xmalloc(size_t size, size_t align)
+{
+    unsigned long flags;
+    void *p;
+
+    xmalloc_lock_irqsave(flags);
+    p = __xmalloc(size, align, &flags);
+    xmalloc_unlock_irqrestore(flags);
+
+    return p;
+}
+
+void xfree(const void *p)
+{
+    unsigned long flags;
+
+    xmalloc_lock_irqsave(flags);
+    __xfree(p, &flags);
+    xmalloc_unlock_irqrestore(flags);
+}
+
+/*
+ * Zeroed blocks this large are mapped to the zero frame and only get real
+ * pages where they are written to.
+ */
+#define ZALLOC_MAP_MIN  (4 * PAGE_SIZE)
+
+void *_xzalloc(size_t size, size_t align)
+{
+    struct xmalloc_hdr *hdr;
+    struct xmalloc_pad *pad;
+    unsigned long nr_pages, flags;
+    size_t hdr_size;
+    void *p;
+
+    if ( size >= ZALLOC_MAP_MIN && align <= PAGE_SIZE )
+    {
+        hdr_size = sizeof(struct xmalloc_hdr) + sizeof(struct xmalloc_pad);
+        align = align_up(align, __alignof__(struct xmalloc_hdr));
+        align = align_up(align, __alignof__(struct xmalloc_pad));
+        hdr_size = align_up(hdr_size, align);
+        nr_pages = (hdr_size + size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+        hdr = vzalloc_pages(nr_pages);
+        if ( hdr != NULL )
+        {
+            hdr->size = (nr_pages << PAGE_SHIFT) | BLOCK_VMAP;
+            p = (char *)hdr + hdr_size;
+            pad = (struct xmalloc_pad *)p - 1;
+            pad->hdr_size = hdr_size;
+            xmalloc_lock_irqsave(flags);
+            account_block(hdr, hdr_size, 1);
+            xmalloc_unlock_irqrestore(flags);
+            return p;
+        }
+    }
+
+    p = _xmalloc(size, align);
+    if ( p != NULL )
+        memset(p, 0, size);
+
+    return p;
 }
 
 void *malloc(size_t size)
@@ -272,32 +747,87 @@ void *malloc(size_t size)
     return _xmalloc(size, DEFAULT_ALIGN);
 }
 
-void *realloc(void *ptr, size_t size)
+void *calloc(size_t nmemb, size_t size)
+{
+    if ( size && nmemb > UINT_MAX / size )
+        return NULL;
+
+    return _xzalloc(nmemb * size, DEFAULT_ALIGN);
+}
+
+static void *__realloc(void *ptr, size_t size, unsigned long *flags)
 {
     void *new;
-    struct xmalloc_hdr *hdr;
+    struct xmalloc_hdr *hdr, *next;
     struct xmalloc_pad *pad;
-    size_t old_data_size;
+    struct slab_page *page;
+    size_t old_data_size, need;
 
     if (ptr == NULL)
-        return _xmalloc(size, DEFAULT_ALIGN);
+        return __xmalloc(size, DEFAULT_ALIGN, flags);
+
+    page = slab_page_of(ptr);
+    if ( page )
+    {
+        old_data_size = page->cache->size;
+        if ( old_data_size >= size )
+            return ptr;
+        goto move;
+    }
 
     pad = (struct xmalloc_pad *)ptr - 1;
     hdr = (struct xmalloc_hdr *)((char*)ptr - pad->hdr_size);
 
-    old_data_size = hdr->size - pad->hdr_size;
+    /* Whole-page allocations are returned to the page allocator by order,
+     * so they are never split or grown in place. */
+    old_data_size = block_usable(hdr, pad->hdr_size);
+    if ( hdr->size >= PAGE_SIZE )
+    {
+        if ( old_data_size >= size )
+            return ptr;
+        goto move;
+    }
+
+    need = pad->hdr_size + size + BLOCK_TAG_SIZE;
     if ( old_data_size >= size )
     {
-	maybe_split(hdr, pad->hdr_size + size, hdr->size);
+        account_block(hdr, pad->hdr_size, 0);
+        maybe_split(hdr, need, hdr->size);
+        account_block(hdr, pad->hdr_size, 1);
+        return ptr;
+    }
+
+    /* Grow in place by absorbing a free successor. */
+    next = block_next(hdr);
+    if ( next && (next->size & BLOCK_FREE) &&
+         hdr->size + block_size(next) >= need )
+    {
+        account_block(hdr, pad->hdr_size, 0);
+        freelist_remove(next);
+        maybe_split(hdr, need, hdr->size + block_size(next));
+        account_block(hdr, pad->hdr_size, 1);
         return ptr;
     }
-    
-    new = _xmalloc(size, DEFAULT_ALIGN);
+
+ move:
+    new = __xmalloc(size, DEFAULT_ALIGN, flags);
     if (new == NULL) 
         return NULL;
 
     memcpy(new, ptr, old_data_size);
-    xfree(ptr);
+    __xfree(ptr, flags);
+
+    return new;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    unsigned long flags;
+    void *new;
+
+    xmalloc_lock_irqsave(flags);
+    new = __realloc(ptr, size, &flags);
+    xmalloc_unlock_irqrestore(flags);
 
     return new;
 }
@@ -308,6 +838,36 @@ void free(void *ptr)
 }
 #endif
 
+void get_xmalloc_stats(struct xmalloc_stats *stats)
+{
+#ifndef HAVE_LIBC
+    struct xmalloc_hdr *i;
+#endif
+
+    *stats = xstats;
+#ifndef HAVE_LIBC
+    MINIOS_TAILQ_FOREACH(i, &freelist, freelist)
+    {
+        stats->freelist_len++;
+        stats->freelist_bytes += block_size(i);
+    }
+#endif
+}
+
+void print_xmalloc_stats(void)
+{
+    struct xmalloc_stats stats;
+
+    get_xmalloc_stats(&stats);
+    printk("xmalloc: slabs %lu pages, %lu bytes in use, %lu bytes unused\n",
+           stats.slab_pages, stats.slab_bytes,
+           stats.slab_pages * PAGE_SIZE - stats.slab_bytes);
+    printk("xmalloc: blocks %lu bytes in use, %lu bytes of overhead\n",
+           stats.block_bytes, stats.block_overhead);
+    printk("xmalloc: free list %lu blocks, %lu bytes\n",
+           stats.freelist_len, stats.freelist_bytes);
+}
+
 /*
  * Local variables:
  * mode: C
@@ -236,12 +236,15 @@ static struct thread *lwip_thread;
 sys_thread_t sys_thread_new(char *name, void (* thread)(void *arg), void *arg, int stacksize, int prio)
 {
     struct thread *t;
-    if (stacksize > STACK_SIZE) {
-        printk("Can't start lwIP thread: stack size %d is too large for our %lu\n",
-                stacksize, (unsigned long) STACK_SIZE);
+    /* This is the tcpip thread, which all network I/O goes through. */
+    t = create_thread_ex(name, thread, arg, stacksize > 0 ? stacksize : STACK_SIZE,
+                         SCHED_PRIO_DEFAULT + 1);
+    if (!t) {
+        printk("Can't start lwIP thread: no memory for a %d byte stack\n",
+                stacksize);
         do_exit();
     }
-    lwip_thread = t = create_thread(name, thread, arg);
+    lwip_thread = t;
     return t;
 }
 
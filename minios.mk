@@ -17,6 +17,7 @@ DEF_LDFLAGS +=
 ifeq ($(debug),y)
 DEF_CFLAGS += -g
 #DEF_CFLAGS += -DMM_DEBUG
+#DEF_CFLAGS += -DMM_LAT_STATS
 #DEF_CFLAGS += -DFS_DEBUG
 #DEF_CFLAGS += -DLIBC_DEBUG
 #DEF_CFLAGS += -DGNT_DEBUG
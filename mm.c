@@ -43,7 +43,11 @@
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
 #include <mini-os/xmalloc.h>
+#include <mini-os/preempt.h>
 #include <mini-os/e820.h>
+#include <mini-os/time.h>
+#include <mini-os/sched.h>
+#include <mini-os/spinlock.h>
 
 /*********************
  * ALLOCATION BITMAP
@@ -61,6 +65,20 @@ unsigned long mm_alloc_bitmap_size;
 
 unsigned long nr_free_pages;
 
+/*
+ * Statistics, see get_mm_stats().  Allocation latencies are only measured
+ * when built with MM_LAT_STATS, as reading the clock is not free.
+ */
+#ifdef CONFIG_SMP
+#define stat_inc(s)     __sync_fetch_and_add(&(s), 1)
+#else
+#define stat_inc(s)     ((s)++)
+#endif
+static unsigned long nr_allocs[MM_NR_ORDERS];
+static unsigned long nr_frees[MM_NR_ORDERS];
+static unsigned long nr_failed[MM_NR_ORDERS];
+static unsigned long alloc_latency[MM_LAT_BUCKETS];
+
 /*
  * Hint regarding bitwise arithmetic in map_{alloc,free}:
  *  -(1<<n)  sets all bits >= n. 
@@ -137,11 +155,42 @@ struct chunk_tail_st {
 };
 
 /* Linked lists of free chunks of different powers-of-two in size. */
-#define FREELIST_SIZE ((sizeof(void*)<<3)-PAGE_SHIFT)
+#define FREELIST_SIZE MM_NR_ORDERS
 static chunk_head_t *free_head[FREELIST_SIZE];
 static chunk_head_t  free_tail[FREELIST_SIZE];
 #define FREELIST_EMPTY(_l) ((_l)->next == NULL)
 
+/*
+ * Summary of the free lists: bit n is set iff free_head[n] is not empty.
+ * FREELIST_SIZE is always less than the number of bits in a long.
+ */
+static unsigned long free_orders;
+
+/* Protects the above and the bitmap; callbacks take pages too. */
+static DEFINE_SPINLOCK(heap_lock);
+
+static inline void freelist_add(chunk_head_t *ch, int order)
+{
+    chunk_tail_t *ct;
+
+    ct = (chunk_tail_t *)((char *)ch + (1UL << (order + PAGE_SHIFT))) - 1;
+    ch->level       = order;
+    ch->next        = free_head[order];
+    ch->pprev       = &free_head[order];
+    ch->next->pprev = &ch->next;
+    free_head[order] = ch;
+    ct->level       = order;
+    free_orders |= 1UL << order;
+}
+
+static inline void freelist_del(chunk_head_t *ch, int order)
+{
+    *(ch->pprev) = ch->next;
+    ch->next->pprev = ch->pprev;
+    if ( FREELIST_EMPTY(free_head[order]) )
+        free_orders &= ~(1UL << order);
+}
+
 /*
  * Initialise allocator, placing addresses [@min,@max] in free pool.
  * @min and @max are PHYSICAL addresses.
@@ -152,7 +201,6 @@ static void init_page_allocator(unsigned long min, unsigned long max)
     unsigned long range;
     unsigned long r_min, r_max;
     chunk_head_t *ch;
-    chunk_tail_t *ct;
 
     printk("MM: Initialise page allocator for %lx(%lx)-%lx(%lx)\n",
            (u_long)to_virt(min), min, (u_long)to_virt(max), max);
@@ -162,6 +210,7 @@ static void init_page_allocator(unsigned long min, unsigned long max)
         free_tail[i].pprev = &free_head[i];
         free_tail[i].next  = NULL;
     }
+    free_orders = 0;
 
     min = round_pgup  (min);
     max = round_pgdown(max);
@@ -190,6 +239,12 @@ static void init_page_allocator(unsigned long min, unsigned long max)
             r_min = min;
         if ( r_max > max )
             r_max = max;
+#ifdef CONFIG_DEFERRED_MEM
+        if ( r_max > PFN_PHYS(deferred_pfn) )
+            r_max = PFN_PHYS(deferred_pfn);
+        if ( r_min >= r_max )
+            continue;
+#endif
 
         printk("    Adding memory range %lx-%lx\n", r_min, r_max);
 
@@ -213,14 +268,7 @@ static void init_page_allocator(unsigned long min, unsigned long max)
             ch = (chunk_head_t *)r_min;
             r_min += 1UL << i;
             range -= 1UL << i;
-            ct = (chunk_tail_t *)r_min - 1;
-            i -= PAGE_SHIFT;
-            ch->level       = i;
-            ch->next        = free_head[i];
-            ch->pprev       = &free_head[i];
-            ch->next->pprev = &ch->next;
-            free_head[i]    = ch;
-            ct->level       = i;
+            freelist_add(ch, i - PAGE_SHIFT);
         }
     }
 
@@ -228,28 +276,30 @@ static void init_page_allocator(unsigned long min, unsigned long max)
 }
 
 
-/* Allocate 2^@order contiguous pages. Returns a VIRTUAL address. */
-unsigned long alloc_pages(int order)
+static unsigned long alloc_chunk(int order)
 {
     int i;
+    unsigned long avail;
     chunk_head_t *alloc_ch, *spare_ch;
-    chunk_tail_t            *spare_ct;
 
-    if ( !chk_free_pages(1UL << order) )
-        goto no_memory;
+    /* Single pages are the common case: no need to search or split. */
+    if ( order == 0 && !FREELIST_EMPTY(free_head[0]) )
+    {
+        alloc_ch = free_head[0];
+        freelist_del(alloc_ch, 0);
+        map_alloc(PHYS_PFN(to_phys(alloc_ch)), 1);
+        return (unsigned long)alloc_ch;
+    }
 
     /* Find smallest order which can satisfy the request. */
-    for ( i = order; i < FREELIST_SIZE; i++ ) {
-	if ( !FREELIST_EMPTY(free_head[i]) ) 
-	    break;
-    }
+    avail = order < FREELIST_SIZE ? free_orders & -(1UL << order) : 0;
+    if ( !avail )
+        return 0;
+    i = __ffs(avail);
 
-    if ( i == FREELIST_SIZE ) goto no_memory;
- 
     /* Unlink a chunk. */
     alloc_ch = free_head[i];
-    free_head[i] = alloc_ch->next;
-    alloc_ch->next->pprev = alloc_ch->pprev;
+    freelist_del(alloc_ch, i);
 
     /* We may have to break the chunk a number of times. */
     while ( i != order )
@@ -257,42 +307,51 @@ unsigned long alloc_pages(int order)
         /* Split into two equal parts. */
         i--;
         spare_ch = (chunk_head_t *)((char *)alloc_ch + (1UL<<(i+PAGE_SHIFT)));
-        spare_ct = (chunk_tail_t *)((char *)spare_ch + (1UL<<(i+PAGE_SHIFT)))-1;
-
-        /* Create new header for spare chunk. */
-        spare_ch->level = i;
-        spare_ch->next  = free_head[i];
-        spare_ch->pprev = &free_head[i];
-        spare_ct->level = i;
 
-        /* Link in the spare chunk. */
-        spare_ch->next->pprev = &spare_ch->next;
-        free_head[i] = spare_ch;
+        /* Create new header for spare chunk and link it in. */
+        freelist_add(spare_ch, i);
     }
     
     map_alloc(PHYS_PFN(to_phys(alloc_ch)), 1UL<<order);
 
     return((unsigned long)alloc_ch);
+}
+
+/*
+ * Take 2^@order contiguous pages off the buddy lists, 0 on failure.  No
+ * ballooning is attempted.
+ */
+unsigned long __alloc_pages(int order)
+{
+    unsigned long page, flags;
 
- no_memory:
+    spin_lock_irqsave(&heap_lock, flags);
+    page = alloc_chunk(order);
+    spin_unlock_irqrestore(&heap_lock, flags);
 
-    printk("Cannot handle page request order %d!\n", order);
+    return page;
+}
 
-    return 0;
+static unsigned long buddy_alloc(int order)
+{
+    if ( !chk_free_pages(1UL << order) )
+        return 0;
+
+    return __alloc_pages(order);
 }
 
-void free_pages(void *pointer, int order)
+void __free_pages(void *pointer, int order)
 {
     chunk_head_t *freed_ch, *to_merge_ch;
-    chunk_tail_t *freed_ct;
-    unsigned long mask;
+    unsigned long mask, flags;
     
+    spin_lock_irqsave(&heap_lock, flags);
+
     /* First free the chunk */
     map_free(virt_to_pfn(pointer), 1UL << order);
     
     /* Create free chunk */
     freed_ch = (chunk_head_t *)pointer;
-    freed_ct = (chunk_tail_t *)((char *)pointer + (1UL<<(order + PAGE_SHIFT)))-1;
     
     /* Now, possibly we can conseal chunks together */
     while(order < FREELIST_SIZE)
@@ -314,27 +373,468 @@ void free_pages(void *pointer, int order)
             if(allocated_in_map(virt_to_pfn(to_merge_ch)) ||
                     to_merge_ch->level != order)
                 break;
-            
-            /* Merge with successor */
-            freed_ct = (chunk_tail_t *)((char *)to_merge_ch + mask) - 1;
         }
         
         /* We are commited to merging, unlink the chunk */
-        *(to_merge_ch->pprev) = to_merge_ch->next;
-        to_merge_ch->next->pprev = to_merge_ch->pprev;
+        freelist_del(to_merge_ch, order);
         
         order++;
     }
 
     /* Link the new chunk */
-    freed_ch->level = order;
-    freed_ch->next  = free_head[order];
-    freed_ch->pprev = &free_head[order];
-    freed_ct->level = order;
-    
-    freed_ch->next->pprev = &freed_ch->next;
-    free_head[order] = freed_ch;   
-   
+    freelist_add(freed_ch, order);
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+
+
+/*************************
+ * PAGE MAGAZINES
+ *  Each thread, and the event callback, keeps a small stack of order-0
+ *  pages.  It is refilled from the buddy lists with one chunk of
+ *  PAGE_MAG_BATCH pages and drained PAGE_MAG_BATCH pages at a time, so
+ *  single page alloc/free pairs rarely touch the buddy lists or the bitmap.
+ *  Pages held in a magazine are accounted as allocated.  The owner uses its
+ *  magazine with preemption disabled, so that a shrinker in sched.c can
+ *  empty the magazines of threads that are switched out.
+ */
+
+#define PAGE_MAG_BATCH_ORDER 3
+#define PAGE_MAG_BATCH       (1U << PAGE_MAG_BATCH_ORDER)
+
+static int page_magazine_refill(struct page_magazine *mag)
+{
+    unsigned long chunk;
+    unsigned int i;
+
+    chunk = buddy_alloc(PAGE_MAG_BATCH_ORDER);
+    if ( chunk )
+    {
+        for ( i = 0; i < PAGE_MAG_BATCH; i++ )
+            mag->pages[mag->nr++] = chunk + ((unsigned long)i << PAGE_SHIFT);
+        return 1;
+    }
+
+    /* Too fragmented for a whole batch, settle for a single page. */
+    chunk = buddy_alloc(0);
+    if ( !chunk )
+        return 0;
+    mag->pages[mag->nr++] = chunk;
+
+    return 1;
+}
+
+/* Return the n least recently freed pages to the buddy lists. */
+static void page_magazine_drain(struct page_magazine *mag, unsigned int n)
+{
+    unsigned int i;
+
+    if ( n > mag->nr )
+        n = mag->nr;
+    for ( i = 0; i < n; i++ )
+        __free_pages((void *)mag->pages[i], 0);
+    mag->nr -= n;
+    for ( i = 0; i < mag->nr; i++ )
+        mag->pages[i] = mag->pages[i + n];
+}
+
+void page_magazine_flush(struct page_magazine *mag)
+{
+    page_magazine_drain(mag, mag->nr);
+}
+
+#ifdef MM_LAT_STATS
+#define alloc_start()   NOW()
+static void account_alloc(int order, s_time_t start)
+{
+    s_time_t delta = NOW() - start;
+    unsigned int b;
+
+    for ( b = 0; b < MM_LAT_BUCKETS - 1; b++ )
+        if ( delta < (1LL << (b + MM_LAT_SHIFT)) )
+            break;
+    stat_inc(alloc_latency[b]);
+    stat_inc(nr_allocs[order]);
+}
+#else
+#define alloc_start()   0
+#define account_alloc(order, start) ((void)(start), stat_inc(nr_allocs[order]))
+#endif
+
+/*************************
+ * SHRINKERS
+ */
+
+static MINIOS_TAILQ_HEAD(, struct shrinker) shrinkers =
+    MINIOS_TAILQ_HEAD_INITIALIZER(shrinkers);
+
+void register_shrinker(struct shrinker *shrinker)
+{
+    struct shrinker *s;
+
+    MINIOS_TAILQ_FOREACH(s, &shrinkers, list)
+    {
+        if ( s->priority > shrinker->priority )
+        {
+            MINIOS_TAILQ_INSERT_BEFORE(s, shrinker, list);
+            return;
+        }
+    }
+    MINIOS_TAILQ_INSERT_TAIL(&shrinkers, shrinker, list);
+}
+
+void unregister_shrinker(struct shrinker *shrinker)
+{
+    MINIOS_TAILQ_REMOVE(&shrinkers, shrinker, list);
+}
+
+unsigned long shrink_memory(unsigned long nr_pages)
+{
+    static DEFINE_SPINLOCK(shrink_lock);
+    struct shrinker *s;
+    struct page_magazine *mag;
+    unsigned long freed = 0;
+
+    /* Shrinkers may allocate, and one caller at a time is enough. */
+    if ( in_callback || !spin_trylock(&shrink_lock) )
+        return 0;
+
+    MINIOS_TAILQ_FOREACH(s, &shrinkers, list)
+    {
+        freed += s->shrink(nr_pages - freed);
+        if ( freed >= nr_pages )
+            break;
+    }
+    spin_unlock(&shrink_lock);
+
+    /* Pages freed into our magazine are invisible to the buddy lists. */
+    preempt_disable();
+    mag = current_page_magazine();
+    if ( freed && mag )
+        page_magazine_flush(mag);
+    preempt_enable();
+
+    return freed;
+}
+
+/* Allocate 2^@order contiguous pages. Returns a VIRTUAL address. */
+unsigned long alloc_pages(int order)
+{
+    struct page_magazine *mag;
+    unsigned long page;
+    s_time_t start = alloc_start();
+    int shrunk = 0;
+
+ retry:
+    preempt_disable();
+    mag = current_page_magazine();
+    if ( order == 0 && mag )
+    {
+        page = 0;
+        if ( mag->nr || page_magazine_refill(mag) )
+            page = mag->pages[--mag->nr];
+    }
+    else
+    {
+        page = buddy_alloc(order);
+
+        /* Pages sitting in our magazine may complete a free chunk. */
+        if ( !page && mag && mag->nr )
+        {
+            page_magazine_flush(mag);
+            page = buddy_alloc(order);
+        }
+    }
+    preempt_enable();
+    if ( page )
+        goto out;
+
+    /* Memory not set up yet comes first, then what caches can give back. */
+    if ( deferred_mem_init(1UL << order) )
+        goto retry;
+    if ( !shrunk && shrink_memory(1UL << order) )
+    {
+        shrunk = 1;
+        goto retry;
+    }
+
+    if ( order < MM_NR_ORDERS )
+        stat_inc(nr_failed[order]);
+    printk("Cannot handle page request order %d!\n", order);
+
+    return 0;
+
+ out:
+    account_alloc(order, start);
+    return page;
+}
+
+void free_pages(void *pointer, int order)
+{
+    struct page_magazine *mag;
+
+    if ( order < MM_NR_ORDERS )
+        stat_inc(nr_frees[order]);
+    preempt_disable();
+    mag = current_page_magazine();
+    if ( order == 0 && mag )
+    {
+        if ( mag->nr == PAGE_MAG_SIZE )
+            page_magazine_drain(mag, PAGE_MAG_BATCH);
+        mag->pages[mag->nr++] = (unsigned long)pointer;
+        preempt_enable();
+        return;
+    }
+    preempt_enable();
+
+    __free_pages(pointer, order);
+}
+
+/*************************
+ * PRE-ZEROED PAGES
+ *  The idle thread clears free pages ahead of time so alloc_zeroed_page()
+ *  does not have to.  Pool pages are linked through their first word,
+ *  which is cleared again when they are handed out.
+ */
+
+#define ZERO_POOL_PAGES   64
+#define ZERO_POOL_BATCH   8
+/* Leave the pool empty rather than eat into the last free pages. */
+#define ZERO_POOL_MIN_FREE (4 * ZERO_POOL_PAGES)
+
+static unsigned long *zero_pool;
+static unsigned int zero_pool_nr;
+static DEFINE_SPINLOCK(zero_pool_lock);
+
+static unsigned long shrink_zero_pool(unsigned long nr_pages)
+{
+    unsigned long flags, *page, freed = 0;
+
+    while ( freed < nr_pages )
+    {
+        spin_lock_irqsave(&zero_pool_lock, flags);
+        page = zero_pool;
+        if ( page )
+        {
+            zero_pool = (unsigned long *)*page;
+            zero_pool_nr--;
+        }
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+        if ( !page )
+            break;
+        free_page(page);
+        freed++;
+    }
+
+    return freed;
+}
+
+static struct shrinker zero_pool_shrinker = {
+    .shrink = shrink_zero_pool,
+    .priority = 0,
+};
+
+/*
+ * Called by the idle thread: clear up to ZERO_POOL_BATCH pages into the
+ * pool.  Returns 0 once there is nothing left to do.
+ */
+int refill_zero_pool(void)
+{
+    unsigned long flags, *page;
+    unsigned int i;
+
+    for ( i = 0; i < ZERO_POOL_BATCH; i++ )
+    {
+        if ( zero_pool_nr >= ZERO_POOL_PAGES ||
+             nr_free_pages < ZERO_POOL_MIN_FREE )
+            return 0;
+        page = (unsigned long *)alloc_page();
+        if ( !page )
+            return 0;
+        memset(page, 0, PAGE_SIZE);
+        spin_lock_irqsave(&zero_pool_lock, flags);
+        *page = (unsigned long)zero_pool;
+        zero_pool = page;
+        zero_pool_nr++;
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+    }
+
+    return 1;
+}
+
+/* Allocate 2^@order pages cleared to zero. */
+unsigned long alloc_zeroed_pages(int order)
+{
+    unsigned long flags, *page = NULL;
+
+    if ( order == 0 )
+    {
+        spin_lock_irqsave(&zero_pool_lock, flags);
+        page = zero_pool;
+        if ( page )
+        {
+            zero_pool = (unsigned long *)*page;
+            zero_pool_nr--;
+        }
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+
+        /* Running low, have the idle thread top the pool up. */
+        if ( zero_pool_nr < ZERO_POOL_PAGES / 2 && idle_thread )
+            wake(idle_thread);
+
+        if ( page )
+        {
+            *page = 0;
+            return (unsigned long)page;
+        }
+    }
+
+    page = (unsigned long *)alloc_pages(order);
+    if ( page )
+        memset(page, 0, PAGE_SIZE << order);
+
+    return (unsigned long)page;
+}
+
+/*
+ * Virtually contiguous allocations: order-0 pages mapped back to back in
+ * the demand map area, for large buffers that need not be physically
+ * contiguous.  Mappings of the zero frame are left alone on free.
+ */
+#define VMAP_BATCH 64
+
+void vfree_pages(void *va, unsigned long n)
+{
+    unsigned long mfns[VMAP_BATCH];
+    unsigned long addr = (unsigned long)va;
+    unsigned long i, todo;
+
+    while ( n )
+    {
+        todo = n < VMAP_BATCH ? n : VMAP_BATCH;
+        for ( i = 0; i < todo; i++ )
+            mfns[i] = virtual_to_mfn(addr + i * PAGE_SIZE);
+        unmap_frames(addr, todo);
+        for ( i = 0; i < todo; i++ )
+            if ( mfns[i] != mfn_zero )
+                free_page(mfn_to_virt(mfns[i]));
+        addr += todo * PAGE_SIZE;
+        n -= todo;
+    }
+}
+
+void *vmalloc_pages(unsigned long n)
+{
+    unsigned long mfns[VMAP_BATCH];
+    unsigned long va, page, done, i, todo;
+
+    va = allocate_ondemand(n, 1);
+    if ( !va )
+        return NULL;
+
+    for ( done = 0; done < n; done += todo )
+    {
+        todo = n - done < VMAP_BATCH ? n - done : VMAP_BATCH;
+        for ( i = 0; i < todo; i++ )
+        {
+            page = alloc_page();
+            if ( !page )
+                goto fail;
+            mfns[i] = virt_to_mfn(page);
+        }
+        if ( do_map_frames(va + done * PAGE_SIZE, mfns, todo, 1, 0,
+                           DOMID_SELF, NULL, L1_PROT) )
+        {
+            /* Part of the batch may be mapped, this skips the rest. */
+            unmap_frames(va + done * PAGE_SIZE, todo);
+            for ( i = 0; i < todo; i++ )
+                free_page(mfn_to_virt(mfns[i]));
+            vfree_pages((void *)va, done);
+            done += todo;
+            free_ondemand(va + done * PAGE_SIZE, n - done);
+            return NULL;
+        }
+    }
+
+    return (void *)va;
+
+ fail:
+    while ( i-- )
+        free_page(mfn_to_virt(mfns[i]));
+    vfree_pages((void *)va, done);
+    free_ondemand(va + done * PAGE_SIZE, n - done);
+    return NULL;
+}
+
+/*
+ * n pages reading as zero, backed by the zero frame until first written
+ * to.  Freed with vfree_pages().
+ */
+void *vzalloc_pages(unsigned long n)
+{
+    return map_zero(n, 1);
+}
+
+void get_mm_stats(struct mm_stats *stats)
+{
+    chunk_head_t *ch;
+    unsigned long flags;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    /* Merging chunks in __free_pages() unlinks them under us otherwise. */
+    spin_lock_irqsave(&heap_lock, flags);
+    stats->free_pages = nr_free_pages;
+    for ( i = 0; i < MM_NR_ORDERS; i++ )
+        for ( ch = free_head[i]; !FREELIST_EMPTY(ch); ch = ch->next )
+            stats->free_chunks[i]++;
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    stats->largest_free_order = -1;
+    for ( i = 0; i < MM_NR_ORDERS; i++ )
+    {
+        if ( stats->free_chunks[i] )
+            stats->largest_free_order = i;
+        stats->allocs[i] = nr_allocs[i];
+        stats->frees[i] = nr_frees[i];
+        stats->failed[i] = nr_failed[i];
+    }
+    for ( i = 0; i < MM_LAT_BUCKETS; i++ )
+        stats->alloc_latency[i] = alloc_latency[i];
+}
+
+void print_mm_stats(void)
+{
+    static struct mm_stats stats;
+    int i;
+
+    get_mm_stats(&stats);
+    printk("MM: %lu free pages, largest free chunk order %d\n",
+           stats.free_pages, stats.largest_free_order);
+    printk("  order  free chunks       allocs        frees   failed\n");
+    for ( i = 0; i < MM_NR_ORDERS; i++ )
+    {
+        if ( !stats.free_chunks[i] && !stats.allocs[i] && !stats.frees[i] &&
+             !stats.failed[i] )
+            continue;
+        printk("  %5d  %11lu  %11lu  %11lu  %7lu\n", i, stats.free_chunks[i],
+               stats.allocs[i], stats.frees[i], stats.failed[i]);
+    }
+#ifdef MM_LAT_STATS
+    printk("  alloc latency:\n");
+    for ( i = 0; i < MM_LAT_BUCKETS; i++ )
+    {
+        if ( !stats.alloc_latency[i] )
+            continue;
+        if ( i < MM_LAT_BUCKETS - 1 )
+            printk("    < %8lu ns: %lu\n", 1UL << (i + MM_LAT_SHIFT),
+                   stats.alloc_latency[i]);
+        else
+            printk("   >= %8lu ns: %lu\n", 1UL << (i - 1 + MM_LAT_SHIFT),
+                   stats.alloc_latency[i]);
+    }
+#endif
 }
 
 int free_physical_pages(xen_pfn_t *mfns, int n)
@@ -359,6 +859,30 @@ void *sbrk(ptrdiff_t increment)
     unsigned long old_brk = brk;
     unsigned long new_brk = old_brk + increment;
 
+    if (increment < 0) {
+        unsigned long n;
+
+        if (new_brk < heap || new_brk > old_brk) {
+            printk("Heap underflow: %lx - %lx < %lx\n",
+                   old_brk, (unsigned long) -increment, heap);
+            return NULL;
+        }
+
+        /*
+         * malloc_trim() and free() give back the top of the heap: return the
+         * whole pages above the new break to the page allocator.  Pages that
+         * were never written to are still backed by mfn_zero and only need
+         * unmapping.
+         */
+        n = (heap_mapped - round_pgup(new_brk)) >> PAGE_SHIFT;
+        if (n) {
+            heap_mapped -= n * PAGE_SIZE;
+            vfree_pages((void *) heap_mapped, n);
+        }
+        brk = new_brk;
+        return (void *) old_brk;
+    }
+
     if (new_brk > heap_end) {
 	printk("Heap exhausted: %lx + %lx = %p > %p\n",
 			old_brk,
@@ -371,7 +895,8 @@ void *sbrk(ptrdiff_t increment)
     if (new_brk > heap_mapped) {
         unsigned long n = (new_brk - heap_mapped + PAGE_SIZE - 1) / PAGE_SIZE;
 
-        if ( !chk_free_pages(n) )
+        /* Have caches give memory back before failing. */
+        if ( !chk_free_pages(n) && !(shrink_memory(n) && chk_free_pages(n)) )
         {
             printk("Memory exhausted: want %ld pages, but only %ld are left\n",
                    n, nr_free_pages);
@@ -389,6 +914,72 @@ void *sbrk(ptrdiff_t increment)
 
 
 
+#ifdef CONFIG_DEFERRED_MEM
+/*
+ * Memory above deferred_pfn is added by the idle thread DEFERRED_MEM_BATCH
+ * pages at a time, or right away when an allocation would fail otherwise.
+ */
+unsigned long deferred_pfn;
+static unsigned long deferred_max_pfn;
+static DEFINE_SPINLOCK(deferred_lock);
+
+/* Add at least nr_pages deferred pages if there are any, returns how many. */
+unsigned long deferred_mem_init(unsigned long nr_pages)
+{
+    unsigned long end, r_min, r_max, added = 0;
+    int m, order;
+
+    /* Mapping may need page table pages, which come back here. */
+    if ( !spin_trylock(&deferred_lock) )
+        return 0;
+
+    while ( added < nr_pages && deferred_pfn < deferred_max_pfn )
+    {
+        end = deferred_pfn + DEFERRED_MEM_BATCH;
+        if ( end > deferred_max_pfn )
+            end = deferred_max_pfn;
+
+        for ( m = 0; m < e820_entries; m++ )
+        {
+            if ( e820_map[m].type != E820_RAM )
+                continue;
+            r_min = PFN_UP(e820_map[m].addr);
+            r_max = PFN_DOWN(e820_map[m].addr + e820_map[m].size);
+            if ( r_min < deferred_pfn )
+                r_min = deferred_pfn;
+            if ( r_max > end )
+                r_max = end;
+            if ( r_min >= r_max )
+                continue;
+
+            /* Try again later, page tables may be short of memory. */
+            if ( arch_map_deferred(r_min, r_max - r_min) )
+            {
+                deferred_pfn = r_min;
+                goto out;
+            }
+
+            added += r_max - r_min;
+            while ( r_min < r_max )
+            {
+                for ( order = 0; order < FREELIST_SIZE - 1; order++ )
+                    if ( (r_min & (1UL << order)) ||
+                         (2UL << order) > r_max - r_min )
+                        break;
+                __free_pages(pfn_to_virt(r_min), order);
+                r_min += 1UL << order;
+            }
+        }
+
+        deferred_pfn = end;
+    }
+
+ out:
+    spin_unlock(&deferred_lock);
+    return added;
+}
+#endif
+
 void init_mm(void)
 {
 
@@ -398,6 +989,11 @@ void init_mm(void)
 
     get_max_pages();
     arch_init_mm(&start_pfn, &max_pfn);
+#ifdef CONFIG_DEFERRED_MEM
+    if ( !deferred_pfn || deferred_pfn > max_pfn )
+        deferred_pfn = max_pfn;
+    deferred_max_pfn = max_pfn;
+#endif
     /*
      * now we can initialise the page allocator
      */
@@ -408,6 +1004,8 @@ void init_mm(void)
     
     arch_init_demand_mapping_area();
 
+    register_shrinker(&zero_pool_shrinker);
+
 #ifdef CONFIG_BALLOON
     nr_mem_pages = max_pfn;
 #endif
@@ -431,5 +1029,6 @@ void sanity_check(void)
         if (free_head[x]) {
             ASSERT(free_head[x]->pprev == &free_head[x]);
         }
+        ASSERT(!(free_orders & (1UL << x)) == FREELIST_EMPTY(free_head[x]));
     }
 }
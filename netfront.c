@@ -16,6 +16,7 @@
 #include <mini-os/netfront.h>
 #include <mini-os/lib.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/spinlock.h>
 
 DECLARE_WAIT_QUEUE_HEAD(netfront_queue);
 
@@ -38,6 +39,12 @@ struct net_buffer {
 struct netfront_dev {
     domid_t dom;
 
+    /*
+     * The handler may run on another vCPU: covers the rings, the TX
+     * freelist and the buffers.
+     */
+    spinlock_t lock;
+
     unsigned short tx_freelist[NET_TX_RING_SIZE + 1];
     struct semaphore tx_sem;
 
@@ -79,6 +86,12 @@ struct netfront_dev_list {
 
 static struct netfront_dev_list *dev_list = NULL;
 
+static unsigned long netfront_shrink(unsigned long nr_pages);
+static struct shrinker netfront_shrinker = {
+    .shrink = netfront_shrink,
+    .priority = 0,
+};
+
 void init_rx_buffers(struct netfront_dev *dev);
 static struct netfront_dev *_init_netfront(struct netfront_dev *dev,
                                            unsigned char rawmac[6], char **ip);
@@ -232,29 +245,70 @@ void network_tx_buf_gc(struct netfront_dev *dev)
     } while ((cons == prod) && (prod != dev->tx.sring->rsp_prod));
 }
 
+/*
+ * TX buffer pages are kept after first use.  Under memory pressure give
+ * back those that are not in flight; netfront_xmit() reallocates them.
+ * It holds on to the page of the buffer it is filling until it is granted,
+ * so anything with a page and no grant is idle.  A device whose lock is
+ * held is skipped: its holder may be allocating, from netif_rx() say.
+ */
+static unsigned long netfront_shrink(unsigned long nr_pages)
+{
+    struct netfront_dev_list *list;
+    struct netfront_dev *dev;
+    struct net_buffer *buf;
+    unsigned long freed = 0, flags;
+    void *page;
+    int i;
+
+    for (list = dev_list; list != NULL && freed < nr_pages; list = list->next) {
+        dev = list->dev;
+        for (i = 0; i < NET_TX_RING_SIZE && freed < nr_pages; i++) {
+            local_irq_save(flags);
+            if (!_raw_spin_trylock(&dev->lock)) {
+                local_irq_restore(flags);
+                break;
+            }
+            buf = &dev->tx_buffers[i];
+            page = buf->page;
+            if (page && buf->gref == GRANT_INVALID_REF)
+                buf->page = NULL;
+            else
+                page = NULL;
+            spin_unlock_irqrestore(&dev->lock, flags);
+            if (page) {
+                free_page(page);
+                freed++;
+            }
+        }
+    }
+
+    return freed;
+}
+
 void netfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
-    int flags;
+    unsigned long flags;
     struct netfront_dev *dev = data;
 
-    local_irq_save(flags);
+    spin_lock_irqsave(&dev->lock, flags);
 
     network_tx_buf_gc(dev);
     network_rx(dev);
 
-    local_irq_restore(flags);
+    spin_unlock_irqrestore(&dev->lock, flags);
 }
 
 #ifdef HAVE_LIBC
 void netfront_select_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
-    int flags;
+    unsigned long flags;
     struct netfront_dev *dev = data;
     int fd = dev->fd;
 
-    local_irq_save(flags);
+    spin_lock_irqsave(&dev->lock, flags);
     network_tx_buf_gc(dev);
-    local_irq_restore(flags);
+    spin_unlock_irqrestore(&dev->lock, flags);
 
     if (fd != -1)
         files[fd].read = 1;
@@ -351,6 +405,7 @@ struct netfront_dev *init_netfront(char *_nodename,
 
         if (!dev_list) {
             dev_list = ldev;
+            register_shrinker(&netfront_shrinker);
         } else {
             for (list = dev_list; list->next != NULL; list = list->next)
                 ;
@@ -395,10 +450,12 @@ static struct netfront_dev *_init_netfront(struct netfront_dev *dev,
 
     printk("net TX ring size %lu\n", (unsigned long) NET_TX_RING_SIZE);
     printk("net RX ring size %lu\n", (unsigned long) NET_RX_RING_SIZE);
+    spin_lock_init(&dev->lock);
     init_SEMAPHORE(&dev->tx_sem, NET_TX_RING_SIZE);
     for (i = 0; i < NET_TX_RING_SIZE; i++) {
         add_id_to_freelist(i, dev->tx_freelist);
         dev->tx_buffers[i].page = NULL;
+        dev->tx_buffers[i].gref = GRANT_INVALID_REF;
     }
 
     for (i = 0; i < NET_RX_RING_SIZE; i++) {
@@ -415,11 +472,10 @@ static struct netfront_dev *_init_netfront(struct netfront_dev *dev,
     else
 #endif
         evtchn_alloc_unbound(dev->dom, netfront_handler, dev, &dev->evtchn);
+    evtchn_spread(dev->evtchn);
 
-    txs = (struct netif_tx_sring *) alloc_page();
-    rxs = (struct netif_rx_sring *) alloc_page();
-    memset(txs, 0, PAGE_SIZE);
-    memset(rxs, 0, PAGE_SIZE);
+    txs = (struct netif_tx_sring *) alloc_zeroed_page();
+    rxs = (struct netif_rx_sring *) alloc_zeroed_page();
 
     SHARED_RING_INIT(txs);
     SHARED_RING_INIT(rxs);
@@ -591,6 +647,7 @@ void shutdown_netfront(struct netfront_dev *dev)
         if (to_del == dev_list) {
             free(to_del);
 			dev_list = NULL;
+            unregister_shrinker(&netfront_shrinker);
         } else {
             for (list = dev_list; list->next != to_del; list = list->next)
                 ;
@@ -714,35 +771,42 @@ void init_rx_buffers(struct netfront_dev *dev)
 
 void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len)
 {
-    int flags;
+    unsigned long flags;
     struct netif_tx_request *tx;
     RING_IDX i;
     int notify;
     unsigned short id;
     struct net_buffer* buf;
+    grant_ref_t gref;
     void* page;
 
     BUG_ON(len > PAGE_SIZE);
 
     down(&dev->tx_sem);
 
-    local_irq_save(flags);
+    spin_lock_irqsave(&dev->lock, flags);
     id = get_id_from_freelist(dev->tx_freelist);
-    local_irq_restore(flags);
-
     buf = &dev->tx_buffers[id];
     page = buf->page;
-    if (!page)
-	page = buf->page = (char*) alloc_page();
+    /* Keep netfront_shrink() off the page until it is granted. */
+    buf->page = NULL;
+    spin_unlock_irqrestore(&dev->lock, flags);
 
-    i = dev->tx.req_prod_pvt;
-    tx = RING_GET_REQUEST(&dev->tx, i);
+    /* Both may block, so not under the lock. */
+    if (!page)
+	page = (char*) alloc_page();
 
     memcpy(page,data,len);
 
-    buf->gref = 
-        tx->gref = gnttab_grant_access(dev->dom,virt_to_mfn(page),1);
+    gref = gnttab_grant_access(dev->dom,virt_to_mfn(page),1);
 
+    spin_lock_irqsave(&dev->lock, flags);
+    buf->gref = gref;
+    buf->page = page;
+
+    i = dev->tx.req_prod_pvt;
+    tx = RING_GET_REQUEST(&dev->tx, i);
+    tx->gref = gref;
     tx->offset=0;
     tx->size = len;
     tx->flags=0;
@@ -753,11 +817,10 @@ void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len)
 
     RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->tx, notify);
 
-    if(notify) notify_remote_via_evtchn(dev->evtchn);
-
-    local_irq_save(flags);
     network_tx_buf_gc(dev);
-    local_irq_restore(flags);
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if(notify) notify_remote_via_evtchn(dev->evtchn);
 }
 
 #ifdef HAVE_LIBC
@@ -771,14 +834,14 @@ ssize_t netfront_receive(struct netfront_dev *dev, unsigned char *data, size_t l
     dev->data = data;
     dev->len = len;
 
-    local_irq_save(flags);
+    spin_lock_irqsave(&dev->lock, flags);
     network_rx(dev);
     if (!dev->rlen && fd != -1)
         /* No data for us, make select stop returning */
         files[fd].read = 0;
     /* Before re-enabling the interrupts, in case a packet just arrived in the
      * meanwhile. */
-    local_irq_restore(flags);
+    spin_unlock_irqrestore(&dev->lock, flags);
 
     dev->data = NULL;
     dev->len = 0;
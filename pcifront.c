@@ -171,8 +171,7 @@ struct pcifront_dev *init_pcifront(char *_nodename)
 
     evtchn_alloc_unbound(dev->dom, pcifront_handler, dev, &dev->evtchn);
 
-    dev->info = (struct xen_pci_sharedinfo*) alloc_page();
-    memset(dev->info,0,PAGE_SIZE);
+    dev->info = (struct xen_pci_sharedinfo*) alloc_zeroed_page();
 
     dev->info_ref = gnttab_grant_access(dev->dom,virt_to_mfn(dev->info),0);
 
@@ -12,8 +12,8 @@
  * Environment: Xen Minimal OS
  * Description: simple scheduler for Mini-Os
  *
- * The scheduler is non-preemptive (cooperative), and schedules according 
- * to Round Robin algorithm.
+ * The scheduler is non-preemptive (cooperative) unless built with
+ * CONFIG_PREEMPT, and schedules according to Round Robin algorithm.
  *
  ****************************************************************************
  * Permission is hereby granted, free of charge, to any person obtaining a copy
@@ -45,6 +45,10 @@
 #include <mini-os/list.h>
 #include <mini-os/sched.h>
 #include <mini-os/semaphore.h>
+#include <mini-os/errno.h>
+#include <mini-os/timer.h>
+#include <mini-os/preempt.h>
+#include <mini-os/smp.h>
 
 
 #ifdef SCHED_DEBUG
@@ -56,100 +60,838 @@
 
 MINIOS_TAILQ_HEAD(thread_list, struct thread);
 
-struct thread *idle_thread = NULL;
+struct thread *idle_threads[NR_CPUS];
+#ifndef CONFIG_SMP
+struct thread *current_thread = NULL;
+#endif
 static struct thread_list exited_threads = MINIOS_TAILQ_HEAD_INITIALIZER(exited_threads);
 static struct thread_list thread_list = MINIOS_TAILQ_HEAD_INITIALIZER(thread_list);
 static int threads_started;
+static unsigned int nr_threads;
+
+/*
+ * Runnable threads other than the running one wait in FIFO order on the run
+ * queue of their priority.  Threads sleeping with a wakeup_time are kept in
+ * a binary min-heap ordered by it, which has room for every thread.
+ *
+ * With aging enabled, a thread that has been waiting for longer than
+ * sched_aging runs ahead of higher priority threads, so that busy ones
+ * can't starve it.  "sched_aging_ms=" on the command line, 0 disables it.
+ */
+#define SCHED_AGING_MS 20
+struct run_queue {
+    struct thread_list queue[SCHED_PRIO_MAX + 1];
+    unsigned int mask;                  /* Non-empty queues. */
+};
+static struct run_queue run_queues[NR_CPUS];
+static s_time_t sched_aging;
+static struct thread **sleepers;
+static unsigned int nr_sleepers, max_sleepers;
 
 struct thread *main_thread;
 
+#ifdef CONFIG_SMP
+/*
+ * Each vCPU has its own run queues, and threads are queued on those of the
+ * vCPU they last ran on.  One that runs out of threads takes one from
+ * another, unless it is pinned or its context is still being switched out
+ * (on_cpu).  All scheduler state is protected by sched_lock, taken with
+ * interrupts disabled.
+ */
+static spinlock_t sched_lock = SPIN_LOCK_UNLOCKED;
+spinlock_t waitq_lock = SPIN_LOCK_UNLOCKED;
+static unsigned long idle_cpus;         /* Blocked in schedule(). */
+static struct thread *switched_from[NR_CPUS];
+#define lock_sched()        _raw_spin_lock(&sched_lock)
+#define unlock_sched()      _raw_spin_unlock(&sched_lock)
+#define thread_on_cpu(t)    ((t)->on_cpu)
+#else
+#define lock_sched()        ((void)0)
+#define unlock_sched()      ((void)0)
+#define thread_on_cpu(t)    0
+#endif
+
+#ifdef CONFIG_PREEMPT
+/*
+ * preempt_count belongs to the running thread and is saved in it while it
+ * is switched out.  It starts raised for the boot context and for new
+ * threads, which schedule() switches to with it raised.  A thread keeps
+ * the CPU for up to sched_slice while others wait for it, after which the
+ * timer event makes it schedule() on the way out of the callback
+ * ("sched_slice_ms=" on the command line).  Being preempted is the same as
+ * calling schedule() at that point, so a thread that has blocked itself
+ * waits for its wake() as usual.
+ */
+#define SCHED_SLICE_MS 10
+#ifndef CONFIG_SMP
+int preempt_count = 1;
+int need_resched;
+#endif
+static s_time_t sched_slice;
+#endif
+
+/*
+ * Stacks of exited threads are kept for reuse, up to STACK_CACHE_DEPTH of
+ * each order.  All stacks are filled with STACK_POISON before use so that
+ * thread_stack_used() can tell how deep they went, and schedule() checks
+ * that the lowest word still holds it to catch overflows.
+ */
+#define STACK_CACHE_ORDERS (STACK_SIZE_PAGE_ORDER + 2)
+#define STACK_CACHE_DEPTH  4
+#define STACK_POISON       0x5a5a5a5a5a5a5a5aULL
+static char *stack_cache[STACK_CACHE_ORDERS][STACK_CACHE_DEPTH];
+static unsigned int stack_cache_nr[STACK_CACHE_ORDERS];
+
+static void poison_stack(char *stack, unsigned long size)
+{
+    unsigned long *p = (unsigned long *)stack;
+    unsigned long i;
+
+    for (i = 0; i < size / sizeof(*p); i++)
+        p[i] = (unsigned long)STACK_POISON;
+}
+
+static char *alloc_stack(int order)
+{
+    char *stack = NULL;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    lock_sched();
+    if (order < STACK_CACHE_ORDERS && stack_cache_nr[order])
+        stack = stack_cache[order][--stack_cache_nr[order]];
+    unlock_sched();
+    local_irq_restore(flags);
+    if (stack)
+        return stack;
+
+    /* We can't use lazy allocation here since the trap handler runs on the stack */
+    stack = (char *)alloc_pages(order);
+    if (stack)
+        poison_stack(stack, PAGE_SIZE << order);
+    return stack;
+}
+
+static void free_stack(char *stack, int order)
+{
+    unsigned long flags;
+
+    if (order < STACK_CACHE_ORDERS) {
+        poison_stack(stack, PAGE_SIZE << order);
+        local_irq_save(flags);
+        lock_sched();
+        if (stack_cache_nr[order] < STACK_CACHE_DEPTH) {
+            stack_cache[order][stack_cache_nr[order]++] = stack;
+            stack = NULL;
+        }
+        unlock_sched();
+        local_irq_restore(flags);
+        if (!stack)
+            return;
+    }
+    free_pages(stack, order);
+}
+
+static unsigned long shrink_stack_cache(unsigned long nr_pages)
+{
+    unsigned long flags, freed = 0;
+    char *stack;
+    int order;
+
+    for (order = STACK_CACHE_ORDERS - 1; order >= 0 && freed < nr_pages; order--) {
+        while (freed < nr_pages) {
+            local_irq_save(flags);
+            lock_sched();
+            stack = stack_cache_nr[order] ?
+                    stack_cache[order][--stack_cache_nr[order]] : NULL;
+            unlock_sched();
+            local_irq_restore(flags);
+            if (!stack)
+                break;
+            free_pages(stack, order);
+            freed += 1UL << order;
+        }
+    }
+
+    return freed;
+}
+
+static struct shrinker stack_cache_shrinker = {
+    .shrink = shrink_stack_cache,
+    .priority = 0,
+};
+
+/*
+ * Empty the page magazines of threads that are switched out.  Their owners
+ * only use them with preemption disabled, so none is half way through.
+ */
+static unsigned long shrink_page_magazines(unsigned long nr_pages)
+{
+    struct thread *thread;
+    unsigned long flags, freed = 0;
+
+    local_irq_save(flags);
+    lock_sched();
+    MINIOS_TAILQ_FOREACH(thread, &thread_list, thread_list) {
+        if (thread == current || (thread->flags & RUNNING_FLAG) ||
+            thread_on_cpu(thread))
+            continue;
+        freed += thread->page_mag.nr;
+        page_magazine_flush(&thread->page_mag);
+    }
+    unlock_sched();
+    local_irq_restore(flags);
+
+    return freed;
+}
+
+static struct shrinker page_magazine_shrinker = {
+    .shrink = shrink_page_magazines,
+    .priority = 0,
+};
+
+unsigned long thread_stack_used(struct thread *thread)
+{
+    unsigned long *p = (unsigned long *)thread->stack;
+    unsigned long i, n = thread->stack_size / sizeof(*p);
+
+    for (i = 0; i < n && p[i] == (unsigned long)STACK_POISON; i++)
+        ;
+    return (n - i) * sizeof(*p);
+}
+
+void print_stack_usage(void)
+{
+    struct thread *thread;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    lock_sched();
+    MINIOS_TAILQ_FOREACH(thread, &thread_list, thread_list)
+        printk("Thread \"%s\": %lu of %lu stack bytes used\n", thread->name,
+               thread_stack_used(thread), thread->stack_size);
+    unlock_sched();
+    local_irq_restore(flags);
+}
+
+#ifdef CONFIG_SMP
+/*
+ * Have an idle vCPU look at the run queues: cpu if it is idle, else any
+ * other one if any is allowed.
+ */
+static void kick_idle_cpu(unsigned int cpu, int any)
+{
+    unsigned long idle = idle_cpus & ~(1UL << smp_processor_id());
+
+    if (!(idle & (1UL << cpu))) {
+        if (!idle || !any)
+            return;
+        cpu = __ffs(idle);
+    }
+    idle_cpus &= ~(1UL << cpu);
+    smp_send_reschedule(cpu);
+}
+#endif
+
+static void enqueue_thread(struct thread *thread)
+{
+    struct run_queue *rq = &run_queues[thread->cpu];
+
+    if (sched_aging)
+        thread->queued_at = NOW();
+    MINIOS_TAILQ_INSERT_TAIL(&rq->queue[thread->prio], thread, run_list);
+    rq->mask |= 1U << thread->prio;
+    thread_set_flags(thread, QUEUED_FLAG);
+#ifdef CONFIG_SMP
+    /* Only its own vCPU may take it before its context is saved. */
+    kick_idle_cpu(thread->cpu, !thread->on_cpu);
+#endif
+}
+
+static void dequeue_thread(struct thread *thread)
+{
+    struct run_queue *rq = &run_queues[thread->cpu];
+
+    MINIOS_TAILQ_REMOVE(&rq->queue[thread->prio], thread, run_list);
+    if (MINIOS_TAILQ_EMPTY(&rq->queue[thread->prio]))
+        rq->mask &= ~(1U << thread->prio);
+    thread_clear_flags(thread, QUEUED_FLAG);
+}
+
+#ifdef CONFIG_SMP
+/* The highest priority thread another vCPU has waiting that may move. */
+static struct thread *steal_thread(unsigned int cpu)
+{
+    struct thread *thread, *best = NULL;
+    struct run_queue *rq;
+    unsigned int i;
+    int prio;
+
+    for (i = 0; i < nr_cpus; i++) {
+        if (i == cpu)
+            continue;
+        rq = &run_queues[i];
+        for (prio = SCHED_PRIO_MAX; prio >= SCHED_PRIO_MIN; prio--) {
+            if (best && prio <= best->prio)
+                break;
+            if (!(rq->mask & (1U << prio)))
+                continue;
+            MINIOS_TAILQ_FOREACH(thread, &rq->queue[prio], run_list)
+                if (!(thread->flags & PINNED_FLAG) && !thread->on_cpu)
+                    break;
+            if (thread) {
+                best = thread;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/* prev's context is saved now, so other vCPUs may run it. */
+static void finish_switch(void)
+{
+    unsigned int cpu = smp_processor_id();
+    struct thread *prev = switched_from[cpu];
+
+    if (prev) {
+        wmb();
+        prev->on_cpu = 0;
+        switched_from[cpu] = NULL;
+    }
+}
+#else
+#define finish_switch() ((void)0)
+#endif
+
+/*
+ * The first thread of the highest priority on cpu's run queues, unless a
+ * lower one aged, else one from another vCPU.
+ */
+static struct thread *pick_next_thread(unsigned int cpu, s_time_t now)
+{
+    struct run_queue *rq = &run_queues[cpu];
+    struct thread *thread, *next = NULL;
+    int prio;
+
+    for (prio = SCHED_PRIO_MAX; prio >= SCHED_PRIO_MIN; prio--) {
+        if (!(rq->mask & (1U << prio)))
+            continue;
+        thread = MINIOS_TAILQ_FIRST(&rq->queue[prio]);
+        if (!next) {
+            next = thread;
+            if (!sched_aging)
+                break;
+        } else if (now - thread->queued_at > sched_aging)
+            return thread;
+    }
+#ifdef CONFIG_SMP
+    if (!next)
+        next = steal_thread(cpu);
+#endif
+    return next;
+}
+
+#ifdef CONFIG_PREEMPT
+/* Per vCPU, the slice end the timer was last armed for. */
+static s_time_t slice_ends[NR_CPUS];
+#define slice_end_armed (slice_ends[smp_processor_id()])
+
+/* Called with interrupts disabled. */
+static void arm_preempt_timer(s_time_t slice_end)
+{
+    s_time_t deadline = slice_end;
+
+    slice_end_armed = slice_end;
+
+    if (nr_sleepers && sleepers[0]->wakeup_time < deadline)
+        deadline = sleepers[0]->wakeup_time;
+    if (next_timer_expiry() < deadline)
+        deadline = next_timer_expiry();
+    if (deadline != FOREVER)
+        arch_set_timer(deadline);
+}
+
+/* Whether thread has to give way to others once its slice is up. */
+static int slice_contended(struct thread *thread)
+{
+    unsigned int mask = run_queues[thread->cpu].mask;
+
+    if (sched_aging)
+        return mask != 0;
+    return (mask >> thread->prio) != 0;
+}
+
+static void start_slice(struct thread *thread, s_time_t now)
+{
+    thread->slice_start = now;
+    arm_preempt_timer(slice_contended(thread) ? now + sched_slice : FOREVER);
+}
+
+void preempt_schedule(void)
+{
+    if (in_callback || irqs_disabled() || !threads_started || preempt_count)
+        return;
+    schedule();
+}
+
+/*
+ * Called with events masked on the way out of the outermost callback, on
+ * the stack of the thread it interrupted, if that had them enabled.
+ */
+void preempt_schedule_irq(void)
+{
+    if (!need_resched || preempt_count || in_callback || !threads_started)
+        return;
+    local_irq_enable();
+    schedule();
+    local_irq_disable();
+}
+#endif
+
+#if defined(CONFIG_PREEMPT) || defined(CONFIG_SMP)
+/* New threads start here, see alloc_thread(). */
+static void thread_entry(void *unused)
+{
+    struct thread *thread = current;
+
+    finish_switch();
+#ifdef CONFIG_PREEMPT
+    preempt_count_dec();
+#endif
+    thread->entry(thread->entry_data);
+}
+#endif
+
+static inline void set_sleeper(unsigned int i, struct thread *thread)
+{
+    sleepers[i] = thread;
+    thread->sleep_idx = i;
+}
+
+static void sleepers_up(unsigned int i)
+{
+    struct thread *thread = sleepers[i];
+    unsigned int parent;
+
+    while (i) {
+        parent = (i - 1) / 2;
+        if (sleepers[parent]->wakeup_time <= thread->wakeup_time)
+            break;
+        set_sleeper(i, sleepers[parent]);
+        i = parent;
+    }
+    set_sleeper(i, thread);
+}
+
+static void sleepers_down(unsigned int i)
+{
+    struct thread *thread = sleepers[i];
+    unsigned int child;
+
+    while ((child = 2 * i + 1) < nr_sleepers) {
+        if (child + 1 < nr_sleepers &&
+            sleepers[child + 1]->wakeup_time < sleepers[child]->wakeup_time)
+            child++;
+        if (thread->wakeup_time <= sleepers[child]->wakeup_time)
+            break;
+        set_sleeper(i, sleepers[child]);
+        i = child;
+    }
+    set_sleeper(i, thread);
+}
+
+static void add_sleeper(struct thread *thread)
+{
+    set_sleeper(nr_sleepers, thread);
+    sleepers_up(nr_sleepers++);
+}
+
+static void del_sleeper(struct thread *thread)
+{
+    unsigned int i = thread->sleep_idx;
+    struct thread *last = sleepers[--nr_sleepers];
+
+    thread->sleep_idx = -1;
+    if (last == thread)
+        return;
+    set_sleeper(i, last);
+    sleepers_up(i);
+    sleepers_down(last->sleep_idx);
+}
+
+/* Make sure the heap of sleepers can hold n threads. */
+static int reserve_sleepers(unsigned int n)
+{
+    struct thread **new, **old;
+    unsigned long flags;
+
+    if (n <= max_sleepers)
+        return 0;
+    if (n < max_sleepers * 2)
+        n = max_sleepers * 2;
+    if (n < 16)
+        n = 16;
+
+    new = xmalloc_array(struct thread *, n);
+    if (!new)
+        return -ENOMEM;
+
+    local_irq_save(flags);
+    lock_sched();
+    /* Somebody else may have made room meanwhile. */
+    if (n > max_sleepers) {
+        if (nr_sleepers)
+            memcpy(new, sleepers, nr_sleepers * sizeof(*new));
+        old = sleepers;
+        sleepers = new;
+        max_sleepers = n;
+    } else
+        old = new;
+    unlock_sched();
+    local_irq_restore(flags);
+    xfree(old);
+
+    return 0;
+}
+
+#ifdef CONFIG_PREEMPT
+/* thread was queued on this vCPU: preempt for it, or time the slice. */
+static void check_preempt(struct thread *thread)
+{
+    struct thread *curr = current;
+
+    if (!threads_started || curr == thread || !(curr->flags & RUNNING_FLAG))
+        return;
+    if (thread->prio > curr->prio) {
+        set_need_resched(1);
+        if (!in_callback)
+            arm_preempt_timer(NOW());
+    } else if (slice_contended(curr) &&
+               slice_end_armed != curr->slice_start + sched_slice)
+        arm_preempt_timer(curr->slice_start + sched_slice);
+}
+
+#ifdef CONFIG_SMP
+/* Another vCPU queued threads here, see __wake(). */
+void sched_check_preempt(void)
+{
+    struct thread *curr = current;
+    unsigned int mask;
+
+    lock_sched();
+    mask = run_queues[smp_processor_id()].mask;
+    if (threads_started && mask && (curr->flags & RUNNING_FLAG)) {
+        if (mask >> (curr->prio + 1))
+            set_need_resched(1);
+        else if (slice_contended(curr) &&
+                 slice_end_armed != curr->slice_start + sched_slice)
+            arm_preempt_timer(curr->slice_start + sched_slice);
+    }
+    unlock_sched();
+}
+#endif
+#endif
+
+/* Called with sched_lock held. */
+static void __wake(struct thread *thread)
+{
+    thread->wakeup_time = 0LL;
+    set_runnable(thread);
+    if (thread->sleep_idx >= 0)
+        del_sleeper(thread);
+    /* The running thread gets queued when it calls schedule(). */
+    if (!(thread->flags & (QUEUED_FLAG | RUNNING_FLAG | EXITED_FLAG))) {
+        enqueue_thread(thread);
+#ifdef CONFIG_PREEMPT
+        /* Preempt for a higher priority, else start timing the slice. */
+        if (thread->cpu == smp_processor_id())
+            check_preempt(thread);
+        else
+            smp_send_reschedule(thread->cpu);
+#endif
+    }
+}
+
+/* Free the threads that exited, except for self, which is still running. */
+static void reap_threads(struct thread *self)
+{
+    struct thread *thread;
+    unsigned long flags;
+
+    while (!MINIOS_TAILQ_EMPTY(&exited_threads)) {
+        local_irq_save(flags);
+        lock_sched();
+        MINIOS_TAILQ_FOREACH(thread, &exited_threads, thread_list)
+            if (thread != self && !thread_on_cpu(thread))
+                break;
+        if (thread)
+            MINIOS_TAILQ_REMOVE(&exited_threads, thread, thread_list);
+        unlock_sched();
+        local_irq_restore(flags);
+        if (!thread)
+            break;
+        free_stack(thread->stack, get_order(thread->stack_size));
+#ifdef HAVE_LIBC
+        xfree(thread->pthread);
+#endif
+        xfree(thread);
+    }
+}
+
 void schedule(void)
 {
-    struct thread *prev, *next, *thread, *tmp;
+    struct thread *prev, *next;
     unsigned long flags;
+    unsigned int cpu;
 
     if (irqs_disabled()) {
         printk("Must not call schedule() with IRQs disabled\n");
         BUG();
     }
 
+#ifdef CONFIG_PREEMPT
+    preempt_count_inc();
+#endif
     prev = current;
+    if (*(unsigned long *)prev->stack != (unsigned long)STACK_POISON) {
+        printk("Thread \"%s\" overflowed its stack\n", prev->name);
+        BUG();
+    }
     local_irq_save(flags); 
+    cpu = smp_processor_id();
 
     if (in_callback) {
         printk("Must not call schedule() from a callback\n");
         BUG();
     }
 
+    lock_sched();
+    /* From here on wake(prev) has to queue it again. */
+    thread_clear_flags(prev, RUNNING_FLAG);
+    if (is_runnable(prev)) {
+        /* Round robin: go behind everybody else */
+        if (!(prev->flags & QUEUED_FLAG))
+            enqueue_thread(prev);
+    } else if (prev->wakeup_time != 0LL && prev->sleep_idx < 0) {
+        add_sleeper(prev);
+#ifdef CONFIG_SMP
+        /* An idle vCPU may have to wake up earlier now. */
+        if (prev->sleep_idx == 0)
+            kick_idle_cpu(cpu, 1);
+#endif
+    }
+
     do {
-        /* Examine all threads.
-           Find a runnable thread, but also wake up expired ones and find the
-           time when the next timeout expires, else use 10 seconds. */
+        /* Run expired timers and wake up expired sleepers, then take the
+           first runnable thread, else block until the next timeout expires
+           or for 10 seconds. */
         s_time_t now = NOW();
         s_time_t min_wakeup_time = now + SECONDS(10);
-        next = NULL;
-        MINIOS_TAILQ_FOREACH_SAFE(thread, &thread_list, thread_list, tmp)
-        {
-            if (!is_runnable(thread) && thread->wakeup_time != 0LL)
-            {
-                if (thread->wakeup_time <= now)
-                    wake(thread);
-                else if (thread->wakeup_time < min_wakeup_time)
-                    min_wakeup_time = thread->wakeup_time;
-            }
-            if(is_runnable(thread)) 
-            {
-                next = thread;
-                /* Put this thread on the end of the list */
-                MINIOS_TAILQ_REMOVE(&thread_list, thread, thread_list);
-                MINIOS_TAILQ_INSERT_TAIL(&thread_list, thread, thread_list);
-                break;
-            }
+
+        if (next_timer_expiry() <= now) {
+            unlock_sched();
+            local_irq_restore(flags);
+            run_timers();
+            local_irq_save(flags);
+            lock_sched();
+            continue;
         }
-        if (next)
+        while (nr_sleepers && sleepers[0]->wakeup_time <= now)
+            __wake(sleepers[0]);
+        next = pick_next_thread(cpu, now);
+        if (next) {
+            dequeue_thread(next);
             break;
+        }
+        if (nr_sleepers && sleepers[0]->wakeup_time < min_wakeup_time)
+            min_wakeup_time = sleepers[0]->wakeup_time;
+        if (next_timer_expiry() < min_wakeup_time)
+            min_wakeup_time = next_timer_expiry();
+#ifdef CONFIG_SMP
+        idle_cpus |= 1UL << cpu;
+#endif
+        unlock_sched();
         /* block until the next timeout expires, or for 10 secs, whichever comes first */
         block_domain(min_wakeup_time);
         /* handle pending events if any */
         force_evtchn_callback();
+        lock_sched();
+#ifdef CONFIG_SMP
+        idle_cpus &= ~(1UL << cpu);
+#endif
     } while(1);
+    thread_set_flags(next, RUNNING_FLAG);
+    next->cpu = cpu;
+#ifdef CONFIG_SMP
+    next->on_cpu = 1;
+    if (prev != next)
+        switched_from[cpu] = prev;
+#endif
+#ifdef CONFIG_PREEMPT
+    set_need_resched(0);
+    start_slice(next, NOW());
+#endif
+    unlock_sched();
     local_irq_restore(flags);
     /* Interrupting the switch is equivalent to having the next thread
        inturrupted at the return instruction. And therefore at safe point. */
-    if(prev != next) switch_threads(prev, next);
-
-    MINIOS_TAILQ_FOREACH_SAFE(thread, &exited_threads, thread_list, tmp)
-    {
-        if(thread != prev)
-        {
-            MINIOS_TAILQ_REMOVE(&exited_threads, thread, thread_list);
-            free_pages(thread->stack, STACK_SIZE_PAGE_ORDER);
-            xfree(thread);
-        }
+    if(prev != next) {
+#ifdef CONFIG_PREEMPT
+        prev->saved_preempt_count = preempt_count;
+        set_preempt_count(next->saved_preempt_count);
+#endif
+        set_current(next);
+        switch_threads(prev, next);
+        finish_switch();
     }
+
+    reap_threads(prev);
+#ifdef CONFIG_PREEMPT
+    preempt_count_dec();
+#endif
 }
 
-struct thread* create_thread(char *name, void (*function)(void *), void *data)
+static struct thread *alloc_thread(char *name, void (*function)(void *),
+                                   void *data, unsigned long stack_size,
+                                   int prio)
 {
     struct thread *thread;
-    unsigned long flags;
+    char *stack;
+    int order;
+
+    if (prio < SCHED_PRIO_MIN || prio > SCHED_PRIO_MAX)
+        return NULL;
+    if (stack_size < STACK_SIZE_MIN)
+        stack_size = STACK_SIZE_MIN;
+    order = get_order(stack_size);
+    stack = alloc_stack(order);
+    if (!stack)
+        return NULL;
+    if (reserve_sleepers(nr_threads + 1)) {
+        free_stack(stack, order);
+        return NULL;
+    }
     /* Call architecture specific setup. */
-    thread = arch_create_thread(name, function, data);
+#if defined(CONFIG_PREEMPT) || defined(CONFIG_SMP)
+    thread = arch_create_thread(name, thread_entry, NULL, stack,
+                                PAGE_SIZE << order);
+#else
+    thread = arch_create_thread(name, function, data, stack, PAGE_SIZE << order);
+#endif
+    if (!thread) {
+        free_stack(stack, order);
+        return NULL;
+    }
+#if defined(CONFIG_PREEMPT) || defined(CONFIG_SMP)
+    thread->entry = function;
+    thread->entry_data = data;
+#endif
+#ifdef CONFIG_PREEMPT
+    thread->saved_preempt_count = 1;
+#endif
     /* Not runable, not exited, not sleeping */
     thread->flags = 0;
+    thread->prio = prio;
     thread->wakeup_time = 0LL;
+    thread->sleep_idx = -1;
+    thread->page_mag.nr = 0;
+    thread->cpu = smp_processor_id();
+#ifdef CONFIG_SMP
+    thread->on_cpu = 0;
+#endif
 #ifdef HAVE_LIBC
     _REENT_INIT_PTR((&thread->reent))
+    thread->pthread = NULL;
 #endif
+    return thread;
+}
+
+struct thread* create_thread_ex(char *name, void (*function)(void *),
+                                void *data, unsigned long stack_size,
+                                int prio)
+{
+    struct thread *thread;
+    unsigned long flags;
+
+    thread = alloc_thread(name, function, data, stack_size, prio);
+    if (!thread)
+        return NULL;
     set_runnable(thread);
     local_irq_save(flags);
+    lock_sched();
     MINIOS_TAILQ_INSERT_TAIL(&thread_list, thread, thread_list);
+    nr_threads++;
+    enqueue_thread(thread);
+    unlock_sched();
     local_irq_restore(flags);
     return thread;
 }
 
+struct thread* create_thread(char *name, void (*function)(void *), void *data)
+{
+    return create_thread_ex(name, function, data, STACK_SIZE,
+                            SCHED_PRIO_DEFAULT);
+}
+
+/* Never queued: its vCPU starts in it and falls back to it when idle. */
+static struct thread *create_idle_thread(unsigned int cpu,
+                                         void (*function)(void *))
+{
+    struct thread *thread;
+    unsigned long flags;
+
+    thread = alloc_thread("Idle", function, NULL, STACK_SIZE, SCHED_PRIO_MIN);
+    if (!thread)
+        return NULL;
+    thread->cpu = cpu;
+    thread_set_flags(thread, RUNNABLE_FLAG | RUNNING_FLAG | PINNED_FLAG);
+#ifdef CONFIG_SMP
+    thread->on_cpu = 1;
+#endif
+    local_irq_save(flags);
+    lock_sched();
+    MINIOS_TAILQ_INSERT_TAIL(&thread_list, thread, thread_list);
+    nr_threads++;
+    unlock_sched();
+    local_irq_restore(flags);
+    idle_threads[cpu] = thread;
+    return thread;
+}
+
+int set_thread_priority(struct thread *thread, int prio)
+{
+    unsigned long flags;
+
+    if (prio < SCHED_PRIO_MIN || prio > SCHED_PRIO_MAX)
+        return -EINVAL;
+
+    local_irq_save(flags);
+    lock_sched();
+    if (thread->flags & QUEUED_FLAG) {
+        dequeue_thread(thread);
+        thread->prio = prio;
+        enqueue_thread(thread);
+    } else
+        thread->prio = prio;
+    unlock_sched();
+    local_irq_restore(flags);
+
+    return 0;
+}
+
+static struct page_magazine callback_page_mag[NR_CPUS];
+struct page_magazine *current_page_magazine(void)
+{
+    if (in_callback)
+        return &callback_page_mag[smp_processor_id()];
+    if (!threads_started)
+        return NULL;
+    return &get_current()->page_mag;
+}
+
 #ifdef HAVE_LIBC
-static struct _reent callback_reent;
+static struct _reent callback_reent[NR_CPUS];
 struct _reent *__getreent(void)
 {
     struct _reent *_reent;
@@ -157,7 +899,7 @@ struct _reent *__getreent(void)
     if (!threads_started)
         _reent = _impure_ptr;
     else if (in_callback)
-        _reent = &callback_reent;
+        _reent = &callback_reent[smp_processor_id()];
     else
         _reent = &get_current()->reent;
 
@@ -169,7 +911,10 @@ struct _reent *__getreent(void)
 #else
         register unsigned long sp asm ("esp");
 #endif
-        if ((sp & (STACK_SIZE-1)) < STACK_SIZE / 16) {
+        struct thread *thread = threads_started && !in_callback ?
+                                get_current() : NULL;
+        if (thread &&
+            sp - (unsigned long)thread->stack < thread->stack_size / 16) {
             static int overflowing;
             if (!overflowing) {
                 overflowing = 1;
@@ -190,13 +935,20 @@ void exit_thread(void)
 {
     unsigned long flags;
     struct thread *thread = current;
-    printk("Thread \"%s\" exited.\n", thread->name);
+    printk("Thread \"%s\" exited, %lu of %lu stack bytes used.\n",
+           thread->name, thread_stack_used(thread), thread->stack_size);
+    page_magazine_flush(&thread->page_mag);
     local_irq_save(flags);
+    lock_sched();
     /* Remove from the thread list */
     MINIOS_TAILQ_REMOVE(&thread_list, thread, thread_list);
+    nr_threads--;
     clear_runnable(thread);
+    thread->wakeup_time = 0LL;
+    thread_set_flags(thread, EXITED_FLAG);
     /* Put onto exited list */
     MINIOS_TAILQ_INSERT_HEAD(&exited_threads, thread, thread_list);
+    unlock_sched();
     local_irq_restore(flags);
     /* Schedule will free the resources */
     while(1)
@@ -208,41 +960,99 @@ void exit_thread(void)
 
 void block(struct thread *thread)
 {
+    unsigned long flags;
+
+    local_irq_save(flags);
+    lock_sched();
     thread->wakeup_time = 0LL;
     clear_runnable(thread);
+    if (thread->flags & QUEUED_FLAG)
+        dequeue_thread(thread);
+    if (thread->sleep_idx >= 0)
+        del_sleeper(thread);
+    unlock_sched();
+    local_irq_restore(flags);
 }
 
 void msleep(uint32_t millisecs)
 {
     struct thread *thread = get_current();
+    unsigned long flags;
+
+    local_irq_save(flags);
+    lock_sched();
     thread->wakeup_time = NOW()  + MILLISECS(millisecs);
     clear_runnable(thread);
+    unlock_sched();
+    local_irq_restore(flags);
     schedule();
 }
 
 void wake(struct thread *thread)
 {
-    thread->wakeup_time = 0LL;
-    set_runnable(thread);
+    unsigned long flags;
+
+    local_irq_save(flags);
+    lock_sched();
+    __wake(thread);
+    unlock_sched();
+    local_irq_restore(flags);
 }
 
 void idle_thread_fn(void *unused)
 {
     threads_started = 1;
+    while (1) {
+        /* Stay runnable while there is memory to add or pages to clear. */
+        if (!deferred_mem_init(DEFERRED_MEM_BATCH) && !refill_zero_pool())
+            block(current);
+        schedule();
+    }
+}
+
+#ifdef CONFIG_SMP
+static void secondary_idle_fn(void *unused)
+{
+    start_secondary();
+    /* Leave the threads to the boot vCPU until it is done setting up. */
+    while (!threads_started)
+        barrier();
     while (1) {
         block(current);
         schedule();
     }
 }
 
+struct thread *init_sched_cpu(unsigned int cpu)
+{
+    return create_idle_thread(cpu, secondary_idle_fn);
+}
+#endif
+
 void init_sched(void)
 {
+    unsigned int cpu;
+    int i;
+
     printk("Initialising scheduler\n");
 
 #ifdef HAVE_LIBC
-    _REENT_INIT_PTR((&callback_reent))
+    for (cpu = 0; cpu < NR_CPUS; cpu++)
+        _REENT_INIT_PTR((&callback_reent[cpu]))
 #endif
-    idle_thread = create_thread("Idle", idle_thread_fn, NULL);
+    for (cpu = 0; cpu < NR_CPUS; cpu++)
+        for (i = SCHED_PRIO_MIN; i <= SCHED_PRIO_MAX; i++)
+            MINIOS_TAILQ_INIT(&run_queues[cpu].queue[i]);
+    sched_aging = MILLISECS(get_boot_param("sched_aging_ms", SCHED_AGING_MS));
+#ifdef CONFIG_PREEMPT
+    sched_slice = MILLISECS(get_boot_param("sched_slice_ms", SCHED_SLICE_MS));
+#endif
+
+    register_shrinker(&stack_cache_shrinker);
+    register_shrinker(&page_magazine_shrinker);
+    /* Deferred work only, when nothing else wants to run.
+       run_idle_thread() switches to it directly. */
+    create_idle_thread(0, idle_thread_fn);
 }
 
 /*
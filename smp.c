@@ -0,0 +1,98 @@
+/*
+ * smp.c
+ *
+ * Bringing up the secondary vCPUs, and the reschedule IPIs between them.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/kernel.h>
+#include <mini-os/lib.h>
+#include <mini-os/hypervisor.h>
+#include <mini-os/events.h>
+#include <mini-os/time.h>
+#include <mini-os/sched.h>
+#include <mini-os/preempt.h>
+#include <mini-os/smp.h>
+#include <xen/vcpu.h>
+
+unsigned int nr_cpus = 1;
+
+static evtchn_port_t ipi_ports[NR_CPUS];
+
+/* Nothing to do here: the event itself gets the vCPU out of block_domain(). */
+static void ipi_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
+{
+#ifdef CONFIG_PREEMPT
+    sched_check_preempt();
+#endif
+}
+
+void smp_send_reschedule(unsigned int cpu)
+{
+    notify_remote_via_evtchn(ipi_ports[cpu]);
+}
+
+static void init_cpu_events(void)
+{
+    unsigned int cpu = smp_processor_id();
+
+    ipi_ports[cpu] = bind_ipi(ipi_handler, NULL);
+    unmask_evtchn(ipi_ports[cpu]);
+}
+
+void start_secondary(void)
+{
+    init_cpu_events();
+    init_time_secondary();
+    printk("vCPU %u up\n", smp_processor_id());
+    local_irq_enable();
+}
+
+void init_smp(void)
+{
+    unsigned long max = get_boot_param("maxcpus", NR_CPUS);
+    struct thread *idle;
+    unsigned int cpu;
+    int rc;
+
+    init_cpu_events();
+    if ( max > NR_CPUS )
+        max = NR_CPUS;
+
+    for ( cpu = 1; cpu < max; cpu++ )
+    {
+        /* The vCPUs Xen gave the domain are numbered from 0 on. */
+        if ( HYPERVISOR_vcpu_op(VCPUOP_is_up, cpu, NULL) < 0 )
+            break;
+        idle = init_sched_cpu(cpu);
+        if ( !idle )
+            break;
+        rc = arch_start_cpu(cpu, idle);
+        if ( rc )
+        {
+            printk("Starting vCPU %u failed rc=%d\n", cpu, rc);
+            break;
+        }
+        nr_cpus++;
+    }
+
+    printk("Using %u vCPUs\n", nr_cpus);
+}
@@ -34,6 +34,7 @@
 #include <mini-os/types.h>
 #include <mini-os/lib.h>
 #include <mini-os/sched.h>
+#include <mini-os/timer.h>
 #include <mini-os/xenbus.h>
 #include <mini-os/gnttab.h>
 #include <mini-os/netfront.h>
@@ -73,16 +74,96 @@ int rand(void)
 }
 #endif
 
-static void periodic_thread(void *p)
+static struct timer periodic_timer;
+
+static void periodic_fn(void *p)
 {
     struct timeval tv;
-    printk("Periodic thread started.\n");
-    for(;;)
-    {
-        gettimeofday(&tv, NULL);
-        printk("T(s=%ld us=%ld)\n", tv.tv_sec, tv.tv_usec);
-        msleep(1000);
+    gettimeofday(&tv, NULL);
+    printk("T(s=%ld us=%ld)\n", tv.tv_sec, tv.tv_usec);
+}
+
+#define CACHE_TEST_OBJS  (2 * PAGE_SIZE / 64)
+#define CACHE_TEST_MAGIC 0x5a5a5a5aU
+
+static void cache_test_ctor(void *obj)
+{
+    *(uint32_t *)obj = CACHE_TEST_MAGIC;
+}
+
+static void test_xmem_cache(void)
+{
+    static void *objs[CACHE_TEST_OBJS];
+    struct xmalloc_stats before, after;
+    struct xmem_cache *cache;
+    int i, j, failed = 0;
+
+    if (xmem_cache_create("bad", 40, 0, NULL) ||
+        xmem_cache_create("bad", 40, 24, NULL) ||
+        xmem_cache_create("bad", PAGE_SIZE, 8, NULL)) {
+        printk("xmem_cache: bad parameters accepted\n");
+        failed = 1;
+    }
+
+    get_xmalloc_stats(&before);
+    cache = xmem_cache_create("test", 40, 64, cache_test_ctor);
+    if (!cache) {
+        printk("xmem_cache: creating the cache failed\n");
+        return;
+    }
+    /* More than a slab's worth, so that a second one gets used. */
+    for (i = 0; i < CACHE_TEST_OBJS; i++) {
+        objs[i] = xmem_cache_alloc(cache);
+        if (!objs[i]) {
+            printk("xmem_cache: allocation %d failed\n", i);
+            failed = 1;
+            break;
+        }
+        if ((unsigned long)objs[i] & 63) {
+            printk("xmem_cache: %p is not aligned\n", objs[i]);
+            failed = 1;
+        }
+        if (*(uint32_t *)objs[i] != CACHE_TEST_MAGIC) {
+            printk("xmem_cache: constructor not run on %p\n", objs[i]);
+            failed = 1;
+        }
+        memset(objs[i], i, 40);
     }
+    for (j = 0; j < i; j++) {
+        if (*((unsigned char *)objs[j] + 39) != (unsigned char)j) {
+            printk("xmem_cache: %p overlaps another object\n", objs[j]);
+            failed = 1;
+        }
+        xmem_cache_free(cache, objs[j]);
+    }
+    xmem_cache_destroy(cache);
+    get_xmalloc_stats(&after);
+    if (after.slab_pages != before.slab_pages) {
+        printk("xmem_cache: %ld slab pages leaked\n",
+               (long)(after.slab_pages - before.slab_pages));
+        failed = 1;
+    }
+
+    /* One object per slab: all but one empty slab go once freed. */
+    cache = xmem_cache_create("test1", PAGE_SIZE / 2, PAGE_SIZE / 2, NULL);
+    if (!cache) {
+        printk("xmem_cache: creating the single object cache failed\n");
+        return;
+    }
+    for (i = 0; i < 4; i++)
+        if (!(objs[i] = xmem_cache_alloc(cache)))
+            break;
+    for (j = 0; j < i; j++)
+        xmem_cache_free(cache, objs[j]);
+    get_xmalloc_stats(&after);
+    if (i == 4 && after.slab_pages != before.slab_pages + 1) {
+        printk("xmem_cache: %ld empty single object slabs kept\n",
+               (long)(after.slab_pages - before.slab_pages));
+        failed = 1;
+    }
+    xmem_cache_destroy(cache);
+
+    printk("xmem_cache test %s\n", failed ? "FAILED" : "passed");
 }
 
 #ifdef CONFIG_NETFRONT
@@ -109,13 +190,17 @@ struct blk_req {
     struct blk_req *next;
 };
 
+static struct xmem_cache *blk_req_cache;
+
 #ifdef BLKTEST_WRITE
 static struct blk_req *blk_to_read;
 #endif
 
 static struct blk_req *blk_alloc_req(uint64_t sector)
 {
-    struct blk_req *req = xmalloc(struct blk_req);
+    struct blk_req *req = xmem_cache_alloc(blk_req_cache);
+    if (!req)
+        return NULL;
     req->aiocb.aio_dev = blk_dev;
     req->aiocb.aio_buf = _xmalloc(blk_info.sector_size, blk_info.sector_size);
     req->aiocb.aio_nbytes = blk_info.sector_size;
@@ -125,6 +210,12 @@ static struct blk_req *blk_alloc_req(uint64_t sector)
     return req;
 }
 
+static void blk_free_req(struct blk_req *req)
+{
+    free(req->aiocb.aio_buf);
+    xmem_cache_free(blk_req_cache, req);
+}
+
 static void blk_read_completed(struct blkfront_aiocb *aiocb, int ret)
 {
     struct blk_req *req = aiocb->data;
@@ -132,8 +223,7 @@ static void blk_read_completed(struct blkfront_aiocb *aiocb, int ret)
         printk("got error code %d when reading at offset %ld\n", ret, (long) aiocb->aio_offset);
     else
         blk_size_read += blk_info.sector_size;
-    free(aiocb->aio_buf);
-    free(req);
+    blk_free_req(req);
 }
 
 static void blk_read_sector(uint64_t sector)
@@ -141,6 +231,8 @@ static void blk_read_sector(uint64_t sector)
     struct blk_req *req;
 
     req = blk_alloc_req(sector);
+    if (!req)
+        return;
     req->aiocb.aio_cb = blk_read_completed;
 
     blkfront_aio_read(&req->aiocb);
@@ -156,8 +248,7 @@ static void blk_write_read_completed(struct blkfront_aiocb *aiocb, int ret)
 
     if (ret) {
         printk("got error code %d when reading back at offset %ld\n", ret, aiocb->aio_offset);
-        free(aiocb->aio_buf);
-        free(req);
+        blk_free_req(req);
         return;
     }
     blk_size_read += blk_info.sector_size;
@@ -170,8 +261,7 @@ static void blk_write_read_completed(struct blkfront_aiocb *aiocb, int ret)
         }
         rand_value *= RAND_MIX;
     }
-    free(aiocb->aio_buf);
-    free(req);
+    blk_free_req(req);
 }
 
 static void blk_write_completed(struct blkfront_aiocb *aiocb, int ret)
@@ -179,8 +269,7 @@ static void blk_write_completed(struct blkfront_aiocb *aiocb, int ret)
     struct blk_req *req = aiocb->data;
     if (ret) {
         printk("got error code %d when writing at offset %ld\n", ret, aiocb->aio_offset);
-        free(aiocb->aio_buf);
-        free(req);
+        blk_free_req(req);
         return;
     }
     blk_size_write += blk_info.sector_size;
@@ -197,6 +286,8 @@ static void blk_write_sector(uint64_t sector)
     int *buf;
 
     req = blk_alloc_req(sector);
+    if (!req)
+        return;
     req->aiocb.aio_cb = blk_write_completed;
     req->rand_value = rand_value = rand();
 
@@ -220,6 +311,14 @@ static void blkfront_thread(void *p)
         return;
     }
 
+    blk_req_cache = xmem_cache_create("blk_req", sizeof(struct blk_req),
+                                      __alignof__(struct blk_req), NULL);
+    if (!blk_req_cache) {
+        printk("Could not create the blk_req cache\n");
+        up(&blk_sem);
+        return;
+    }
+
     if (blk_info.info & VDISK_CDROM)
         printk("Block device is a CDROM\n");
     if (blk_info.info & VDISK_REMOVABLE)
@@ -555,10 +654,14 @@ static void shutdown_thread(void *p)
 int app_main(void *p)
 {
     printk("Test main: par=%p\n", p);
+    test_xmem_cache();
 #ifdef CONFIG_XENBUS
     create_thread("xenbus_tester", xenbus_tester, p);
 #endif
-    create_thread("periodic_thread", periodic_thread, p);
+    init_timer(&periodic_timer, periodic_fn, NULL);
+    periodic_timer.expires = NOW();
+    periodic_timer.period = SECONDS(1);
+    add_timer(&periodic_timer);
 #ifdef CONFIG_NETFRONT
     create_thread("netfront", netfront_thread, p);
 #endif
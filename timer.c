@@ -0,0 +1,171 @@
+/* -*-  Mode:C; c-basic-offset:4; tab-width:4 -*-
+ *
+ * Kernel timers.  Pending timers are kept on a list sorted by expiry time,
+ * which the scheduler checks before picking the next thread and uses for
+ * its block_domain() deadline.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <mini-os/os.h>
+#include <mini-os/lib.h>
+#include <mini-os/timer.h>
+#include <mini-os/spinlock.h>
+
+MINIOS_TAILQ_HEAD(timer_list, struct timer);
+
+static struct timer_list timer_list = MINIOS_TAILQ_HEAD_INITIALIZER(timer_list);
+
+/* Any vCPU may run the timers, the list is shared. */
+#ifdef CONFIG_SMP
+static spinlock_t timer_lock = SPIN_LOCK_UNLOCKED;
+#define lock_timers()   _raw_spin_lock(&timer_lock)
+#define unlock_timers() _raw_spin_unlock(&timer_lock)
+#else
+#define lock_timers()   ((void)0)
+#define unlock_timers() ((void)0)
+#endif
+
+void init_timer(struct timer *timer, void (*function)(void *), void *data)
+{
+    timer->expires = 0;
+    timer->period = 0;
+    timer->function = function;
+    timer->data = data;
+    timer->pending = 0;
+}
+
+/*
+ * Timers are mostly armed for later than the ones already pending, so look
+ * for the insertion point from the end.  Called with interrupts disabled.
+ */
+static void __add_timer(struct timer *timer)
+{
+    struct timer *t;
+
+    MINIOS_TAILQ_FOREACH_REVERSE(t, &timer_list, timer_list, list)
+        if ( t->expires <= timer->expires )
+            break;
+    if ( t )
+        MINIOS_TAILQ_INSERT_AFTER(&timer_list, t, timer, list);
+    else
+        MINIOS_TAILQ_INSERT_HEAD(&timer_list, timer, list);
+    timer->pending = 1;
+}
+
+static void __del_timer(struct timer *timer)
+{
+    MINIOS_TAILQ_REMOVE(&timer_list, timer, list);
+    timer->pending = 0;
+}
+
+void add_timer(struct timer *timer)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    lock_timers();
+    BUG_ON(timer->pending);
+    __add_timer(timer);
+    unlock_timers();
+    local_irq_restore(flags);
+}
+
+int mod_timer(struct timer *timer, s_time_t expires)
+{
+    unsigned long flags;
+    int pending;
+
+    local_irq_save(flags);
+    lock_timers();
+    pending = timer->pending;
+    if ( pending )
+        __del_timer(timer);
+    timer->expires = expires;
+    __add_timer(timer);
+    unlock_timers();
+    local_irq_restore(flags);
+
+    return pending;
+}
+
+int del_timer(struct timer *timer)
+{
+    unsigned long flags;
+    int pending;
+
+    local_irq_save(flags);
+    lock_timers();
+    pending = timer->pending;
+    if ( pending )
+        __del_timer(timer);
+    unlock_timers();
+    local_irq_restore(flags);
+
+    return pending;
+}
+
+s_time_t next_timer_expiry(void)
+{
+    struct timer *timer;
+    unsigned long flags;
+    s_time_t expires;
+
+    local_irq_save(flags);
+    lock_timers();
+    timer = MINIOS_TAILQ_FIRST(&timer_list);
+    expires = timer ? timer->expires : Time_Max;
+    unlock_timers();
+    local_irq_restore(flags);
+
+    return expires;
+}
+
+void run_timers(void)
+{
+    struct timer *timer;
+    void (*function)(void *);
+    void *data;
+    unsigned long flags;
+    s_time_t now = NOW();
+
+    local_irq_save(flags);
+    lock_timers();
+    while ( (timer = MINIOS_TAILQ_FIRST(&timer_list)) != NULL &&
+            timer->expires <= now )
+    {
+        __del_timer(timer);
+        if ( timer->period > 0 )
+        {
+            timer->expires += ((now - timer->expires) / timer->period + 1) *
+                              timer->period;
+            __add_timer(timer);
+        }
+        /* The callback may free or re-arm the timer. */
+        function = timer->function;
+        data = timer->data;
+        unlock_timers();
+        local_irq_restore(flags);
+        function(data);
+        local_irq_save(flags);
+        lock_timers();
+    }
+    unlock_timers();
+    local_irq_restore(flags);
+}
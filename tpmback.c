@@ -129,6 +129,7 @@ static tpmback_dev_t gtpmdev = {
 };
 struct wait_queue_head waitq;
 int globalinit = 0;
+static struct xmem_cache *tpmcmd_cache;
 
 /************************************
  * TPMIF SORTED ARRAY FUNCTIONS
@@ -889,6 +890,12 @@ void init_tpmback(void (*open_cb)(domid_t, unsigned int), void (*close_cb)(domid
 {
    if(!globalinit) {
       init_waitqueue_head(&waitq);
+      tpmcmd_cache = xmem_cache_create("tpmcmd", sizeof(tpmcmd_t),
+                                       __alignof__(tpmcmd_t), NULL);
+      if(tpmcmd_cache == NULL) {
+         TPMBACK_ERR("Unable to create the tpmcmd cache\n");
+         return;
+      }
       globalinit = 1;
    }
    printk("============= Init TPM BACK ================\n");
@@ -948,7 +955,7 @@ tpmcmd_t* get_request(tpmif_t* tpmif) {
    local_irq_save(flags);
 
    /* Allocate the cmd object to hold the data */
-   if((cmd = malloc(sizeof(*cmd))) == NULL) {
+   if((cmd = xmem_cache_alloc(tpmcmd_cache)) == NULL) {
       goto error;
    }
    init_tpmcmd(cmd, tpmif->domid, tpmif->handle, tpmif->opaque);
@@ -989,7 +996,7 @@ error:
 	 free(cmd->req);
 	 cmd->req = NULL;
       }
-      free(cmd);
+      xmem_cache_free(tpmcmd_cache, cmd);
       cmd = NULL;
    }
    local_irq_restore(flags);
@@ -1105,7 +1112,7 @@ end:
    if(tpmcmd->req != NULL) {
       free(tpmcmd->req);
    }
-   free(tpmcmd);
+   xmem_cache_free(tpmcmd_cache, tpmcmd);
    return;
 }
 
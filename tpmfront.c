@@ -204,12 +204,11 @@ static int tpmfront_connect(struct tpmfront_dev* dev)
 {
    char* err;
    /* Create shared page */
-   dev->page = (tpmif_shared_page_t *)alloc_page();
+   dev->page = (tpmif_shared_page_t *)alloc_zeroed_page();
    if(dev->page == NULL) {
       TPMFRONT_ERR("Unable to allocate page for shared memory\n");
       goto error;
    }
-   memset(dev->page, 0, PAGE_SIZE);
    dev->ring_ref = gnttab_grant_access(dev->bedomid, virt_to_mfn(dev->page), 0);
    TPMFRONT_DEBUG("grant ref is %lu\n", (unsigned long) dev->ring_ref);
 
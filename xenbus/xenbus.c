@@ -61,8 +61,10 @@ struct xenbus_req_info
     void *reply;
 };
 
+/* Default number of requests in flight, "xenbus_reqs=" on the command line. */
 #define NR_REQS 32
-static struct xenbus_req_info req_info[NR_REQS];
+static struct xenbus_req_info *req_info;
+static unsigned int nr_reqs;
 
 static char *errmsg(struct xsd_sockmsg *rep);
 
@@ -319,7 +321,7 @@ static void release_xenbus_id(int id)
     req_info[id].in_use = 0;
     nr_live_reqs--;
     req_info[id].in_use = 0;
-    if (nr_live_reqs == 0 || nr_live_reqs == NR_REQS - 1)
+    if (nr_live_reqs == 0 || nr_live_reqs == nr_reqs - 1)
         wake_up(&req_wq);
     spin_unlock(&req_lock);
 }
@@ -334,10 +336,10 @@ static int allocate_xenbus_id(void)
     while (1) 
     {
         spin_lock(&req_lock);
-        if (nr_live_reqs < NR_REQS)
+        if (nr_live_reqs < nr_reqs)
             break;
         spin_unlock(&req_lock);
-        wait_event(req_wq, (nr_live_reqs < NR_REQS));
+        wait_event(req_wq, (nr_live_reqs < nr_reqs));
     }
 
     o_probe = probe;
@@ -345,12 +347,12 @@ static int allocate_xenbus_id(void)
     {
         if (!req_info[o_probe].in_use)
             break;
-        o_probe = (o_probe + 1) % NR_REQS;
+        o_probe = (o_probe + 1) % nr_reqs;
         BUG_ON(o_probe == probe);
     }
     nr_live_reqs++;
     req_info[o_probe].in_use = 1;
-    probe = (o_probe + 1) % NR_REQS;
+    probe = (o_probe + 1) % nr_reqs;
     spin_unlock(&req_lock);
     init_waitqueue_head(&req_info[o_probe].waitq);
 
@@ -362,9 +364,17 @@ void init_xenbus(void)
 {
     int err;
     DEBUG("init_xenbus called.\n");
-    create_thread("xenstore", xenbus_thread_func, NULL);
+    nr_reqs = get_boot_param("xenbus_reqs", NR_REQS);
+    if (!nr_reqs)
+        nr_reqs = 1;
+    req_info = xzalloc_array(struct xenbus_req_info, nr_reqs);
+    BUG_ON(!req_info);
+    /* Replies are waited for by everyone else: run ahead of them. */
+    create_thread_ex("xenstore", xenbus_thread_func, NULL, STACK_SIZE,
+                     SCHED_PRIO_DEFAULT + 1);
     DEBUG("buf at %p.\n", xenstore_buf);
     err = bind_evtchn(xenbus_evtchn, xenbus_evtchn_handler, NULL);
+    BUG_ON(err < 0);
     unmask_evtchn(xenbus_evtchn);
     printk("xenbus initialised on irq %d\n", err);
 }